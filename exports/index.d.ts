@@ -16,7 +16,13 @@ export type FileEvent =
 	| 'delR'
 	
 	/** Local file is deleted */
-	| 'delL';
+	| 'delL'
+
+	/** Remote file is moved. Renamed on local, see {@link FileInfo.from} */
+	| 'movR'
+
+	/** Local file is moved. Renamed on remote, see {@link FileInfo.from} */
+	| 'movL';
 
 /** File type enum */
 export type FileType = 
@@ -49,6 +55,174 @@ export enum ErrorType {
 	Sftp = 3
 }
 
+/**
+ * Synchronization direction
+ *  - `bidirectional` : changes on both sides are synchronized
+ *  - `download` : remote is mirrored to local
+ *  - `upload` : local is mirrored to remote
+ */
+export type SyncMode = 'bidirectional' | 'download' | 'upload';
+
+/**
+ * How modified files are detected. 'hash' also compares content of files with
+ * the same size before transferring them, so files with new mtime and the same
+ * content only get their times and permission updated.
+ */
+export type CompareMode = 'mtime' | 'hash';
+
+/**
+ * Transfer scheduling. Directories are always created first. Files are
+ * ordered by the first matching pattern, then by {@link Priority.order}.
+ * With {@link Priority.largeFileSize} set, small and large files are
+ * interleaved, so small files aren't delayed by a bulk of large files.
+ */
+export interface Priority {
+	/** Glob patterns, the first one has the highest priority. `*` and `?`
+	 * don't match `/`, `**` matches any directories. Patterns without `/`
+	 * are matched against the file name only
+	*/
+	patterns?: string[];
+
+	/** Order of files with the same priority
+	 * @defaultValue 'scan'
+	*/
+	order?: 'scan' | 'smallest' | 'oldest';
+
+	/** Files of this size in bytes or larger are large files. 0 to disable
+	 * interleaving
+	 * @defaultValue 0
+	*/
+	largeFileSize?: number;
+
+	/** Number of small files transferred before each large file
+	 * @defaultValue 8
+	*/
+	smallPerLarge?: number;
+}
+
+/**
+ * Block delta transfer of modified files. Needs exec channel on the server
+ */
+export interface Delta {
+	/** Modified files of this size in bytes or larger only transfer changed
+	 * blocks. 0 to disable
+	 * @defaultValue 0
+	*/
+	minSize?: number;
+
+	/** Block size in bytes. Blocks are compared at the same offset only
+	 * @defaultValue 1048576
+	*/
+	blockSize?: number;
+
+	/** Remote command printing a sha256sum line for each block. `{block}` is
+	 * replaced by block size, and `{path}` by quoted file path
+	 * @defaultValue 'split -b {block} --filter=sha256sum -- {path}'
+	*/
+	command?: string;
+}
+
+/**
+ * Small files transferred as tar archives. Needs exec channel and tar on the
+ * server
+ */
+export interface Batch {
+	/** Files of this size in bytes or smaller are transferred in batches.
+	 * 0 to disable
+	 * @defaultValue 0
+	*/
+	maxSize?: number;
+
+	/** Maximum number of files in one batch
+	 * @defaultValue 256
+	*/
+	maxFiles?: number;
+
+	/** Maximum total size in bytes of files in one batch
+	 * @defaultValue 16777216
+	*/
+	maxBytes?: number;
+}
+
+/**
+ * When downloaded files are flushed to disk, including delta and batch
+ * downloads. 'batch' flushes each local file system written to once after
+ * the downloads of each cycle, other platforms than Linux flush each file then
+ */
+export type FsyncPolicy = 'none' | 'file' | 'batch';
+
+/**
+ * Local writes of downloaded files. Preallocation, direct I/O and cache
+ * dropping are only available on Linux
+ */
+export interface Writer {
+	/** Size in bytes of each local write, rounded down to 4096
+	 * @defaultValue 1048576
+	*/
+	blockSize?: number;
+
+	/** Reserve the remote file size before writing, to avoid fragmentation
+	 * @defaultValue true
+	*/
+	preallocate?: boolean;
+
+	/** Write with O_DIRECT, bypassing page cache. Falls back to buffered
+	 * writes if the file system doesn't support it
+	 * @defaultValue false
+	*/
+	direct?: boolean;
+
+	/** Start writeback while downloading and drop written pages from page
+	 * cache, so large downloads don't evict other cached data
+	 * @defaultValue false
+	*/
+	dropCache?: boolean;
+
+	/** @defaultValue 'none' */
+	fsync?: FsyncPolicy;
+}
+
+/**
+ * SSH algorithm preferences, each a comma separated list in order of
+ * preference, e.g. 'aes128-gcm@openssh.com,aes128-ctr'. Unset lists keep
+ * libssh2 defaults
+ */
+export interface Algorithms {
+	/** Key exchange methods */
+	kex?: string;
+
+	/** Host key types */
+	hostkey?: string;
+
+	/** Ciphers of both directions. Candidates of
+	 * {@link Algorithms.rankByLocalCpu}
+	*/
+	cipher?: string;
+
+	/** MACs of both directions, unused by AEAD ciphers */
+	mac?: string;
+
+	/** Order candidate ciphers by their local OpenSSL throughput when
+	 * connecting. The server picks the first one it also supports. Without
+	 * `cipher`, all ciphers of libssh2 are candidates. Only local encryption
+	 * is measured, not the network or the server, so it helps only when the
+	 * client CPU limits transfers
+	 * @defaultValue false
+	*/
+	rankByLocalCpu?: boolean;
+}
+
+/**
+ * Pair of remote and local directories to be synchronized
+ */
+export interface Mapping {
+	/** Remote root directory path */
+	remotePath: string;
+
+	/** Local root directory path */
+	localPath: string;
+}
+
 /**
  * SFTP configuration
  */
@@ -61,11 +235,23 @@ export interface Config {
 	 */
 	port?: number;
 
-	/** Remote root directory path */
-	remotePath: string;
+	/** Remote root directory path. Required unless {@link Config.mappings}
+	 * is given, can't be combined with it.
+	*/
+	remotePath?: string;
 
-	/** Locale root directory path */
-	localPath: string;
+	/** Locale root directory path. Required unless {@link Config.mappings}
+	 * is given, can't be combined with it.
+	*/
+	localPath?: string;
+
+	/** Directory pairs synchronized by this instance, using the
+	 * same connection and thread. File events are tagged with the mapping
+	 * index, see {@link FileInfo.mapping}, which equals the index in this
+	 * array. Can't be combined with {@link Config.remotePath} and
+	 * {@link Config.localPath}.
+	*/
+	mappings?: Mapping[];
 
 	/** Username for auth */
 	username: string;
@@ -98,6 +284,150 @@ export interface Config {
 	 * @defaultValue 3
 	*/
 	maxErrCount?: number;
+
+	/** Run synchronization on threads shared by every instance in the process,
+	 * instead of a dedicated thread for this instance. On Linux, an instance
+	 * waiting for its socket or a callback is suspended, and sockets of all
+	 * instances on a thread are multiplexed with epoll.
+	 * @defaultValue false
+	*/
+	sharedEngine?: boolean;
+
+	/** Number of threads of the shared engine. Only used by the instance which
+	 * starts the shared engine, see {@link Config.sharedEngine}. 1 - 255.
+	 * @defaultValue 4
+	*/
+	engineThreads?: number;
+
+	/** Synchronization direction. In mirror modes, the destination side is not
+	 * scanned on each cycle. It's assumed to be unchanged since the last
+	 * synchronization, except on the first cycle and verification cycles, see
+	 * {@link Config.verifyEvery}. Destination changes found on those cycles
+	 * are overwritten by the source, and items which only exist on the
+	 * destination are left as is.
+	 * @defaultValue 'bidirectional'
+	*/
+	mode?: SyncMode;
+
+	/** Scan both sides every this many cycles in mirror modes, to find changes
+	 * made on the destination side. 0 to only scan it on the first cycle.
+	 * @defaultValue 0
+	*/
+	verifyEvery?: number;
+
+	/** Transfer order of new and modified files */
+	priority?: Priority;
+
+	/** Number of SFTP channels used to delete a remote directory tree, each
+	 * keeping up to 64 delete requests in flight. 1 to delete one item at a
+	 * time. Trees with less than 64 items are deleted on a single channel.
+	 * Entries without reply on timeout are reported as errors. Must be 1 - 255
+	 * @defaultValue 8
+	*/
+	deleteChannels?: number;
+
+	/** Treat grown files as append-only. When a file is larger than the copy
+	 * on the other side and this many trailing bytes of the old content are
+	 * the same on both sides, only the new tail is transferred. Useful for
+	 * log files. 0 to always transfer the whole file.
+	 * @defaultValue 0
+	*/
+	appendWindow?: number;
+
+	/** Transfer only changed blocks of modified files. Changed blocks are
+	 * written into a temporary copy which then replaces the file, falling back
+	 * to whole file transfer if it fails
+	*/
+	delta?: Delta;
+
+	/** Transfer small files in batches, each batch streamed as one tar
+	 * archive. Files which can't be transferred by the archive are
+	 * transferred one by one
+	*/
+	batch?: Batch;
+
+	/** Local writes of downloaded files */
+	writer?: Writer;
+
+	/** SSH algorithm preferences. Instances with different preferences
+	 * never share a connection
+	*/
+	algorithms?: Algorithms;
+
+	/** Change detection. In 'hash' mode, remote files are hashed with
+	 * sha256sum over exec, and local files rewritten within the same second
+	 * are detected by their sub-second mtime.
+	 * @defaultValue 'mtime'
+	*/
+	compare?: CompareMode;
+
+	/** File to keep content hashes between restarts, see
+	 * {@link Config.compare}. Hashes are only kept in memory if not set.
+	*/
+	hashCache?: string;
+
+	/** Size in bytes of each transfer buffer, the length passed to a single
+	 * libssh2 read or write call. libssh2 splits it into SFTP requests of up
+	 * to 30000 bytes and pipelines them, so larger buffers keep more requests
+	 * in flight. Buffers are page aligned and reused by all transfers of this
+	 * instance. Clamped to 4 KiB - 64 MiB. Limits advertised by the server
+	 * with limits@openssh.com aren't queried, libssh2 can't send SFTP
+	 * extended requests.
+	 * @defaultValue 30000
+	*/
+	bufferSize?: number;
+
+	/** Uploads of this size in bytes or larger are read by mmap, and written
+	 * from the mapping without copying. A file truncated by another process
+	 * during its upload crashes the process with SIGBUS. 0 to disable. Not
+	 * available on Windows.
+	 * @defaultValue 0
+	*/
+	mmapSize?: number;
+
+	/** Keep sparse files sparse. Holes of local files are skipped on upload,
+	 * and the remote file is extended to the full size. Downloaded blocks of
+	 * zeros are left as holes. SFTP can't tell where remote holes are, so
+	 * downloads still transfer the zeros, only local disk space is saved.
+	 * @defaultValue false
+	*/
+	sparse?: boolean;
+
+	/** Write transferred files into a hidden temporary file, then rename it
+	 * over the destination, so the destination is never seen half written.
+	 * Appended tails are still written in place, see
+	 * {@link Config.appendWindow}.
+	 * @defaultValue false
+	*/
+	staged?: boolean;
+
+	/** Directory of temporary files of staged downloads, instead of the
+	 * directory of each file. Must be on the same file system as the local
+	 * path
+	*/
+	stagingDir?: string;
+
+	/** Hash bytes while they are transferred and compare the digest with
+	 * sha256sum of the remote file over exec, after each group of transfers.
+	 * Mismatches are reported as errors of the files. Files transferred in
+	 * batches or by changed blocks aren't hashed.
+	 * @defaultValue false
+	*/
+	checksum?: boolean;
+
+	/** Reuse the SSH connection of other instances with the same host, port
+	 * and credentials. Each instance still opens its own SFTP channel, but
+	 * remote operations of the instances sharing the connection are
+	 * serialized.
+	 * @defaultValue false
+	*/
+	shareConnection?: boolean;
+
+	/** Enable tracing of sync phases and file operations with a ring buffer
+	 * of this many spans. See {@link SftpWatch.getTrace}.
+	 * @defaultValue 0 (disabled)
+	*/
+	traceSize?: number;
 }
 
 /**
@@ -122,8 +452,19 @@ export interface FileInfo {
 	/** File name */
 	name: string;
 
+	/** Previous file name, only for 'movR' and 'movL' events */
+	from?: string;
+
+	/** Hex SHA-256 of the transferred content, only on completed 'up' and
+	 * 'down' events when {@link Config.checksum} is enabled
+	*/
+	hash?: string;
+
 	/** File permissions in octal format */
 	perm: number;
+
+	/** Index of the mapping which the file belongs to */
+	mapping: number;
 }
 
 /**
@@ -143,6 +484,144 @@ export interface FileError {
 	path: string;
 }
 
+/**
+ * Size of each synchronization queue in the last cycle
+ */
+export interface QueueStats {
+	/** Local items queued for upload */
+	localNew: number;
+
+	/** Remote items queued for download */
+	remoteNew: number;
+
+	/** Items deleted on local, queued for deletion on remote */
+	localDel: number;
+
+	/** Items deleted on remote, queued for deletion on local */
+	remoteDel: number;
+}
+
+/**
+ * Runtime counters of synchronization process.
+ * Durations are in microseconds, other counters are totals since created.
+ */
+export interface SyncStats {
+	/** Number of finished synchronization cycles */
+	cycles: number;
+
+	/** Duration of the last cycle */
+	cycleUs: number;
+
+	/** Duration of local directories scan in the last cycle */
+	localScanUs: number;
+
+	/** Duration of remote directories scan in the last cycle */
+	remoteScanUs: number;
+
+	/** Number of local directories listed */
+	localDirs: number;
+
+	/** Number of remote directories listed */
+	remoteDirs: number;
+
+	/** Number of local entries listed */
+	localEntries: number;
+
+	/** Number of remote entries listed */
+	remoteEntries: number;
+
+	/** Queue sizes of the last cycle */
+	queue: QueueStats;
+
+	/** Uploaded bytes */
+	bytesUp: number;
+
+	/** Downloaded bytes */
+	bytesDown: number;
+
+	/** Number of successful file uploads */
+	uploads: number;
+
+	/** Number of successful file downloads */
+	downloads: number;
+
+	/** Number of items deleted on local */
+	localDels: number;
+
+	/** Number of items deleted on remote */
+	remoteDels: number;
+
+	/** Number of moved items applied as rename instead of transfers */
+	moves: number;
+
+	/** Number of transfers where only the appended tail was transferred */
+	appends: number;
+
+	/** Number of transfers where only changed blocks were transferred */
+	deltas: number;
+
+	/** Bytes not transferred because they were already the same */
+	bytesSaved: number;
+
+	/** Number of batches transferred as tar archive */
+	batches: number;
+
+	/** Number of files hashed for content compare, cached hashes excluded */
+	hashed: number;
+
+	/** Number of files with the same content, only attributes were updated */
+	attrSyncs: number;
+
+	/** Number of transferred files whose remote hash matched */
+	verified: number;
+
+	/** Number of successful reconnections */
+	reconnects: number;
+
+	/** Number of errors reported via 'error' event */
+	errors: number;
+
+	/** Number of remote requests skipped since the answer is already known
+	 * from snapshots */
+	roundTripsSaved: number;
+
+	/** {@link SyncStats.roundTripsSaved} of the last cycle */
+	cycleRoundTripsSaved: number;
+}
+
+/** Remote operation names whose latency is recorded */
+export type LatencyOp =
+	'openDir'
+	| 'readDir'
+	| 'getFilestat'
+	| 'setFilestat'
+	| 'openFile'
+	| 'mkdir'
+	| 'remove'
+	| 'rename'
+	| 'downFile'
+	| 'upFile';
+
+/**
+ * Latency distribution of a remote operation, in microseconds
+ */
+export interface LatencyStats {
+	/** Number of recorded operations */
+	count: number;
+
+	/** Fastest recorded operation */
+	min: number;
+
+	/** Slowest recorded operation */
+	max: number;
+
+	/** Average of recorded operations */
+	mean: number;
+
+	/** Values for requested percentiles, in the same order as requested */
+	percentiles: number[];
+}
+
 /**
  * Callback for synchronization data
  * @param info - synced file data
@@ -212,4 +691,52 @@ export default class SftpWatch {
 	 * @returns last error
 	 */
 	getError(): FileError;
+
+	/**
+	 * Get runtime counters of synchronization process.
+	 * Can be called while synchronization is running.
+	 * @returns current counters
+	 */
+	getStats(): SyncStats;
+
+	/**
+	 * Get latency distribution of each remote operation.
+	 * Values are approximated within ~6% relative error.
+	 * @param percentiles - requested percentiles.
+	 * Defaults to `[50, 90, 99, 99.9]`
+	 * @param reset - reset recorded values after reading, for interval reporting
+	 * @returns latency distribution for each operation
+	 */
+	getLatency(
+		percentiles?: number[],
+		reset?: boolean
+	): Record<LatencyOp, LatencyStats>;
+
+	/**
+	 * Enable or disable tracing of sync phases and file operations.
+	 * @param enabled - whether spans should be recorded
+	 * @param size - ring buffer size in spans. Defaults to {@link Config.traceSize}
+	 * or 65536. Recorded spans are discarded if the size is changed
+	 * @returns instance for SftpWatch, for chained methods
+	 */
+	setTrace(enabled: boolean, size?: number): this;
+
+	/**
+	 * Get recorded spans as Chrome trace-event JSON, which can be loaded in
+	 * Perfetto or chrome://tracing. Spans of each instance have their own
+	 * `tid`, so traces of several instances can be merged.
+	 * @param clear - discard recorded spans after reading
+	 * @returns trace-event JSON string
+	 */
+	getTrace(clear?: boolean): string;
+
+	/**
+	 * Start the next cycle immediately instead of waiting for
+	 * {@link Config.delayMs}. Useful when a file is known to be changed.
+	 * @param path - only check this subtree, relative to the root directories
+	 * as in {@link FileInfo.name}. The nearest known parent directory is
+	 * checked if the path is not a known directory. Check everything if empty
+	 * @returns false if synchronization is not running
+	 */
+	triggerSync(path?: string): boolean;
 }
@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "debug.hpp"
+#include "sftp_algo.hpp"
+
+/** data encrypted at once, about one SFTP packet */
+#define SNOD_ALGO_PACKET 32768U
+
+namespace { // start of unnamed namespace for static function
+
+typedef struct AlgoCipher_s {
+	const char* name;
+	const EVP_CIPHER* (*evp)();
+	bool is_aead; /**< no separate MAC */
+} AlgoCipher_t;
+
+static const AlgoCipher_t ciphers[] = {
+	{ "chacha20-poly1305@openssh.com", EVP_chacha20_poly1305, true },
+	{ "aes256-gcm@openssh.com", EVP_aes_256_gcm, true },
+	{ "aes128-gcm@openssh.com", EVP_aes_128_gcm, true },
+	{ "aes256-ctr", EVP_aes_256_ctr, false },
+	{ "aes192-ctr", EVP_aes_192_ctr, false },
+	{ "aes128-ctr", EVP_aes_128_ctr, false },
+};
+
+static std::mutex                    speed_mtx;
+static std::map<std::string, double> speed_list; /**< bytes per second */
+
+static std::vector<std::string> prv_split(const std::string& list)
+{
+	std::vector<std::string> res;
+	size_t                   pos = 0;
+
+	while (pos <= list.size()) {
+		size_t end = list.find(',', pos);
+		if (end == std::string::npos) end = list.size();
+
+		if (end > pos) res.push_back(list.substr(pos, end - pos));
+		pos = end + 1;
+	}
+
+	return res;
+}
+
+static const AlgoCipher_t* prv_find(const std::string& name)
+{
+	for (const AlgoCipher_t& cipher : ciphers) {
+		if (name == cipher.name) return &cipher;
+	}
+
+	return nullptr;
+}
+
+/** @return bytes per second, 0 if the cipher isn't available */
+static double prv_bench(const AlgoCipher_t* cipher)
+{
+	EVP_CIPHER_CTX* evp = EVP_CIPHER_CTX_new();
+	if (!evp) return 0;
+
+	std::vector<uint8_t> in(SNOD_ALGO_PACKET, 0x5a);
+	std::vector<uint8_t> out(SNOD_ALGO_PACKET + EVP_MAX_BLOCK_LENGTH);
+	uint8_t              key[EVP_MAX_KEY_LENGTH] = { 0 };
+	uint8_t              iv[EVP_MAX_IV_LENGTH]   = { 0 };
+	uint8_t              mac[EVP_MAX_MD_SIZE];
+	unsigned int         mac_len;
+	int                  len;
+	bool                 is_ok = true;
+
+	auto start = std::chrono::steady_clock::now();
+
+	if (!EVP_EncryptInit_ex(evp, cipher->evp(), NULL, key, iv)) is_ok = false;
+
+	// each packet gets its own nonce and tag, or its own HMAC
+	for (uint32_t done = 0; is_ok && done < SNOD_ALGO_BENCH_BYTES;
+		 done += SNOD_ALGO_PACKET) {
+		if (cipher->is_aead) {
+			is_ok = EVP_EncryptInit_ex(evp, NULL, NULL, NULL, iv)
+				&& EVP_EncryptUpdate(evp, out.data(), &len, in.data(),
+					SNOD_ALGO_PACKET)
+				&& EVP_EncryptFinal_ex(evp, out.data() + len, &len);
+		} else {
+			is_ok = EVP_EncryptUpdate(
+						evp, out.data(), &len, in.data(), SNOD_ALGO_PACKET)
+				&& HMAC(EVP_sha256(), key, 32, out.data(), SNOD_ALGO_PACKET,
+					mac, &mac_len);
+		}
+
+		iv[0]++;
+	}
+
+	auto end = std::chrono::steady_clock::now();
+
+	EVP_CIPHER_CTX_free(evp);
+
+	if (!is_ok) return 0;
+
+	double sec = std::chrono::duration<double>(end - start).count();
+
+	return SNOD_ALGO_BENCH_BYTES / std::max(sec, 1e-9);
+}
+
+static double prv_speed(const AlgoCipher_t* cipher)
+{
+	std::lock_guard<std::mutex> lock(speed_mtx);
+
+	auto found = speed_list.find(cipher->name);
+	if (found != speed_list.end()) return found->second;
+
+	double speed             = prv_bench(cipher);
+	speed_list[cipher->name] = speed;
+
+	LOG_DBG("Cipher %s: %.0f MB/s\n", cipher->name, speed / 1e6);
+
+	return speed;
+}
+
+} // end of unnamed namespace for static function
+
+std::string SftpAlgo::rank(LIBSSH2_SESSION* session, const std::string& ciphers)
+{
+	std::vector<std::string> names = prv_split(ciphers);
+
+	// all ciphers of libssh2, in its own order
+	if (names.empty()) {
+		const char** algs = nullptr;
+
+		int n = libssh2_session_supported_algs(
+			session, LIBSSH2_METHOD_CRYPT_CS, &algs);
+
+		for (int i = 0; i < n; i++) names.push_back(algs[i]);
+		if (algs) libssh2_free(session, algs);
+	}
+
+	std::vector<std::pair<double, std::string>> ranked;
+	std::vector<std::string>                    rest;
+
+	for (const std::string& name : names) {
+		const AlgoCipher_t* cipher = prv_find(name);
+		double              speed  = cipher ? prv_speed(cipher) : 0;
+
+		if (speed > 0) {
+			ranked.emplace_back(speed, name);
+		} else {
+			rest.push_back(name);
+		}
+	}
+
+	std::stable_sort(ranked.begin(), ranked.end(),
+		[](const auto& a, const auto& b) { return a.first > b.first; });
+
+	std::string res;
+
+	for (const auto& item : ranked) res += "," + item.second;
+	for (const auto& name : rest) res += "," + name;
+
+	return res.empty() ? res : res.substr(1);
+}
@@ -0,0 +1,36 @@
+#ifndef _SFTP_ALGO_HPP
+#define _SFTP_ALGO_HPP
+
+#include <string>
+
+#include <libssh2.h>
+
+/*
+ * Cipher ranking by local CPU. Candidate ciphers are benchmarked locally with
+ * OpenSSL, AEAD ciphers by themselves, others together with HMAC-SHA2-256, and
+ * the preference list is ordered from the fastest one. SSH key exchange picks
+ * the first client cipher which the server supports.
+ *
+ * Only local encryption speed is measured. Network, server CPU and libssh2
+ * overhead aren't, so the ranking helps only when the client CPU is what
+ * limits transfers.
+ * */
+
+/** bytes encrypted to benchmark one cipher */
+#ifndef SNOD_ALGO_BENCH_BYTES
+#	define SNOD_ALGO_BENCH_BYTES (4U * 1024U * 1024U)
+#endif
+
+namespace SftpAlgo {
+
+/**
+ * @brief order ciphers by local OpenSSL throughput. Results are measured once
+ * per process. Ciphers which can't be benchmarked keep their order at the end.
+ * @param ciphers comma separated candidates, empty for all supported ones
+ * @return comma separated preference list
+ * */
+std::string rank(LIBSSH2_SESSION* session, const std::string& ciphers);
+
+}
+
+#endif
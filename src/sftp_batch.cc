@@ -0,0 +1,324 @@
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+#if defined(_POSIX_VERSION)
+#	include <sys/stat.h>
+#	include <unistd.h>
+#	include <utime.h>
+#elif defined(_WIN32)
+#	include <sys/stat.h>
+#	include <sys/utime.h>
+#else
+#	error "UNKNOWN ENVIRONMENT"
+#endif
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "debug.hpp"
+#include "sftp_batch.hpp"
+#include "sftp_local.hpp"
+#include "sftp_remote.hpp"
+#include "sftp_tar.hpp"
+#include "sftp_writer.hpp"
+
+namespace { // start of unnamed namespace for static function
+
+typedef struct BatchDown_s {
+	SftpWatch_t*             ctx   = nullptr;
+	std::vector<DirItem_t*>* files = nullptr;
+	std::vector<int32_t>*    rcs   = nullptr;
+
+	std::unordered_map<std::string, size_t> index; /**< name to position */
+
+	FILE*       fd  = NULL;
+	size_t      cur = 0;    /**< position of the file being extracted */
+	std::string write_file; /**< staged copy, or the file itself */
+} BatchDown_t;
+
+static void prv_set_attrs(
+	SftpWatch_t* ctx, const std::string& local_file, DirItem_t* file)
+{
+	struct utimbuf times = {
+		.actime  = static_cast<time_t>(file->attrs.atime),
+		.modtime = static_cast<time_t>(file->attrs.mtime),
+	};
+
+	if (utime(local_file.c_str(), &times)) {
+		SftpLocal::set_error(ctx);
+		LOG_ERR("Failed to set mtime [%d]\n", errno);
+	}
+
+#ifdef _POSIX_VERSION
+	if (chmod(local_file.c_str(), SNOD_FILE_PERM(file->attrs))) {
+		SftpLocal::set_error(ctx);
+		LOG_ERR("Failed to set attributes: %d\n", errno);
+	}
+#endif
+}
+
+/** close the file being extracted, staged copy isn't left behind */
+static void prv_abort_file(BatchDown_t* batch)
+{
+	fclose(batch->fd);
+	batch->fd = NULL;
+
+	if (batch->ctx->staged) ::remove(batch->write_file.c_str());
+}
+
+static int32_t prv_down_entry(void* user, uint8_t evt, TarEntry_t* entry,
+	const char* data, size_t len)
+{
+	BatchDown_t* batch = static_cast<BatchDown_t*>(user);
+	SftpWatch_t* ctx   = batch->ctx;
+
+	switch (evt) {
+
+	case TAR_EVT_BEGIN: {
+		// only requested files are written, whatever the archive contains
+		auto it = batch->index.find(entry->name);
+		if (it == batch->index.end()) break;
+
+		/*
+		 * Archived entry is the second sample of the listed file. Changed one
+		 * is being written, it's left for single transfer which waits for it.
+		 * */
+		DirItem_t* file = (*batch->files)[it->second];
+		if (entry->size != file->attrs.filesize
+			|| entry->mtime != file->attrs.mtime) {
+			break;
+		}
+
+		std::string local_file
+			= ctx->root->local_path + SNOD_SEP + entry->name;
+
+		batch->cur        = it->second;
+		batch->write_file = ctx->staged
+			? SftpWatch::stage_path(ctx, local_file)
+			: local_file;
+
+		batch->fd = fopen(batch->write_file.c_str(), "wb");
+
+		if (!batch->fd) {
+			SftpLocal::set_error(ctx);
+			LOG_ERR("Error opening file '%s'!\n", batch->write_file.c_str());
+		}
+	} break;
+
+	case TAR_EVT_DATA: {
+		if (!batch->fd) break;
+
+		if (fwrite(data, 1, len, batch->fd) != len) {
+			SftpLocal::set_error(ctx);
+			prv_abort_file(batch);
+			break;
+		}
+
+		SNOD_STAT_ADD(ctx, bytes_down, len);
+	} break;
+
+	case TAR_EVT_END: {
+		if (!batch->fd) break;
+
+		// flushed as the fsync policy says, like files of #LocalWriter_t
+		bool is_synced = !fflush(batch->fd)
+			&& !SftpWriter::commit(ctx, fileno(batch->fd));
+
+		if (fclose(batch->fd) || !is_synced) {
+			batch->fd = NULL;
+			SftpLocal::set_error(ctx);
+			if (ctx->staged) ::remove(batch->write_file.c_str());
+			break;
+		}
+
+		batch->fd = NULL;
+
+		// archived content might be newer than the listed one
+		DirItem_t* file      = (*batch->files)[batch->cur];
+		file->attrs.filesize = entry->size;
+		file->attrs.mtime    = entry->mtime;
+
+		std::string local_file = ctx->root->local_path + SNOD_SEP + file->name;
+
+		prv_set_attrs(ctx, batch->write_file, file);
+
+		// staging directory must be on the same file system as the target
+		if (ctx->staged
+			&& ::rename(batch->write_file.c_str(), local_file.c_str())) {
+			SftpLocal::set_error(ctx);
+			LOG_ERR("Failed to replace file '%s'!\n", local_file.c_str());
+			::remove(batch->write_file.c_str());
+			break;
+		}
+
+		(*batch->rcs)[batch->cur] = 0;
+	} break;
+
+	default: {
+		// nothing to do
+	} break;
+	}
+
+	return 0;
+}
+
+/** read whole file, refreshing its attributes */
+static int32_t prv_read_file(SftpWatch_t* ctx, DirItem_t* file,
+	std::string& local_file, std::vector<char>* mem)
+{
+	LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+	if (SftpLocal::filestat(ctx, local_file, &attrs)) return -2;
+
+	memcpy(&file->attrs, &attrs, sizeof(attrs));
+
+	FILE* fd_local = fopen(local_file.c_str(), "rb");
+
+	if (!fd_local) {
+		SftpLocal::set_error(ctx);
+		LOG_ERR("Error opening file '%s'!\n", local_file.c_str());
+		return -2;
+	}
+
+	mem->resize(attrs.filesize);
+
+	size_t nread = fread(mem->data(), 1, mem->size(), fd_local);
+
+	// file is being written, leave it for single transfer which waits for it
+	bool is_stable = nread == mem->size() && fgetc(fd_local) == EOF;
+
+	fclose(fd_local);
+
+	return is_stable ? 0 : -2;
+}
+
+} // end of unnamed namespace for static function
+
+bool SftpBatch::fits(SftpWatch_t* ctx, DirItem_t* file)
+{
+	if (file->type != IS_REG_FILE) return false;
+	if (!ctx->batch.max_size) return false;
+
+	return file->attrs.filesize <= ctx->batch.max_size;
+}
+
+int32_t SftpBatch::down(SftpWatch_t* ctx, std::vector<DirItem_t*>& files,
+	std::vector<int32_t>* rcs)
+{
+	BatchDown_t batch;
+
+	batch.ctx   = ctx;
+	batch.files = &files;
+	batch.rcs   = rcs;
+
+	rcs->assign(files.size(), -1);
+
+	// names are read from standard input, command line length is limited
+	std::string cmd = "cd " + SftpRemote::quote(ctx->root->remote_path);
+	cmd += " && tar -cf - --null -T -";
+
+	std::string names;
+
+	for (size_t i = 0; i < files.size(); i++) {
+		names += files[i]->name;
+		names += '\0';
+		batch.index[files[i]->name] = i;
+	}
+
+	LIBSSH2_CHANNEL* channel = nullptr;
+
+	int32_t rc = SftpRemote::exec_open(ctx, cmd, &channel);
+	if (rc) return rc;
+
+	// names of a batch fit in the channel window, so output isn't read yet
+	rc = SftpRemote::exec_write(ctx, channel, names.data(), names.size());
+	if (!rc) rc = SftpRemote::exec_eof(ctx, channel);
+
+	bool is_eof = !rc;
+
+	TarReader_t         rd;
+	SftpPool::PoolBuf_t buf(&ctx->buffers);
+
+	if (!buf.mem) rc = -1;
+
+	while (!rc && !rd.is_end) {
+		ssize_t nread
+			= SftpRemote::exec_read(ctx, channel, buf.mem, buf.size);
+
+		// end of output before end of archive is an error as well
+		if (nread <= 0) {
+			rc = nread ? static_cast<int32_t>(nread) : -1;
+			break;
+		}
+
+		rc = SftpTar::feed(&rd, buf.mem, static_cast<size_t>(nread),
+			prv_down_entry, &batch);
+	}
+
+	// archive is broken in the middle of a file
+	if (batch.fd) prv_abort_file(&batch);
+
+	// non zero exit status if some files couldn't be archived
+	int32_t exit_rc = SftpRemote::exec_close(ctx, channel, is_eof);
+
+	return rc ? rc : exit_rc;
+}
+
+int32_t SftpBatch::up(SftpWatch_t* ctx, std::vector<DirItem_t*>& files,
+	std::vector<int32_t>* rcs)
+{
+	rcs->assign(files.size(), -1);
+
+	std::string cmd = "cd " + SftpRemote::quote(ctx->root->remote_path);
+	cmd += " && tar -xpf -";
+
+	LIBSSH2_CHANNEL* channel = nullptr;
+
+	int32_t rc = SftpRemote::exec_open(ctx, cmd, &channel);
+	if (rc) return rc;
+
+	std::vector<char> mem;
+
+	for (size_t i = 0; !rc && i < files.size(); i++) {
+		DirItem_t*  file       = files[i];
+		std::string local_file = ctx->root->local_path + SNOD_SEP + file->name;
+
+		if (prv_read_file(ctx, file, local_file, &mem)) continue;
+
+		std::string header = SftpTar::header(file->name, mem.size(),
+			SNOD_FILE_PERM(file->attrs), file->attrs.mtime);
+		std::string pad(SftpTar::padding(mem.size()), '\0');
+
+		rc = SftpRemote::exec_write(ctx, channel, header.data(), header.size());
+		if (rc) break;
+
+		rc = SftpRemote::exec_write(ctx, channel, mem.data(), mem.size());
+		if (rc) break;
+
+		rc = SftpRemote::exec_write(ctx, channel, pad.data(), pad.size());
+		if (rc) break;
+
+		SNOD_STAT_ADD(ctx, bytes_up, mem.size());
+		(*rcs)[i] = 0;
+	}
+
+	if (!rc) {
+		std::string trailer = SftpTar::trailer();
+
+		rc = SftpRemote::exec_write(
+			ctx, channel, trailer.data(), trailer.size());
+	}
+
+	int32_t exit_rc = SftpRemote::exec_close(ctx, channel);
+	if (!rc) rc = exit_rc;
+
+	// unknown which files have been extracted, send all of them again
+	if (rc) rcs->assign(files.size(), rc);
+
+	return rc;
+}
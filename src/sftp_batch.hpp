@@ -0,0 +1,46 @@
+#ifndef _SFTP_BATCH_HPP
+#define _SFTP_BATCH_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "sftp_watch.hpp"
+
+/*
+ * Small file batching. Instead of open, read, close and stat requests for
+ * each file, a batch of files is streamed as one tar archive by tar running
+ * over exec channel. Downloaded archive is extracted while it's received,
+ * uploaded archive is built while it's sent.
+ *
+ * Files missing in the archive, downloaded files changed since they were
+ * listed, or the whole batch if the archive fails, are left to be transferred
+ * one by one.
+ * */
+
+namespace SftpBatch {
+
+/**
+ * @brief whether the file is small enough. Downloaded file which has changed
+ * since it was listed is left out of the archive, see #SftpBatch::down
+ * */
+bool fits(SftpWatch_t* ctx, DirItem_t* file);
+
+/**
+ * @brief download files as one archive.
+ * @param rcs result of each file, 0 if it has been transferred
+ * @return 0 if the archive has been transferred completely
+ * */
+int32_t down(SftpWatch_t* ctx, std::vector<DirItem_t*>& files,
+	std::vector<int32_t>* rcs);
+
+/**
+ * @brief upload files as one archive.
+ * @param rcs result of each file, 0 if it has been transferred
+ * @return 0 if the archive has been transferred completely
+ * */
+int32_t up(SftpWatch_t* ctx, std::vector<DirItem_t*>& files,
+	std::vector<int32_t>* rcs);
+
+}
+
+#endif
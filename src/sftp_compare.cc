@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "debug.hpp"
+#include "sftp_batch.hpp"
+#include "sftp_compare.hpp"
+#include "sftp_hash.hpp"
+#include "sftp_remote.hpp"
+
+namespace { // start of unnamed namespace for static function
+
+static DirItem_t* prv_counterpart(
+	SftpWatch_t* ctx, DirItem_t* item, bool is_down)
+{
+	DirSnapshot_t& snap
+		= is_down ? ctx->root->local_snap : ctx->root->remote_snap;
+
+	size_t      pos    = item->name.find_last_of(SNOD_SEP_CHAR);
+	std::string parent = (pos == std::string::npos)
+		? std::string(SNOD_SEP)
+		: SNOD_SEP + item->name.substr(0, pos);
+
+	auto dir = snap.find(parent);
+	if (dir == snap.end()) return nullptr;
+
+	auto it = dir->second.find(item->name);
+	if (it == dir->second.end()) return nullptr;
+
+	// different size is different content, no need to hash
+	DirItem_t* other = &it->second;
+	if (other->type != IS_REG_FILE) return nullptr;
+	if (other->attrs.filesize != item->attrs.filesize) return nullptr;
+
+	return other;
+}
+
+static std::string prv_key(SyncRoot_t* root, DirItem_t* file, bool is_local)
+{
+	if (is_local) return "L" + root->local_path + SNOD_SEP + file->name;
+
+	return "R" + root->remote_path + SNOD_SEP + file->name;
+}
+
+static bool prv_lookup(
+	SftpWatch_t* ctx, DirItem_t* file, bool is_local, std::string* hash)
+{
+	HashCache_t* cache = &ctx->hash_cache;
+
+	auto it = cache->entries.find(prv_key(ctx->root, file, is_local));
+	if (it == cache->entries.end()) return false;
+
+	const HashEntry_t& entry = it->second;
+
+	// file has been changed since it was hashed
+	if (entry.size != file->attrs.filesize || entry.mtime != file->attrs.mtime
+		|| entry.mtime_nsec != file->mtime_nsec || entry.ino != file->ino) {
+		return false;
+	}
+
+	*hash = entry.hash;
+
+	return true;
+}
+
+static void prv_store(SftpWatch_t* ctx, DirItem_t* file, bool is_local,
+	const std::string& hash)
+{
+	HashEntry_t& entry
+		= ctx->hash_cache.entries[prv_key(ctx->root, file, is_local)];
+
+	entry.size       = file->attrs.filesize;
+	entry.mtime      = file->attrs.mtime;
+	entry.mtime_nsec = file->mtime_nsec;
+	entry.ino        = file->ino;
+	entry.hash       = hash;
+
+	ctx->hash_cache.is_dirty = true;
+}
+
+/** drop entries of files which are in none of the snapshots anymore */
+static void prv_prune(SftpWatch_t* ctx)
+{
+	std::unordered_set<std::string> keys;
+
+	for (SyncRoot_t& root : ctx->roots) {
+		for (auto& [dir, contents] : root.local_snap) {
+			for (auto& [path, item] : contents) {
+				keys.insert(prv_key(&root, &item, true));
+			}
+		}
+
+		for (auto& [dir, contents] : root.remote_snap) {
+			for (auto& [path, item] : contents) {
+				keys.insert(prv_key(&root, &item, false));
+			}
+		}
+	}
+
+	auto& entries = ctx->hash_cache.entries;
+
+	for (auto it = entries.begin(); it != entries.end();) {
+		if (keys.contains(it->first)) {
+			++it;
+		} else {
+			it = entries.erase(it);
+		}
+	}
+}
+
+static std::string prv_local_hash(SftpWatch_t* ctx, DirItem_t* file)
+{
+	std::string hash;
+
+	if (prv_lookup(ctx, file, true, &hash)) return hash;
+
+	std::string local_file = ctx->root->local_path + SNOD_SEP + file->name;
+
+	FILE* fd = fopen(local_file.c_str(), "rb");
+	if (!fd) return "";
+
+	hash = SftpHash::file(fd, 0, file->attrs.filesize);
+
+	// file has grown since it was listed
+	if (fgetc(fd) != EOF) hash.clear();
+
+	fclose(fd);
+
+	if (hash.empty()) return "";
+
+	SNOD_STAT_ADD(ctx, hashed, 1);
+	prv_store(ctx, file, true, hash);
+
+	return hash;
+}
+
+/**
+ * @brief hash remote files with one command.
+ * @param hashes hash of each file. Empty if the file couldn't be hashed
+ * @return 0 on success, or result of the command
+ * */
+static int32_t prv_remote_run(SftpWatch_t* ctx, std::vector<DirItem_t*>& files,
+	std::vector<std::string>* hashes)
+{
+	std::unordered_map<std::string, size_t> paths;
+	std::string                             cmd = SNOD_HASH_CMD;
+
+	hashes->assign(files.size(), "");
+
+	if (ctx->no_remote_hash) return -1;
+
+	for (size_t i = 0; i < files.size(); i++) {
+		std::string path = ctx->root->remote_path + SNOD_SEP + files[i]->name;
+
+		cmd += " " + SftpRemote::quote(path);
+		paths[path] = i;
+	}
+
+	// missing files only fail their own lines, others are still printed
+	std::string out;
+	int32_t     rc = SftpRemote::exec(ctx, cmd, &out);
+
+	// exec isn't allowed or command not found, don't try it again until
+	// reconnected. Other errors may be transient
+	if (rc == SNOD_HASH_NO_CMD || rc == LIBSSH2_ERROR_CHANNEL_FAILURE
+		|| rc == LIBSSH2_ERROR_CHANNEL_REQUEST_DENIED) {
+		LOG_ERR("Remote hash command is unavailable [%d]\n", rc);
+		ctx->no_remote_hash = true;
+		return rc;
+	}
+
+	if (rc < 0) return rc;
+
+	size_t pos = 0;
+
+	while (pos < out.size()) {
+		size_t end = out.find('\n', pos);
+		if (end == std::string::npos) end = out.size();
+
+		std::string line = out.substr(pos, end - pos);
+		pos              = end + 1;
+
+		// escaped names start with backslash, they are transferred instead
+		if (line.size() <= SNOD_HASH_HEX_LEN + 2) continue;
+		if (!SftpHash::is_hex(line)) continue;
+
+		auto it = paths.find(line.substr(SNOD_HASH_HEX_LEN + 2));
+		if (it == paths.end()) continue;
+
+		std::string hash = line.substr(0, SNOD_HASH_HEX_LEN);
+		std::transform(hash.begin(), hash.end(), hash.begin(),
+			[](unsigned char c) { return std::tolower(c); });
+
+		SNOD_STAT_ADD(ctx, hashed, 1);
+		(*hashes)[it->second] = hash;
+	}
+
+	return 0;
+}
+
+/** hash remote files with one command, and put results into cache */
+static void prv_remote_hash(SftpWatch_t* ctx, std::vector<DirItem_t*>& files)
+{
+	std::vector<std::string> hashes;
+
+	prv_remote_run(ctx, files, &hashes);
+
+	for (size_t i = 0; i < files.size(); i++) {
+		if (!hashes[i].empty()) prv_store(ctx, files[i], false, hashes[i]);
+	}
+}
+
+} // end of unnamed namespace for static function
+
+void SftpCompare::prefetch(
+	SftpWatch_t* ctx, std::vector<DirItem_t*>& items, bool is_down)
+{
+	if (ctx->compare != SNOD_COMPARE_HASH) return;
+
+	SftpCompare::load(ctx);
+
+	std::vector<DirItem_t*> files;
+	std::string             hash;
+
+	for (DirItem_t* item : items) {
+		if (item->type != IS_REG_FILE) continue;
+
+		DirItem_t* other = prv_counterpart(ctx, item, is_down);
+		if (!other) continue;
+
+		DirItem_t* remote = is_down ? item : other;
+		if (prv_lookup(ctx, remote, false, &hash)) continue;
+
+		files.push_back(remote);
+
+		if (files.size() >= SNOD_BATCH_FILES) {
+			prv_remote_hash(ctx, files);
+			files.clear();
+		}
+	}
+
+	if (!files.empty()) prv_remote_hash(ctx, files);
+}
+
+bool SftpCompare::is_same(SftpWatch_t* ctx, DirItem_t* item, bool is_down)
+{
+	if (ctx->compare != SNOD_COMPARE_HASH) return false;
+	if (item->type != IS_REG_FILE) return false;
+
+	SftpCompare::load(ctx);
+
+	DirItem_t* other = prv_counterpart(ctx, item, is_down);
+	if (!other) return false;
+
+	DirItem_t* local  = is_down ? other : item;
+	DirItem_t* remote = is_down ? item : other;
+
+	std::string remote_hash;
+
+	if (!prv_lookup(ctx, remote, false, &remote_hash)) {
+		std::vector<DirItem_t*> files = { remote };
+
+		prv_remote_hash(ctx, files);
+		if (!prv_lookup(ctx, remote, false, &remote_hash)) return false;
+	}
+
+	return prv_local_hash(ctx, local) == remote_hash;
+}
+
+int32_t SftpCompare::verify(SftpWatch_t* ctx, std::vector<DirItem_t*>& files,
+	std::vector<DirItem_t*>* bad)
+{
+	std::vector<std::string> hashes;
+
+	int32_t rc = prv_remote_run(ctx, files, &hashes);
+	if (rc) return rc;
+
+	for (size_t i = 0; i < files.size(); i++) {
+		// changed or removed since it has been transferred
+		if (hashes[i].empty()) continue;
+
+		if (hashes[i] == files[i]->hash) {
+			SNOD_STAT_ADD(ctx, verified, 1);
+		} else {
+			bad->push_back(files[i]);
+		}
+	}
+
+	return 0;
+}
+
+void SftpCompare::load(SftpWatch_t* ctx)
+{
+	HashCache_t* cache = &ctx->hash_cache;
+
+	if (cache->is_loaded) return;
+	cache->is_loaded = true;
+
+	if (cache->path.empty()) return;
+
+	FILE* fd = fopen(cache->path.c_str(), "rb");
+	if (!fd) return;
+
+	std::string content;
+	char        mem[SFTP_READ_BUFFER_SIZE];
+	size_t      nread;
+
+	while ((nread = fread(mem, 1, sizeof(mem), fd)) > 0) {
+		content.append(mem, nread);
+	}
+
+	fclose(fd);
+
+	// "<hash> <size> <mtime> <mtime_nsec> <ino> <key>" per line
+	size_t pos = 0;
+
+	while (pos < content.size()) {
+		size_t end = content.find('\n', pos);
+		if (end == std::string::npos) end = content.size();
+
+		std::string line = content.substr(pos, end - pos);
+		pos              = end + 1;
+
+		if (!SftpHash::is_hex(line)) continue;
+
+		HashEntry_t entry;
+		const char* ptr = line.c_str() + SNOD_HASH_HEX_LEN;
+		char*       next;
+
+		entry.hash       = line.substr(0, SNOD_HASH_HEX_LEN);
+		entry.size       = strtoull(ptr, &next, 10);
+		entry.mtime      = strtoull(next, &next, 10);
+		entry.mtime_nsec = static_cast<uint32_t>(strtoul(next, &next, 10));
+		entry.ino        = strtoull(next, &next, 10);
+
+		if (*next != ' ' || !next[1]) continue;
+
+		cache->entries[next + 1] = entry;
+	}
+}
+
+void SftpCompare::save(SftpWatch_t* ctx)
+{
+	HashCache_t* cache = &ctx->hash_cache;
+
+	if (!cache->is_dirty || cache->path.empty()) return;
+
+	prv_prune(ctx);
+
+	// replace the old cache at once, so it's never read half written
+	std::string temp_file = cache->path + SNOD_TEMP_SUFFIX;
+
+	FILE* fd = fopen(temp_file.c_str(), "wb");
+
+	if (!fd) {
+		LOG_ERR("Unable to write hash cache '%s'\n", temp_file.c_str());
+		return;
+	}
+
+	for (const auto& [key, entry] : cache->entries) {
+		if (key.find('\n') != std::string::npos) continue;
+
+		fprintf(fd, "%s %llu %llu %u %llu %s\n", entry.hash.c_str(),
+			static_cast<unsigned long long>(entry.size),
+			static_cast<unsigned long long>(entry.mtime), entry.mtime_nsec,
+			static_cast<unsigned long long>(entry.ino), key.c_str());
+	}
+
+	bool is_written = fclose(fd) == 0;
+
+	if (is_written && !rename(temp_file.c_str(), cache->path.c_str())) {
+		cache->is_dirty = false;
+	} else {
+		LOG_ERR("Unable to write hash cache '%s'\n", cache->path.c_str());
+		remove(temp_file.c_str());
+	}
+}
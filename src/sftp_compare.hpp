@@ -0,0 +1,65 @@
+#ifndef _SFTP_COMPARE_HPP
+#define _SFTP_COMPARE_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "sftp_watch.hpp"
+
+/*
+ * Content hash compare of modified files.
+ *
+ * Size and mtime only have one second resolution on SFTP v3. Touched files
+ * and restored backups get new mtime with the same content, which would be
+ * transferred again. In hash compare mode, a queued regular file having the
+ * same size as the other side is hashed on both sides first, and same content
+ * only gets its times and permission updated.
+ *
+ * Local files are hashed while being read, remote files by sha256sum over
+ * exec channel. The same command verifies transferred files, which are hashed
+ * while their bytes are transferred, see #SftpWatch_t::checksum.
+ *
+ * Hashes are cached by path, size, mtime and inode, so a file is only hashed
+ * again once it has been changed. The cache can be kept in a file, to be
+ * reused after restart.
+ * */
+
+/** remote hash command, followed by quoted paths. Prints sha256sum lines */
+#ifndef SNOD_HASH_CMD
+#	define SNOD_HASH_CMD "sha256sum --"
+#endif
+
+/** exit status of shell when the command isn't found */
+#define SNOD_HASH_NO_CMD 127
+
+/** custom error code of transferred file with different remote hash */
+#define SNOD_HASH_MISMATCH 1
+
+namespace SftpCompare {
+
+/** hash remote counterparts of queued files, many files per command */
+void prefetch(SftpWatch_t* ctx, std::vector<DirItem_t*>& items, bool is_down);
+
+/**
+ * @brief check whether queued file has the same content as the other side.
+ * Always false unless hash compare mode is selected.
+ * */
+bool is_same(SftpWatch_t* ctx, DirItem_t* item, bool is_down);
+
+/**
+ * @brief compare hashes computed while transferring with the remote files.
+ * @param bad files with different remote hash
+ * @return 0 on success, non zero if remote hash is unavailable
+ * */
+int32_t verify(SftpWatch_t* ctx, std::vector<DirItem_t*>& files,
+	std::vector<DirItem_t*>* bad);
+
+/** read hash cache from its file, only once. Invalid lines are skipped */
+void load(SftpWatch_t* ctx);
+
+/** write hash cache into its file, if it has been changed */
+void save(SftpWatch_t* ctx);
+
+}
+
+#endif
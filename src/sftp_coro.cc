@@ -0,0 +1,96 @@
+#include <cerrno>
+#include <unordered_set>
+
+#include "debug.hpp"
+#include "sftp_coro.hpp"
+#include "sftp_engine.hpp"
+
+#if defined(_POSIX_VERSION)
+#	include <poll.h>
+#elif defined(_WIN32)
+#	include <winsock2.h>
+
+#	define poll WSAPoll
+#else
+#	error "UNKNOWN ENVIRONMENT"
+#endif
+
+void SftpCoro::Reactor::spawn(Task& task)
+{
+	ready.push_back(task.handle);
+}
+
+void SftpCoro::Reactor::park(Pending* op)
+{
+	parked.push_back(op);
+}
+
+int32_t SftpCoro::Reactor::run(int32_t timeout_ms)
+{
+	std::vector<struct pollfd> pfds;
+	std::vector<Pending*>      waiting;
+
+	while (1) {
+		while (!ready.empty()) {
+			std::coroutine_handle<> h = ready.front();
+			ready.pop_front();
+			h.resume();
+		}
+
+		if (parked.empty()) return 0;
+
+		// operations which aren't blocked by socket can be retried right away
+		bool has_unblocked = false;
+
+		pfds.clear();
+		for (Pending* op : parked) {
+			struct pollfd pfd = {
+				.fd      = op->chan->sock,
+				.events  = 0,
+				.revents = 0,
+			};
+
+			int32_t dir = libssh2_session_block_directions(op->chan->session);
+
+			if (dir & LIBSSH2_SESSION_BLOCK_INBOUND) pfd.events |= POLLIN;
+			if (dir & LIBSSH2_SESSION_BLOCK_OUTBOUND) pfd.events |= POLLOUT;
+			if (!pfd.events) has_unblocked = true;
+
+			pfds.push_back(pfd);
+		}
+
+		int32_t rc = SftpEngine::poll(
+			pfds.data(), pfds.size(), has_unblocked ? 0 : timeout_ms);
+
+		if (rc < 0) {
+			LOG_ERR("Reactor poll failed %d\n", errno);
+			return -errno;
+		}
+
+		if (rc == 0 && !has_unblocked) return LIBSSH2_ERROR_TIMEOUT;
+
+		/*
+		 * libssh2 reads every incoming packet of a session when any operation
+		 * of that session is retried, and queues it for its channel. So, a
+		 * ready socket means every operation on that session must be retried,
+		 * otherwise an already queued reply would wait for the next packet.
+		 * */
+		std::unordered_set<LIBSSH2_SESSION*> active;
+		for (size_t i = 0; i < pfds.size(); i++) {
+			if (pfds[i].revents || !pfds[i].events) {
+				active.insert(parked[i]->chan->session);
+			}
+		}
+
+		waiting.clear();
+		waiting.swap(parked);
+
+		for (Pending* op : waiting) {
+			if (active.contains(op->chan->session) && op->try_again()) {
+				ready.push_back(op->handle);
+			} else {
+				parked.push_back(op);
+			}
+		}
+	}
+}
@@ -0,0 +1,284 @@
+#ifndef _SFTP_CORO_HPP
+#define _SFTP_CORO_HPP
+
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+/*
+ * Coroutine layer for non-blocking libssh2 operations.
+ *
+ * Each operation is an awaitable which calls libssh2 once. When libssh2
+ * returns EAGAIN, the coroutine is suspended and parked on the Reactor until
+ * the session socket is ready, then the same libssh2 call is retried. This way
+ * a single thread can drive many concurrent operations by spawning a coroutine
+ * for each of them and calling Reactor::run().
+ *
+ * NOTE: libssh2 keeps the state of non-blocking calls per SFTP channel, except
+ *       for read, write, readdir and close which are kept per handle. Thus
+ *       concurrent coroutines must not run channel-level operations (open,
+ *       stat, unlink, etc.) on the same Channel at the same time. Use a
+ *       separate Channel for each coroutine instead.
+ * */
+
+namespace SftpCoro {
+
+class Reactor;
+
+/** SFTP channel driven by a Reactor */
+typedef struct Channel_s {
+	Reactor*         reactor = nullptr;
+	LIBSSH2_SESSION* session = nullptr;
+	LIBSSH2_SFTP*    sftp    = nullptr;
+	libssh2_socket_t sock    = LIBSSH2_INVALID_SOCKET;
+} Channel_t;
+
+/** Operation waiting for its socket to be ready */
+struct Pending {
+	Channel_t*              chan = nullptr;
+	std::coroutine_handle<> handle;
+
+	/** retry the operation. Returns true if it's no longer EAGAIN */
+	virtual bool try_again() = 0;
+
+	virtual ~Pending() { }
+};
+
+/** Coroutine returning status code, as other functions in this library */
+class Task {
+public:
+	struct promise_type {
+		int32_t                 result = 0;
+		std::coroutine_handle<> continuation;
+
+		struct FinalAwaiter {
+			bool await_ready() noexcept { return false; }
+			void await_resume() noexcept { }
+
+			std::coroutine_handle<> await_suspend(
+				std::coroutine_handle<promise_type> h) noexcept
+			{
+				std::coroutine_handle<> next = h.promise().continuation;
+				return next ? next : std::noop_coroutine();
+			}
+		};
+
+		Task get_return_object()
+		{
+			return Task(
+				std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		FinalAwaiter        final_suspend() noexcept { return {}; }
+		void                return_value(int32_t rc) { result = rc; }
+		void                unhandled_exception() { std::terminate(); }
+	};
+
+	typedef std::coroutine_handle<promise_type> Handle_t;
+
+	Task(Handle_t h)
+		: handle(h)
+	{
+		// empty constructor
+	}
+
+	Task(Task&& other) noexcept
+		: handle(std::exchange(other.handle, nullptr))
+	{
+		// empty constructor
+	}
+
+	Task(const Task&)            = delete;
+	Task& operator=(const Task&) = delete;
+
+	~Task()
+	{
+		if (handle) handle.destroy();
+	}
+
+	bool    done() const { return !handle || handle.done(); }
+	int32_t result() const { return handle.promise().result; }
+
+	/** awaiting a task starts it and resumes the caller once it's finished */
+	bool await_ready() const noexcept { return done(); }
+	int32_t await_resume() const { return result(); }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+	{
+		handle.promise().continuation = caller;
+		return handle;
+	}
+
+	Handle_t handle;
+};
+
+class Reactor {
+public:
+	/** queue the task to be started on the next run() */
+	void spawn(Task& task);
+
+	/** park an operation until its socket is ready */
+	void park(Pending* op);
+
+	/**
+	 * @brief drive all spawned tasks until they are finished.
+	 * @return 0 on success, LIBSSH2_ERROR_TIMEOUT if no socket is ready within
+	 * timeout_ms, or negative errno if polling failed. Unfinished tasks are
+	 * left suspended and destroyed with their Task.
+	 * */
+	int32_t run(int32_t timeout_ms);
+
+private:
+	std::deque<std::coroutine_handle<>> ready;
+	std::vector<Pending*>               parked;
+};
+
+inline bool is_eagain(Channel_t* chan, int64_t rc)
+{
+	(void)chan;
+	return rc == LIBSSH2_ERROR_EAGAIN;
+}
+
+inline bool is_eagain(Channel_t* chan, LIBSSH2_SFTP_HANDLE* handle)
+{
+	return !handle
+		&& libssh2_session_last_errno(chan->session) == LIBSSH2_ERROR_EAGAIN;
+}
+
+/** Awaitable for a single libssh2 call, retried until it's not EAGAIN */
+template <typename T, typename Fn>
+struct Op : Pending {
+	Fn fn;
+	T  res {};
+
+	Op(Channel_t* chan, Fn fn)
+		: fn(fn)
+	{
+		this->chan = chan;
+	}
+
+	bool try_again() override
+	{
+		res = fn();
+		return !is_eagain(chan, res);
+	}
+
+	bool await_ready() { return try_again(); }
+	T    await_resume() { return res; }
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		handle = h;
+		chan->reactor->park(this);
+	}
+};
+
+template <typename T, typename Fn> Op<T, Fn> make_op(Channel_t* chan, Fn fn)
+{
+	return Op<T, Fn>(chan, fn);
+}
+
+inline auto open(Channel_t* chan, const std::string& path, unsigned long flags,
+	long mode, int open_type = LIBSSH2_SFTP_OPENFILE)
+{
+	return make_op<LIBSSH2_SFTP_HANDLE*>(chan, [=]() {
+		return libssh2_sftp_open_ex(chan->sftp, path.c_str(),
+			static_cast<unsigned int>(path.size()), flags, mode, open_type);
+	});
+}
+
+inline auto read(Channel_t* chan, LIBSSH2_SFTP_HANDLE* handle, char* buf,
+	size_t len)
+{
+	return make_op<ssize_t>(
+		chan, [=]() { return libssh2_sftp_read(handle, buf, len); });
+}
+
+inline auto write(Channel_t* chan, LIBSSH2_SFTP_HANDLE* handle,
+	const char* buf, size_t len)
+{
+	return make_op<ssize_t>(
+		chan, [=]() { return libssh2_sftp_write(handle, buf, len); });
+}
+
+inline auto readdir(Channel_t* chan, LIBSSH2_SFTP_HANDLE* handle, char* name,
+	size_t len, LIBSSH2_SFTP_ATTRIBUTES* attrs)
+{
+	return make_op<int32_t>(chan,
+		[=]() { return libssh2_sftp_readdir(handle, name, len, attrs); });
+}
+
+inline auto stat(Channel_t* chan, const std::string& path,
+	LIBSSH2_SFTP_ATTRIBUTES* attrs, int stat_type = LIBSSH2_SFTP_LSTAT)
+{
+	return make_op<int32_t>(chan, [=]() {
+		return libssh2_sftp_stat_ex(chan->sftp, path.c_str(),
+			static_cast<unsigned int>(path.size()), stat_type, attrs);
+	});
+}
+
+inline auto unlink(Channel_t* chan, const std::string& path)
+{
+	return make_op<int32_t>(chan, [=]() {
+		return libssh2_sftp_unlink_ex(
+			chan->sftp, path.c_str(), static_cast<unsigned int>(path.size()));
+	});
+}
+
+inline auto rmdir(Channel_t* chan, const std::string& path)
+{
+	return make_op<int32_t>(chan, [=]() {
+		return libssh2_sftp_rmdir_ex(
+			chan->sftp, path.c_str(), static_cast<unsigned int>(path.size()));
+	});
+}
+
+inline auto fsetstat(Channel_t* chan, LIBSSH2_SFTP_HANDLE* handle,
+	LIBSSH2_SFTP_ATTRIBUTES* attrs)
+{
+	return make_op<int32_t>(
+		chan, [=]() { return libssh2_sftp_fsetstat(handle, attrs); });
+}
+
+/** rename replacing existing target, needs posix-rename@openssh.com */
+inline auto posix_rename(
+	Channel_t* chan, const std::string& from, const std::string& to)
+{
+	return make_op<int32_t>(chan, [=]() {
+		return libssh2_sftp_posix_rename_ex(
+			chan->sftp, from.c_str(), from.size(), to.c_str(), to.size());
+	});
+}
+
+/** raw I/O on a channel which isn't used by libssh2 SFTP functions */
+inline auto channel_read(
+	Channel_t* chan, LIBSSH2_CHANNEL* channel, char* buf, size_t len)
+{
+	return make_op<ssize_t>(
+		chan, [=]() { return libssh2_channel_read(channel, buf, len); });
+}
+
+inline auto channel_write(
+	Channel_t* chan, LIBSSH2_CHANNEL* channel, const char* buf, size_t len)
+{
+	return make_op<ssize_t>(
+		chan, [=]() { return libssh2_channel_write(channel, buf, len); });
+}
+
+inline auto close(Channel_t* chan, LIBSSH2_SFTP_HANDLE* handle)
+{
+	return make_op<int32_t>(
+		chan, [=]() { return libssh2_sftp_close_handle(handle); });
+}
+
+}
+
+#endif
@@ -0,0 +1,405 @@
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+#if defined(_POSIX_VERSION)
+#	include <sys/stat.h>
+#	include <unistd.h>
+#	include <utime.h>
+#elif defined(_WIN32)
+#	include <sys/stat.h>
+#	include <sys/utime.h>
+#else
+#	error "UNKNOWN ENVIRONMENT"
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "debug.hpp"
+#include "sftp_coro.hpp"
+#include "sftp_delta.hpp"
+#include "sftp_hash.hpp"
+#include "sftp_local.hpp"
+#include "sftp_remote.hpp"
+#include "sftp_writer.hpp"
+
+namespace { // start of unnamed namespace for static function
+
+typedef std::vector<std::string> Hashes_t;
+
+static std::string prv_replace(
+	std::string str, const std::string& key, const std::string& value)
+{
+	size_t pos = str.find(key);
+
+	while (pos != std::string::npos) {
+		str.replace(pos, key.size(), value);
+		pos = str.find(key, pos + value.size());
+	}
+
+	return str;
+}
+
+/** hash remote file block by block with the configured command */
+static int32_t prv_remote_hashes(
+	SftpWatch_t* ctx, const std::string& path, Hashes_t* hashes)
+{
+	std::string cmd = ctx->delta.command;
+	if (cmd.empty()) cmd = SNOD_DELTA_CMD;
+
+	cmd = prv_replace(cmd, "{block}", std::to_string(ctx->delta.block));
+	cmd = prv_replace(cmd, "{path}", SftpRemote::quote(path));
+
+	std::string out;
+	int32_t     rc = SftpRemote::exec(ctx, cmd, &out);
+
+	if (rc) {
+		LOG_ERR("Delta hash command failed for '%s' [%d]\n", path.c_str(), rc);
+		return rc;
+	}
+
+	return SftpDelta::parse_hashes(out, hashes);
+}
+
+/** remove remote file over exec channel, which works when SFTP one doesn't */
+static void prv_remote_rm(SftpWatch_t* ctx, const std::string& path)
+{
+	std::string out;
+	std::string cmd = "rm -f -- " + SftpRemote::quote(path);
+
+	if (SftpRemote::exec(ctx, cmd, &out)) {
+		LOG_ERR("Unable to remove delta copy '%s'\n", path.c_str());
+	}
+}
+
+static uint64_t prv_block_count(SftpWatch_t* ctx, uint64_t size)
+{
+	return (size + ctx->delta.block - 1) / ctx->delta.block;
+}
+
+static size_t prv_block_len(SftpWatch_t* ctx, uint64_t size, uint64_t index)
+{
+	uint64_t offset = index * ctx->delta.block;
+	uint64_t len    = std::min<uint64_t>(ctx->delta.block, size - offset);
+
+	return static_cast<size_t>(len);
+}
+
+static SftpCoro::Task prv_read_at(SftpCoro::Channel_t* chan,
+	LIBSSH2_SFTP_HANDLE* handle, uint64_t offset, char* mem, size_t len)
+{
+	libssh2_sftp_seek64(handle, offset);
+
+	for (size_t total = 0; total < len;) {
+		ssize_t nread
+			= co_await SftpCoro::read(chan, handle, mem + total, len - total);
+
+		// file has been truncated meanwhile
+		if (nread == 0) co_return -1;
+		if (nread < 0) co_return static_cast<int32_t>(nread);
+
+		total += static_cast<size_t>(nread);
+	}
+
+	co_return 0;
+}
+
+static SftpCoro::Task prv_write_at(SftpCoro::Channel_t* chan,
+	LIBSSH2_SFTP_HANDLE* handle, uint64_t offset, const char* mem, size_t len)
+{
+	libssh2_sftp_seek64(handle, offset);
+
+	for (size_t total = 0; total < len;) {
+		ssize_t nwritten
+			= co_await SftpCoro::write(chan, handle, mem + total, len - total);
+
+		if (nwritten < 0) co_return static_cast<int32_t>(nwritten);
+
+		total += static_cast<size_t>(nwritten);
+	}
+
+	co_return 0;
+}
+
+/** copy unchanged blocks from the old local file, fetch the others */
+static SftpCoro::Task prv_down_task(SftpWatch_t* ctx, SftpCoro::Channel_t* chan,
+	DirItem_t* file, const Hashes_t* hashes, FILE* fd_old, FILE* fd_temp)
+{
+	std::string remote_file = ctx->root->remote_path + SNOD_SEP + file->name;
+
+	LIBSSH2_SFTP_HANDLE* handle
+		= co_await SftpCoro::open(chan, remote_file, LIBSSH2_FXF_READ, 0);
+
+	if (!handle) co_return -3;
+
+	std::vector<char> mem(ctx->delta.block);
+	int32_t           rc = 0;
+
+	for (size_t i = 0; !rc && i < hashes->size(); i++) {
+		size_t len = prv_block_len(ctx, file->attrs.filesize, i);
+
+		// old file is read sequentially, short read means it's smaller
+		size_t nread = fread(mem.data(), 1, len, fd_old);
+
+		if (nread == len && SftpHash::buffer(mem.data(), len) == (*hashes)[i]) {
+			SNOD_STAT_ADD(ctx, bytes_saved, len);
+		} else {
+			uint64_t offset = i * ctx->delta.block;
+
+			rc = co_await prv_read_at(chan, handle, offset, mem.data(), len);
+			if (!rc) SNOD_STAT_ADD(ctx, bytes_down, len);
+		}
+
+		if (!rc && fwrite(mem.data(), 1, len, fd_temp) != len) rc = -2;
+	}
+
+	co_await SftpCoro::close(chan, handle);
+
+	co_return rc;
+}
+
+/** write changed blocks into remote copy, then replace the remote file */
+static SftpCoro::Task prv_up_task(SftpWatch_t* ctx, SftpCoro::Channel_t* chan,
+	DirItem_t* file, const Hashes_t* hashes, FILE* fd_local,
+	const std::string* temp_file)
+{
+	std::string remote_file = ctx->root->remote_path + SNOD_SEP + file->name;
+
+	LIBSSH2_SFTP_HANDLE* handle
+		= co_await SftpCoro::open(chan, *temp_file, LIBSSH2_FXF_WRITE, 0);
+
+	if (!handle) {
+		co_await SftpCoro::unlink(chan, *temp_file);
+		co_return -3;
+	}
+
+	std::vector<char> mem(ctx->delta.block);
+	uint64_t          size = file->attrs.filesize;
+	int32_t           rc   = 0;
+
+	for (uint64_t i = 0; !rc && i < prv_block_count(ctx, size); i++) {
+		size_t len = prv_block_len(ctx, size, i);
+
+		if (fread(mem.data(), 1, len, fd_local) != len) {
+			rc = -2;
+			break;
+		}
+
+		if (i < hashes->size()
+			&& SftpHash::buffer(mem.data(), len) == (*hashes)[i]) {
+			SNOD_STAT_ADD(ctx, bytes_saved, len);
+			continue;
+		}
+
+		uint64_t offset = i * ctx->delta.block;
+
+		rc = co_await prv_write_at(chan, handle, offset, mem.data(), len);
+		if (!rc) SNOD_STAT_ADD(ctx, bytes_up, len);
+	}
+
+	// size truncates the copy when the file has been shrunk
+	if (!rc) {
+		LIBSSH2_SFTP_ATTRIBUTES attrs = file->attrs;
+
+		attrs.flags |= LIBSSH2_SFTP_ATTR_SIZE;
+		attrs.filesize = size;
+
+		rc = co_await SftpCoro::fsetstat(chan, handle, &attrs);
+	}
+
+	int32_t close_rc = co_await SftpCoro::close(chan, handle);
+	if (!rc) rc = close_rc;
+
+	if (!rc) {
+		rc = co_await SftpCoro::posix_rename(chan, *temp_file, remote_file);
+	}
+
+	if (rc) co_await SftpCoro::unlink(chan, *temp_file);
+
+	co_return rc;
+}
+
+static int32_t prv_run(SftpWatch_t* ctx, SftpCoro::Reactor* reactor,
+	SftpCoro::Task& task)
+{
+	reactor->spawn(task);
+
+	int32_t rc = reactor->run(SNOD_SEC2MS(ctx->timeout_sec));
+
+	// abandoned request is still in flight on the main channel, and its reply
+	// would be taken by the next one. Reconnect before the session is reused
+	if (rc) {
+		SftpRemote::set_error(ctx, rc, "Delta transfer didn't finish");
+		SftpRemote::mark_broken(ctx);
+		ctx->err_count = ctx->max_err_count;
+		return rc;
+	}
+
+	return task.done() ? task.result() : -1;
+}
+
+static void prv_main_channel(SftpWatch_t* ctx, SftpCoro::Reactor* reactor,
+	SftpCoro::Channel_t* chan)
+{
+	chan->reactor = reactor;
+	chan->session = ctx->session;
+	chan->sftp    = ctx->sftp_session;
+	chan->sock    = ctx->sock;
+}
+
+} // end of unnamed namespace for static function
+
+int32_t SftpDelta::down_file(SftpWatch_t* ctx, DirItem_t* file)
+{
+	std::string remote_file = ctx->root->remote_path + SNOD_SEP + file->name;
+	std::string local_file  = ctx->root->local_path + SNOD_SEP + file->name;
+	std::string temp_file   = local_file + SNOD_TEMP_SUFFIX;
+
+	// nothing to compare with
+	FILE* fd_old = fopen(local_file.c_str(), "rb");
+	if (!fd_old) return -2;
+
+	Hashes_t hashes;
+	int32_t  rc = prv_remote_hashes(ctx, remote_file, &hashes);
+
+	// remote file has been changed since it was listed
+	if (!rc && hashes.size() != prv_block_count(ctx, file->attrs.filesize)) {
+		rc = -1;
+	}
+
+	FILE* fd_temp = rc ? NULL : fopen(temp_file.c_str(), "wb");
+
+	if (!fd_temp) {
+		fclose(fd_old);
+		return rc ? rc : -2;
+	}
+
+	SftpCoro::Reactor   reactor;
+	SftpCoro::Channel_t chan;
+
+	prv_main_channel(ctx, &reactor, &chan);
+
+	SftpCoro::Task task
+		= prv_down_task(ctx, &chan, file, &hashes, fd_old, fd_temp);
+
+	rc = prv_run(ctx, &reactor, task);
+
+	fclose(fd_old);
+
+	if (!rc && (fflush(fd_temp) || SftpWriter::commit(ctx, fileno(fd_temp)))) {
+		SftpLocal::set_error(ctx);
+		rc = -2;
+	}
+
+	if (fclose(fd_temp) && !rc) rc = -2;
+
+	// set times and permission before the file is visible as the target
+	if (!rc) {
+		struct utimbuf times = {
+			.actime  = static_cast<time_t>(file->attrs.atime),
+			.modtime = static_cast<time_t>(file->attrs.mtime),
+		};
+
+		if (utime(temp_file.c_str(), &times)) {
+			LOG_ERR("Failed to set mtime [%d]\n", errno);
+		}
+
+#ifdef _POSIX_VERSION
+		if (chmod(temp_file.c_str(), SNOD_FILE_PERM(file->attrs))) {
+			LOG_ERR("Failed to set attributes: %d\n", errno);
+		}
+#endif
+
+		if (::rename(temp_file.c_str(), local_file.c_str())) {
+			SftpLocal::set_error(ctx);
+			rc = -2;
+		}
+	}
+
+	if (rc) {
+		::remove(temp_file.c_str());
+		return rc;
+	}
+
+	SNOD_STAT_ADD(ctx, deltas, 1);
+
+	return 0;
+}
+
+int32_t SftpDelta::up_file(SftpWatch_t* ctx, DirItem_t* file)
+{
+	std::string remote_file = ctx->root->remote_path + SNOD_SEP + file->name;
+	std::string local_file  = ctx->root->local_path + SNOD_SEP + file->name;
+	std::string temp_file   = remote_file + SNOD_TEMP_SUFFIX;
+
+	FILE* fd_local = fopen(local_file.c_str(), "rb");
+	if (!fd_local) return -2;
+
+	// unchanged blocks are kept by server side copy, instead of sending them
+	std::string out;
+	std::string cmd = "cp -- " + SftpRemote::quote(remote_file) + " "
+		+ SftpRemote::quote(temp_file);
+
+	int32_t rc = SftpRemote::exec(ctx, cmd, &out);
+	if (rc) LOG_ERR("Delta copy failed for '%s' [%d]\n", cmd.c_str(), rc);
+
+	// the copy is hashed, remote file may have been changed since it's copied
+	Hashes_t hashes;
+	if (!rc) rc = prv_remote_hashes(ctx, temp_file, &hashes);
+
+	if (rc) {
+		prv_remote_rm(ctx, temp_file);
+		fclose(fd_local);
+		return rc;
+	}
+
+	SftpCoro::Reactor   reactor;
+	SftpCoro::Channel_t chan;
+
+	prv_main_channel(ctx, &reactor, &chan);
+
+	SftpCoro::Task task
+		= prv_up_task(ctx, &chan, file, &hashes, fd_local, &temp_file);
+
+	rc = prv_run(ctx, &reactor, task);
+
+	fclose(fd_local);
+
+	// abandoned task didn't get to remove the copy
+	if (rc && !task.done()) prv_remote_rm(ctx, temp_file);
+
+	if (rc) return rc;
+
+	SNOD_STAT_ADD(ctx, deltas, 1);
+
+	return 0;
+}
+
+int32_t SftpDelta::parse_hashes(
+	const std::string& out, std::vector<std::string>* hashes)
+{
+	size_t pos = 0;
+
+	while (pos < out.size()) {
+		size_t end = out.find('\n', pos);
+		if (end == std::string::npos) end = out.size();
+
+		std::string line = out.substr(pos, end - pos);
+		pos              = end + 1;
+
+		if (line.empty()) continue;
+		if (!SftpHash::is_hex(line)) return -1;
+
+		line.resize(SNOD_HASH_HEX_LEN);
+		std::transform(line.begin(), line.end(), line.begin(),
+			[](unsigned char c) { return std::tolower(c); });
+
+		hashes->push_back(line);
+	}
+
+	return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef _SFTP_DELTA_HPP
+#define _SFTP_DELTA_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "sftp_watch.hpp"
+
+/*
+ * Block delta transfer. Files on both sides are split into fixed size blocks,
+ * remote blocks are hashed by a command run over exec channel, and only
+ * blocks with different SHA-256 are transferred.
+ *
+ * Changed blocks are written to a temporary copy next to the target, which
+ * replaces the target by rename once it is complete. Thus the target is
+ * either the old or the new content, never a mix of both.
+ *
+ * NOTE: Blocks are compared at the same offset only, so content inserted in
+ *       the middle of a file changes every following block. It fits files
+ *       modified in place, like disk images or databases.
+ * */
+
+/**
+ * Default remote block hash command. {block} is replaced by block size and
+ * {path} by quoted path. It must print a sha256sum line for each block.
+ * */
+#ifndef SNOD_DELTA_CMD
+#	define SNOD_DELTA_CMD "split -b {block} --filter=sha256sum -- {path}"
+#endif
+
+namespace SftpDelta {
+
+/**
+ * @brief download changed blocks of remote file into a copy of the existing
+ * local file, then replace the local file.
+ * @return 0 on success. Otherwise the target is untouched, and the file
+ * should be transferred as a whole.
+ * */
+int32_t down_file(SftpWatch_t* ctx, DirItem_t* file);
+
+/**
+ * @brief upload changed blocks into a server side copy of the existing
+ * remote file, then replace the remote file.
+ * @return 0 on success. Otherwise the target is untouched, and the file
+ * should be transferred as a whole.
+ * */
+int32_t up_file(SftpWatch_t* ctx, DirItem_t* file);
+
+/**
+ * @brief parse output of the hash command, a sha256sum line for each block in
+ * order. Digests are lowercased, empty lines are ignored.
+ * @return 0 on success, -1 if a line doesn't start with a digest
+ * */
+int32_t parse_hashes(const std::string& out, std::vector<std::string>* hashes);
+
+}
+
+#endif
@@ -0,0 +1,741 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "debug.hpp"
+#include "sftp_engine.hpp"
+
+#if defined(__linux__)
+#	include <sys/epoll.h>
+#	include <sys/eventfd.h>
+#	include <sys/mman.h>
+#	include <ucontext.h>
+#	include <unistd.h>
+
+#	define SNOD_ENGINE_FIBERS 1
+#elif defined(_WIN32)
+#	define poll WSAPoll
+#endif
+
+/*
+ * Each instance is represented by exactly one task, which is either waiting
+ * in the timer queue or being executed by one of the threads. A task
+ * reschedules itself at the end of its cycle via SftpEngine::submit().
+ *
+ * With fibers, a started task is pinned to its thread until it's finished,
+ * since it may hold thread-affine locks while suspended. A thread takes due
+ * tasks only between resuming its ready tasks.
+ * */
+
+namespace { // start of unnamed namespace for static function
+
+typedef std::chrono::steady_clock Clock_t;
+
+typedef struct EngineTask_s {
+	SftpWatch_t*   ctx;
+	engine_task_fn fn;
+} EngineTask_t;
+
+typedef std::multimap<Clock_t::time_point, EngineTask_t> TaskQueue_t;
+
+typedef struct Worker_s Worker_t;
+
+#ifdef SNOD_ENGINE_FIBERS
+typedef struct Fiber_s Fiber_t;
+
+typedef std::multimap<Clock_t::time_point, Fiber_t*> TimerQueue_t;
+
+/** socket watched by a suspended task */
+typedef struct FiberWait_s {
+	int      fd;
+	int16_t  events;  /**< poll events */
+	uint32_t revents; /**< epoll events */
+	Fiber_t* fiber;
+} FiberWait_t;
+
+/**
+ * Socket in the epoll set of a thread. Several tasks of the thread may wait
+ * for the same socket, e.g. instances sharing a session.
+ * */
+typedef struct FdWatch_s {
+	uint32_t                  events = 0; /**< epoll events of all waiters */
+	std::vector<FiberWait_t*> waiters;
+} FdWatch_t;
+
+struct Fiber_s {
+	ucontext_t   uc;
+	char*        stack = nullptr;
+	EngineTask_t task;
+	Worker_t*    worker   = nullptr;
+	bool         is_done  = false;
+	bool         is_ready = false; /**< queued in Worker_t::ready */
+
+	std::vector<FiberWait_t> waits;
+	bool                     has_timer = false;
+	TimerQueue_t::iterator   timer;
+};
+#endif
+
+struct Worker_s {
+	std::thread thread;
+
+#ifdef SNOD_ENGINE_FIBERS
+	int        epfd = -1;
+	int        evfd = -1; /**< wakes epoll_wait for new tasks and signals */
+	ucontext_t main;
+
+	std::deque<Fiber_t*> ready;  /**< owned by the worker thread */
+	std::vector<Fiber_t*> woken; /**< set by other threads, guarded by mtx */
+	TimerQueue_t          timers;
+	std::vector<char*>    stacks; /**< stacks of finished tasks */
+	uint32_t              fibers = 0;
+
+	std::unordered_map<int, FdWatch_t> watches; /**< owned by the thread */
+#endif
+};
+
+static std::mutex                             mtx;
+static std::condition_variable                cv;
+static std::vector<std::unique_ptr<Worker_t>> workers;
+static TaskQueue_t                            tasks;
+static bool                                   is_stopping = false;
+static uint32_t                               users       = 0;
+
+/** position of each instance in #tasks, for rescheduling */
+static std::unordered_map<SftpWatch_t*, TaskQueue_t::iterator> positions;
+
+#ifdef SNOD_ENGINE_FIBERS
+static thread_local Fiber_t* cur_fiber = nullptr;
+
+static size_t prv_page_size()
+{
+	static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	return page;
+}
+
+/** stack with a guard page below it, so overflow crashes instead */
+static char* prv_stack_alloc(Worker_t* w)
+{
+	if (!w->stacks.empty()) {
+		char* stack = w->stacks.back();
+		w->stacks.pop_back();
+		return stack;
+	}
+
+	size_t len = SNOD_ENGINE_STACK_SIZE + prv_page_size();
+	void*  mem = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (mem == MAP_FAILED) return nullptr;
+
+	mprotect(mem, prv_page_size(), PROT_NONE);
+
+	return static_cast<char*>(mem);
+}
+
+static void prv_stack_free(char* stack)
+{
+	munmap(stack, SNOD_ENGINE_STACK_SIZE + prv_page_size());
+}
+
+static void prv_notify_workers()
+{
+	uint64_t one = 1;
+
+	for (auto& w : workers) {
+		if (write(w->evfd, &one, sizeof(one)) < 0) continue;
+	}
+}
+
+static void prv_make_ready(Worker_t* w, Fiber_t* f)
+{
+	if (f->is_ready) return;
+
+	f->is_ready = true;
+	w->ready.push_back(f);
+}
+
+/** resume a suspended task from any thread */
+static void prv_wake(Fiber_t* f)
+{
+	uint64_t one = 1;
+
+	std::lock_guard<std::mutex> lock(mtx);
+	f->worker->woken.push_back(f);
+
+	if (write(f->worker->evfd, &one, sizeof(one)) < 0) return;
+}
+
+static uint32_t prv_epoll_events(int16_t events)
+{
+	return ((events & POLLIN) ? EPOLLIN : 0U)
+		| ((events & POLLOUT) ? EPOLLOUT : 0U);
+}
+
+/** add the socket to the epoll set, or widen its events if it's there */
+static int32_t prv_watch_add(Worker_t* w, FiberWait_t* wait)
+{
+	auto [it, is_new] = w->watches.try_emplace(wait->fd);
+	FdWatch_t* watch  = &it->second;
+	uint32_t   events = watch->events | prv_epoll_events(wait->events);
+
+	if (is_new || events != watch->events) {
+		struct epoll_event ev = {};
+		ev.events             = events;
+		ev.data.ptr           = watch;
+
+		int op = is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+		if (epoll_ctl(w->epfd, op, wait->fd, &ev)) {
+			if (is_new) w->watches.erase(it);
+			return -1;
+		}
+	}
+
+	watch->events = events;
+	watch->waiters.push_back(wait);
+
+	return 0;
+}
+
+/** remove the waiter, the socket leaves epoll set with its last waiter */
+static void prv_watch_del(Worker_t* w, FiberWait_t* wait)
+{
+	auto it = w->watches.find(wait->fd);
+	if (it == w->watches.end()) return;
+
+	FdWatch_t* watch = &it->second;
+	std::erase(watch->waiters, wait);
+
+	if (watch->waiters.empty()) {
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, wait->fd, nullptr);
+		w->watches.erase(it);
+		return;
+	}
+
+	uint32_t events = 0;
+	for (FiberWait_t* other : watch->waiters) {
+		events |= prv_epoll_events(other->events);
+	}
+
+	if (events == watch->events) return;
+
+	struct epoll_event ev = {};
+	ev.events             = events;
+	ev.data.ptr           = watch;
+
+	epoll_ctl(w->epfd, EPOLL_CTL_MOD, wait->fd, &ev);
+	watch->events = events;
+}
+
+static void prv_suspend()
+{
+	Fiber_t* f = cur_fiber;
+	swapcontext(&f->uc, &f->worker->main);
+}
+
+static void prv_entry()
+{
+	Fiber_t* f = cur_fiber;
+
+	f->task.fn(f->task.ctx);
+	f->is_done = true;
+
+	// returns into Worker_t::main by uc_link
+}
+
+static void prv_resume(Worker_t* w, Fiber_t* f)
+{
+	cur_fiber = f;
+	swapcontext(&w->main, &f->uc);
+	cur_fiber = nullptr;
+
+	if (!f->is_done) return;
+
+	w->stacks.push_back(f->stack);
+	w->fibers--;
+	delete f;
+}
+
+static void prv_start(Worker_t* w, const EngineTask_t& task)
+{
+	char* stack = prv_stack_alloc(w);
+
+	// run it on the worker stack, it just can't be suspended
+	if (!stack) {
+		LOG_ERR("Failed to allocate engine stack [%d]\n", errno);
+		task.fn(task.ctx);
+		return;
+	}
+
+	Fiber_t* f = new Fiber_t;
+	f->stack   = stack;
+	f->task    = task;
+	f->worker  = w;
+
+	getcontext(&f->uc);
+	f->uc.uc_stack.ss_sp   = stack + prv_page_size();
+	f->uc.uc_stack.ss_size = SNOD_ENGINE_STACK_SIZE;
+	f->uc.uc_link          = &w->main;
+	makecontext(&f->uc, prv_entry, 0);
+
+	w->fibers++;
+	prv_resume(w, f);
+}
+
+static void prv_set_timer(Fiber_t* f, int32_t timeout_ms)
+{
+	auto deadline = Clock_t::now() + std::chrono::milliseconds(timeout_ms);
+
+	f->timer     = f->worker->timers.insert({ deadline, f });
+	f->has_timer = true;
+}
+
+static void prv_clear_timer(Fiber_t* f)
+{
+	if (!f->has_timer) return;
+
+	f->worker->timers.erase(f->timer);
+	f->has_timer = false;
+}
+
+/** wait time of epoll, until the next task or timer is due */
+static int32_t prv_epoll_timeout(Worker_t* w)
+{
+	if (!w->ready.empty() || !w->woken.empty()) return 0;
+
+	Clock_t::time_point next = Clock_t::time_point::max();
+
+	if (!tasks.empty()) next = tasks.begin()->first;
+	if (!w->timers.empty()) next = std::min(next, w->timers.begin()->first);
+
+	if (next == Clock_t::time_point::max()) return -1;
+
+	auto ms = std::chrono::ceil<std::chrono::milliseconds>(
+		next - Clock_t::now());
+
+	return static_cast<int32_t>(std::max<int64_t>(ms.count(), 0));
+}
+
+static void prv_epoll_wait(Worker_t* w, int32_t timeout_ms)
+{
+	struct epoll_event events[64];
+
+	int n = epoll_wait(w->epfd, events, 64, timeout_ms);
+
+	for (int i = 0; i < n; i++) {
+		// new task or woken task, see #prv_notify_workers
+		if (!events[i].data.ptr) {
+			uint64_t count;
+			if (read(w->evfd, &count, sizeof(count)) < 0) continue;
+			continue;
+		}
+
+		FdWatch_t* watch = static_cast<FdWatch_t*>(events[i].data.ptr);
+
+		for (FiberWait_t* wait : watch->waiters) {
+			uint32_t wanted
+				= prv_epoll_events(wait->events) | EPOLLERR | EPOLLHUP;
+			if (!(events[i].events & wanted)) continue;
+
+			wait->revents |= events[i].events & wanted;
+			prv_make_ready(w, wait->fiber);
+		}
+	}
+
+	Clock_t::time_point now = Clock_t::now();
+
+	while (!w->timers.empty() && w->timers.begin()->first <= now) {
+		Fiber_t* f = w->timers.begin()->second;
+		prv_clear_timer(f);
+		prv_make_ready(w, f);
+	}
+}
+
+static void worker_thread(Worker_t* w)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+	while (!is_stopping || w->fibers) {
+		for (Fiber_t* f : w->woken) prv_make_ready(w, f);
+		w->woken.clear();
+
+		bool is_due = !is_stopping && !tasks.empty()
+			&& tasks.begin()->first <= Clock_t::now();
+
+		if (is_due) {
+			auto         it   = tasks.begin();
+			EngineTask_t task = it->second;
+			positions.erase(task.ctx);
+			tasks.erase(it);
+
+			lock.unlock();
+			prv_start(w, task);
+			lock.lock();
+		}
+
+		lock.unlock();
+
+		while (!w->ready.empty()) {
+			Fiber_t* f = w->ready.front();
+			w->ready.pop_front();
+
+			f->is_ready = false;
+			prv_resume(w, f);
+		}
+
+		lock.lock();
+
+		int32_t timeout_ms = prv_epoll_timeout(w);
+
+		lock.unlock();
+		prv_epoll_wait(w, timeout_ms);
+		lock.lock();
+	}
+}
+#else
+static void worker_thread(Worker_t* w)
+{
+	(void)w;
+
+	std::unique_lock<std::mutex> lock(mtx);
+
+	while (!is_stopping) {
+		if (tasks.empty()) {
+			cv.wait(lock);
+			continue;
+		}
+
+		auto it = tasks.begin();
+		if (it->first > Clock_t::now()) {
+			cv.wait_until(lock, it->first);
+			continue;
+		}
+
+		EngineTask_t task = it->second;
+		positions.erase(task.ctx);
+		tasks.erase(it);
+
+		// run the cycle without holding the lock
+		lock.unlock();
+		task.fn(task.ctx);
+		lock.lock();
+	}
+}
+#endif
+
+static void prv_notify()
+{
+#ifdef SNOD_ENGINE_FIBERS
+	std::lock_guard<std::mutex> lock(mtx);
+	prv_notify_workers();
+#else
+	cv.notify_all();
+#endif
+}
+
+} // end of unnamed namespace for static function
+
+void SftpEngine::attach(uint8_t threads)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	++users;
+
+	if (!workers.empty()) return;
+
+	if (!threads) threads = SNOD_ENGINE_THREADS;
+
+	is_stopping = false;
+	for (uint8_t i = 0; i < threads; i++) {
+		auto w = std::make_unique<Worker_t>();
+
+#ifdef SNOD_ENGINE_FIBERS
+		w->epfd = epoll_create1(EPOLL_CLOEXEC);
+		w->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		struct epoll_event ev = {};
+		ev.events             = EPOLLIN;
+		ev.data.ptr           = nullptr;
+		epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->evfd, &ev);
+#endif
+
+		w->thread = std::thread(worker_thread, w.get());
+		workers.push_back(std::move(w));
+	}
+
+	LOG_DBG("Shared engine started with %u threads\n", threads);
+}
+
+void SftpEngine::detach(SftpWatch_t* ctx)
+{
+	std::vector<std::unique_ptr<Worker_t>> stopped;
+
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		auto found = positions.find(ctx);
+		if (found != positions.end()) {
+			tasks.erase(found->second);
+			positions.erase(found);
+		}
+
+		if (!users || --users) return;
+
+		// nothing is resumed by the next attach
+		tasks.clear();
+		positions.clear();
+		is_stopping = true;
+
+#ifdef SNOD_ENGINE_FIBERS
+		prv_notify_workers();
+#endif
+		stopped.swap(workers);
+	}
+
+	cv.notify_all();
+
+	for (auto& w : stopped) {
+		w->thread.join();
+
+#ifdef SNOD_ENGINE_FIBERS
+		for (char* stack : w->stacks) prv_stack_free(stack);
+
+		close(w->epfd);
+		close(w->evfd);
+#endif
+	}
+
+	LOG_DBG("Shared engine stopped\n");
+}
+
+void SftpEngine::submit(SftpWatch_t* ctx, engine_task_fn fn, uint32_t delay_ms)
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		auto deadline  = Clock_t::now() + std::chrono::milliseconds(delay_ms);
+		positions[ctx] = tasks.insert({ deadline, { ctx, fn } });
+	}
+
+	prv_notify();
+}
+
+void SftpEngine::wake(SftpWatch_t* ctx)
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		// task is being executed or not scheduled at all
+		auto found = positions.find(ctx);
+		if (found == positions.end()) return;
+
+		EngineTask_t task = found->second->second;
+		tasks.erase(found->second);
+		found->second = tasks.insert({ Clock_t::now(), task });
+	}
+
+	prv_notify();
+}
+
+bool SftpEngine::in_task()
+{
+#ifdef SNOD_ENGINE_FIBERS
+	return cur_fiber != nullptr;
+#else
+	return false;
+#endif
+}
+
+int32_t SftpEngine::poll(struct pollfd* fds, size_t count, int32_t timeout_ms)
+{
+#ifdef SNOD_ENGINE_FIBERS
+	Fiber_t* f = cur_fiber;
+
+	if (!f || !timeout_ms) return ::poll(fds, count, timeout_ms);
+
+	// same socket may be listed several times, epoll takes it only once
+	f->waits.clear();
+
+	for (size_t i = 0; i < count; i++) {
+		fds[i].revents = 0;
+
+		bool is_found = false;
+		for (FiberWait_t& wait : f->waits) {
+			if (wait.fd != fds[i].fd) continue;
+
+			wait.events |= fds[i].events;
+			is_found = true;
+		}
+
+		if (!is_found) f->waits.push_back({ fds[i].fd, fds[i].events, 0, f });
+	}
+
+	size_t added = 0;
+
+	for (FiberWait_t& wait : f->waits) {
+		if (prv_watch_add(f->worker, &wait)) break;
+		added++;
+	}
+
+	// socket can't be watched by epoll at all, the thread has to block
+	if (added < f->waits.size()) {
+		for (size_t i = 0; i < added; i++) {
+			prv_watch_del(f->worker, &f->waits[i]);
+		}
+
+		f->waits.clear();
+
+		return ::poll(fds, count, timeout_ms);
+	}
+
+	if (timeout_ms > 0) prv_set_timer(f, timeout_ms);
+
+	prv_suspend();
+
+	prv_clear_timer(f);
+
+	for (FiberWait_t& wait : f->waits) prv_watch_del(f->worker, &wait);
+
+	int32_t rc = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		for (const FiberWait_t& wait : f->waits) {
+			if (wait.fd != fds[i].fd) continue;
+
+			if (wait.revents & EPOLLIN) fds[i].revents |= POLLIN;
+			if (wait.revents & EPOLLOUT) fds[i].revents |= POLLOUT;
+			if (wait.revents & EPOLLERR) fds[i].revents |= POLLERR;
+			if (wait.revents & EPOLLHUP) fds[i].revents |= POLLHUP;
+		}
+
+		fds[i].revents &= fds[i].events | POLLERR | POLLHUP;
+		if (fds[i].revents) rc++;
+	}
+
+	f->waits.clear();
+
+	return rc;
+#else
+	return ::poll(fds, count, timeout_ms);
+#endif
+}
+
+void SftpEngine::sleep(uint32_t ms)
+{
+#ifdef SNOD_ENGINE_FIBERS
+	if (cur_fiber) {
+		prv_set_timer(cur_fiber, static_cast<int32_t>(ms));
+		prv_suspend();
+		prv_clear_timer(cur_fiber);
+		return;
+	}
+#endif
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void SftpEngine::wait(EngineSignal_t* sig)
+{
+	std::unique_lock<std::mutex> lock(sig->mtx);
+
+#ifdef SNOD_ENGINE_FIBERS
+	if (cur_fiber && !sig->is_set) {
+		sig->waiter = cur_fiber;
+
+		// notify can't resume it before it's suspended, the thread is busy
+		lock.unlock();
+		prv_suspend();
+		lock.lock();
+	}
+#endif
+
+	sig->cv.wait(lock, [sig]() { return sig->is_set; });
+	sig->is_set = false;
+}
+
+void SftpEngine::notify(EngineSignal_t* sig)
+{
+	void* waiter = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock(sig->mtx);
+
+		sig->is_set = true;
+		waiter      = sig->waiter;
+		sig->waiter = nullptr;
+	}
+
+	sig->cv.notify_one();
+
+#ifdef SNOD_ENGINE_FIBERS
+	if (waiter) prv_wake(static_cast<Fiber_t*>(waiter));
+#endif
+}
+
+void EngineMutex_s::lock()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+#ifdef SNOD_ENGINE_FIBERS
+	// holder may be a task of this thread, blocking would never return
+	if (cur_fiber && is_locked) {
+		waiters.push_back(cur_fiber);
+
+		// unlock() can't resume it before it's suspended, the thread is busy
+		lock.unlock();
+		prv_suspend();
+
+		// mutex has been handed over by unlock()
+		return;
+	}
+#endif
+
+	cv.wait(lock, [this]() { return !is_locked; });
+	is_locked = true;
+}
+
+bool EngineMutex_s::try_lock()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	if (is_locked) return false;
+
+	is_locked = true;
+	return true;
+}
+
+void EngineMutex_s::unlock()
+{
+	void* waiter = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		// suspended task takes it over, it's kept locked meanwhile
+		if (waiters.empty()) {
+			is_locked = false;
+		} else {
+			waiter = waiters.front();
+			waiters.pop_front();
+		}
+	}
+
+	if (!waiter) {
+		cv.notify_one();
+		return;
+	}
+
+#ifdef SNOD_ENGINE_FIBERS
+	prv_wake(static_cast<Fiber_t*>(waiter));
+#endif
+}
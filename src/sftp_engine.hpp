@@ -0,0 +1,95 @@
+#ifndef _SFTP_ENGINE_HPP
+#define _SFTP_ENGINE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+#if defined(_WIN32)
+#	include <winsock2.h>
+#else
+#	include <poll.h>
+#endif
+
+/*
+ * Shared engine runs sync cycles of many instances on a fixed set of threads.
+ *
+ * On Linux, each cycle runs as a task on its own stack. When the task has to
+ * wait for its socket, or for a JavaScript callback, it's suspended and the
+ * thread runs other tasks meanwhile. Sockets of all suspended tasks of a
+ * thread are multiplexed by one epoll set, so a thread never blocks on a
+ * single session. Other platforms run each cycle to its end on the thread.
+ * */
+
+// default number of I/O threads for the shared engine
+#ifndef SNOD_ENGINE_THREADS
+#	define SNOD_ENGINE_THREADS 4
+#endif
+
+/** stack of each engine task, only touched pages are allocated */
+#ifndef SNOD_ENGINE_STACK_SIZE
+#	define SNOD_ENGINE_STACK_SIZE (1024U * 1024U)
+#endif
+
+typedef struct SftpWatch_s    SftpWatch_t;
+typedef struct EngineMutex_s  EngineMutex_t;
+typedef struct EngineSignal_s EngineSignal_t;
+
+typedef void (*engine_task_fn)(SftpWatch_t* ctx);
+
+/**
+ * Mutex held across suspension points. A task waiting for it is suspended,
+ * and unlock() hands the mutex over to it directly. Other threads wait as
+ * with std::mutex.
+ * */
+struct EngineMutex_s {
+	std::mutex              mtx;
+	std::condition_variable cv;
+	bool                    is_locked = false;
+	std::deque<void*>       waiters; /**< suspended tasks, in lock order */
+
+	void lock();
+	bool try_lock();
+	void unlock();
+};
+
+/**
+ * One-shot wake up, set by any thread. A task waiting for it is suspended,
+ * other threads are blocked.
+ * */
+struct EngineSignal_s {
+	std::mutex              mtx;
+	std::condition_variable cv;
+	bool                    is_set = false;
+	void*                   waiter = nullptr; /**< suspended task */
+};
+
+namespace SftpEngine {
+
+void attach(uint8_t threads);
+
+/**
+ * @brief release the engine used by the instance. Task of the instance which
+ * is still queued is dropped, so it's never resumed after the instance is
+ * freed. Threads are stopped by the last instance.
+ * */
+void detach(SftpWatch_t* ctx);
+void submit(SftpWatch_t* ctx, engine_task_fn fn, uint32_t delay_ms);
+void wake(SftpWatch_t* ctx);
+
+/** whether the caller runs as a suspendable engine task */
+bool in_task();
+
+/** same as poll(), the calling task is suspended while waiting */
+int32_t poll(struct pollfd* fds, size_t count, int32_t timeout_ms);
+
+void sleep(uint32_t ms);
+
+void wait(EngineSignal_t* sig);
+void notify(EngineSignal_t* sig);
+
+}
+
+#endif
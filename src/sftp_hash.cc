@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <vector>
+
+#include "sftp_hash.hpp"
+
+#ifdef _WIN32
+#	define fseeko _fseeki64
+#endif
+
+#ifndef SNOD_HASH_CHUNK
+#	define SNOD_HASH_CHUNK (64U * 1024U)
+#endif
+
+int32_t SftpHash::init(Hash_t* hash)
+{
+	if (!hash->md) hash->md = EVP_MD_CTX_new();
+	if (!hash->md) return -1;
+
+	return EVP_DigestInit_ex(hash->md, EVP_sha256(), NULL) ? 0 : -1;
+}
+
+int32_t SftpHash::update(Hash_t* hash, const void* data, size_t len)
+{
+	return EVP_DigestUpdate(hash->md, data, len) ? 0 : -1;
+}
+
+std::string SftpHash::finish(Hash_t* hash)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	uint8_t      digest[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+
+	if (!EVP_DigestFinal_ex(hash->md, digest, &len)) return "";
+
+	std::string hex;
+	hex.reserve(len * 2);
+
+	for (unsigned int i = 0; i < len; i++) {
+		hex += digits[digest[i] >> 4];
+		hex += digits[digest[i] & 0x0F];
+	}
+
+	return hex;
+}
+
+std::string SftpHash::buffer(const void* data, size_t len)
+{
+	Hash_t hash;
+
+	if (SftpHash::init(&hash)) return "";
+	if (SftpHash::update(&hash, data, len)) return "";
+
+	return SftpHash::finish(&hash);
+}
+
+std::string SftpHash::file(FILE* fd, uint64_t offset, uint64_t len)
+{
+	Hash_t hash;
+
+	if (SftpHash::init(&hash)) return "";
+	if (SftpHash::update_file(&hash, fd, offset, len)) return "";
+
+	return SftpHash::finish(&hash);
+}
+
+int32_t SftpHash::update_file(
+	Hash_t* hash, FILE* fd, uint64_t offset, uint64_t len)
+{
+	if (fseeko(fd, static_cast<int64_t>(offset), SEEK_SET)) return -1;
+
+	std::vector<char> mem(SNOD_HASH_CHUNK);
+
+	while (len) {
+		size_t size  = static_cast<size_t>(std::min<uint64_t>(len, mem.size()));
+		size_t nread = fread(mem.data(), 1, size, fd);
+
+		if (!nread) break;
+
+		SftpHash::update(hash, mem.data(), nread);
+		len -= nread;
+	}
+
+	// file has been truncated meanwhile
+	return len ? -1 : 0;
+}
+
+int32_t SftpHash::update_zeros(Hash_t* hash, uint64_t len)
+{
+	static const std::vector<char> zeros(SNOD_HASH_CHUNK, '\0');
+
+	while (len) {
+		size_t size
+			= static_cast<size_t>(std::min<uint64_t>(len, zeros.size()));
+
+		if (SftpHash::update(hash, zeros.data(), size)) return -1;
+		len -= size;
+	}
+
+	return 0;
+}
+
+bool SftpHash::is_hex(const std::string& str)
+{
+	if (str.size() < SNOD_HASH_HEX_LEN) return false;
+
+	for (size_t i = 0; i < SNOD_HASH_HEX_LEN; i++) {
+		if (!isxdigit(static_cast<unsigned char>(str[i]))) return false;
+	}
+
+	return true;
+}
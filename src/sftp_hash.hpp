@@ -0,0 +1,57 @@
+#ifndef _SFTP_HASH_HPP
+#define _SFTP_HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <openssl/evp.h>
+
+/*
+ * SHA-256 digest on top of OpenSSL EVP. Used to compare contents of local and
+ * remote files without transferring them, remote side is hashed by commands
+ * like sha256sum over an exec channel.
+ * */
+
+#define SNOD_HASH_LEN     32U
+#define SNOD_HASH_HEX_LEN (SNOD_HASH_LEN * 2U)
+
+typedef struct Hash_s Hash_t;
+
+struct Hash_s {
+	EVP_MD_CTX* md = nullptr;
+
+	Hash_s() { }
+	Hash_s(const Hash_s&)            = delete;
+	Hash_s& operator=(const Hash_s&) = delete;
+
+	~Hash_s()
+	{
+		if (md) EVP_MD_CTX_free(md);
+	}
+};
+
+namespace SftpHash {
+
+int32_t     init(Hash_t* hash);
+int32_t     update(Hash_t* hash, const void* data, size_t len);
+std::string finish(Hash_t* hash); /**< hex digest, empty on failure */
+
+/** hex digest of a buffer. Empty on failure */
+std::string buffer(const void* data, size_t len);
+
+/** hex digest of a range of local file. Empty on failure */
+std::string file(FILE* fd, uint64_t offset, uint64_t len);
+
+/** feed a range of local file, leaving the file at the end of the range */
+int32_t update_file(Hash_t* hash, FILE* fd, uint64_t offset, uint64_t len);
+
+/** feed zero bytes, content of holes in sparse file */
+int32_t update_zeros(Hash_t* hash, uint64_t len);
+
+/** check whether the string starts with a hex digest, as sha256sum prints */
+bool is_hex(const std::string& str);
+
+}
+
+#endif
@@ -207,7 +207,8 @@ int32_t SftpLocal::read_dir(Directory_t& dir, DirItem_t* file)
 	struct stat st;
 	std::string abs_path = dir.path + SNOD_SEP + name;
 
-	if (name == "." || name == "..") {
+	// partially written files aren't synchronized
+	if (name == "." || name == ".." || SftpWatch::is_temp(name)) {
 		file->name           = "";
 		file->type           = IS_INVALID;
 		file->attrs.filesize = 0;
@@ -224,7 +225,15 @@ int32_t SftpLocal::read_dir(Directory_t& dir, DirItem_t* file)
 
 	conv_stat_attrs(&file->attrs, &st);
 
+	file->ino  = static_cast<uint64_t>(st.st_ino);
 	file->type = SftpWatch::get_filetype(file);
+
+#if defined(__APPLE__)
+	file->mtime_nsec = static_cast<uint32_t>(st.st_mtimespec.tv_nsec);
+#elif defined(_POSIX_VERSION)
+	file->mtime_nsec = static_cast<uint32_t>(st.st_mtim.tv_nsec);
+#endif
+
 	file->name = dir.rela.empty() ? name : dir.rela + SNOD_SEP + name;
 
 	return 1;
@@ -232,7 +241,7 @@ int32_t SftpLocal::read_dir(Directory_t& dir, DirItem_t* file)
 
 int32_t SftpLocal::remove(SftpWatch_t* ctx, std::string& filename)
 {
-	std::string local_file = ctx->local_path + SNOD_SEP + filename;
+	std::string local_file = ctx->root->local_path + SNOD_SEP + filename;
 
 	if (::remove(local_file.c_str())) {
 		SftpLocal::set_error(ctx);
@@ -247,9 +256,47 @@ int32_t SftpLocal::remove(SftpWatch_t* ctx, DirItem_t* file)
 	return SftpLocal::remove(ctx, file->name);
 }
 
+int32_t SftpLocal::rename(SftpWatch_t* ctx, DirItem_t* from, DirItem_t* to)
+{
+	std::string local_from = ctx->root->local_path + SNOD_SEP + from->name;
+	std::string local_to   = ctx->root->local_path + SNOD_SEP + to->name;
+
+	SNOD_RESET_ERRNO();
+	if (::rename(local_from.c_str(), local_to.c_str())) {
+		SftpLocal::set_error(ctx);
+		return -1;
+	}
+
+	return 0;
+}
+
+int32_t SftpLocal::set_attrs(SftpWatch_t* ctx, DirItem_t* file)
+{
+	std::string local_file = ctx->root->local_path + SNOD_SEP + file->name;
+
+	struct utimbuf times = {
+		.actime  = static_cast<time_t>(file->attrs.atime),
+		.modtime = static_cast<time_t>(file->attrs.mtime),
+	};
+
+	if (utime(local_file.c_str(), &times)) {
+		SftpLocal::set_error(ctx);
+		return -1;
+	}
+
+#ifdef _POSIX_VERSION
+	if (chmod(local_file.c_str(), SNOD_FILE_PERM(file->attrs))) {
+		SftpLocal::set_error(ctx);
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
 int32_t SftpLocal::mkdir(SftpWatch_t* ctx, DirItem_t* file)
 {
-	std::string local_dir = ctx->local_path + SNOD_SEP + file->name;
+	std::string local_dir = ctx->root->local_path + SNOD_SEP + file->name;
 	struct stat st;
 	int32_t     rc = 0;
 
@@ -302,7 +349,7 @@ int32_t SftpLocal::mkdir(SftpWatch_t* ctx, DirItem_t* file)
  * */
 void SftpLocal::rmdir(SftpWatch_t* ctx, std::string& dirname)
 {
-	std::filesystem::path dirpath(ctx->local_path + SNOD_SEP + dirname);
+	std::filesystem::path dirpath(ctx->root->local_path + SNOD_SEP + dirname);
 
 	if (!std::filesystem::is_directory(dirpath)) return;
 
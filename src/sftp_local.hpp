@@ -17,6 +17,10 @@ int32_t mkdir(SftpWatch_t* ctx, DirItem_t* file);
 
 int32_t remove(SftpWatch_t* ctx, DirItem_t* file);
 int32_t remove(SftpWatch_t* ctx, std::string& filename);
+int32_t rename(SftpWatch_t* ctx, DirItem_t* from, DirItem_t* to);
+
+/** set times and permission of local file to match the item */
+int32_t set_attrs(SftpWatch_t* ctx, DirItem_t* file);
 
 void rmdir(SftpWatch_t* ctx, DirItem_t* file);
 void rmdir(SftpWatch_t* ctx, std::string& dirname);
@@ -37,6 +37,14 @@ void SftpNode::tsfn_sync_cb(
 		obj.Set("evt", Napi::String::New(env, "down"));
 	} break;
 
+	case EVT_FILE_RMOV: {
+		obj.Set("evt", Napi::String::New(env, "movR"));
+	} break;
+
+	case EVT_FILE_LMOV: {
+		obj.Set("evt", Napi::String::New(env, "movL"));
+	} break;
+
 	default: {
 	} break;
 	}
@@ -48,6 +56,14 @@ void SftpNode::tsfn_sync_cb(
 		Napi::Number::New(env, static_cast<double>(ev->file->attrs.filesize)));
 	obj.Set("time", Napi::Number::New(env, SNOD_SEC2MS(ev->file->attrs.mtime)));
 	obj.Set("perm", Napi::Number::New(env, SNOD_FILE_PERM(ev->file->attrs)));
+	obj.Set("mapping", Napi::Number::New(env, ev->root));
+
+	if (ev->prev) obj.Set("from", Napi::String::New(env, *ev->prev));
+
+	// digest computed while transferring, see checksum option
+	if (ev->status && !ev->file->hash.empty()) {
+		obj.Set("hash", Napi::String::New(env, ev->file->hash));
+	}
 
 	// don't forget to delete the data, since we used dynamic allocation
 	node_ctx->delete_file_event();
@@ -55,18 +71,18 @@ void SftpNode::tsfn_sync_cb(
 	js_cb.Call({ obj });
 
 	// release the lock
-	node_ctx->sem_sync.release();
+	SftpEngine::notify(&node_ctx->sig_sync);
 }
 
 void SftpNode::tsfn_sync_js_call(SftpWatch_t* ctx, UserData_t data,
-	DirItem_t* file, bool status, EventFile_t ev)
+	DirItem_t* file, bool status, EventFile_t ev, const std::string* prev)
 {
 	(void)ctx;
 
 	SftpNode* node_ctx = static_cast<SftpNode*>(data);
 
 	// need to use heap, avoiding data lost when race condition occurs
-	node_ctx->set_file_event(ev, status, file);
+	node_ctx->set_file_event(ev, status, file, prev);
 
 	// BlockingCall() should never fail, since max queue size is 0
 	if (node_ctx->tsfn_sync.BlockingCall(node_ctx, tsfn_sync_cb) != napi_ok) {
@@ -74,7 +90,7 @@ void SftpNode::tsfn_sync_js_call(SftpWatch_t* ctx, UserData_t data,
 	}
 
 	// wait until the BlockingCall is finished
-	node_ctx->sem_sync.acquire();
+	SftpEngine::wait(&node_ctx->sig_sync);
 }
 
 void SftpNode::tsfn_err_cb(
@@ -86,7 +102,7 @@ void SftpNode::tsfn_err_cb(
 	js_cb.Call({ res->Value() });
 
 	// release the lock
-	node_ctx->sem_err.release();
+	SftpEngine::notify(&node_ctx->sig_err);
 }
 
 void SftpNode::tsfn_err_js_call(
@@ -105,7 +121,7 @@ void SftpNode::tsfn_err_js_call(
 	};
 
 	// wait until the BlockingCall is finished
-	node_ctx->sem_err.acquire();
+	SftpEngine::wait(&node_ctx->sig_err);
 }
 
 void SftpNode::stop_finalizer(Napi::Env env, void* data, StopWorker_t* stop)
@@ -153,8 +169,6 @@ void SftpNode::thread_cleanup(SftpWatch_t* ctx, UserData_t data)
 SftpNode::SftpNode(const Napi::CallbackInfo& info)
 	: Napi::ObjectWrap<SftpNode>(info)
 	, sem_main(0) // semaphore is initially locked
-	, sem_sync(0) // semaphore is initially locked
-	, sem_err(0)  // semaphore is initially locked
 {
 	Napi::Env env = info.Env();
 
@@ -169,6 +183,10 @@ SftpNode::SftpNode(const Napi::CallbackInfo& info)
 	Directory_t remote_dir;
 	Directory_t local_dir;
 	std::string host;
+
+	std::vector<Directory_t> map_remotes;
+	std::vector<Directory_t> map_locals;
+
 	std::string username;
 	std::string pubkey;
 	std::string privkey;
@@ -203,6 +221,60 @@ SftpNode::SftpNode(const Napi::CallbackInfo& info)
 		return;
 	}
 
+	if (arg.Has("mappings")) {
+		if (!arg.Get("mappings").IsArray()) {
+			Napi::TypeError::New(env, "'mappings' is not an array")
+				.ThrowAsJavaScriptException();
+			return;
+		}
+
+		Napi::Array arr = arg.Get("mappings").As<Napi::Array>();
+
+		for (uint32_t i = 0; i < arr.Length(); i++) {
+			Napi::Value val = arr.Get(i);
+
+			if (!val.IsObject()) {
+				Napi::TypeError::New(env, "'mappings' item is not an object")
+					.ThrowAsJavaScriptException();
+				return;
+			}
+
+			Napi::Object map = val.As<Napi::Object>();
+
+			if (!map.Has("remotePath") || !map.Get("remotePath").IsString()
+				|| !map.Has("localPath") || !map.Get("localPath").IsString()) {
+				Napi::TypeError::New(env, "'mappings' item is invalid")
+					.ThrowAsJavaScriptException();
+				return;
+			}
+
+			Directory_t map_remote;
+			Directory_t map_local;
+
+			map_remote.path
+				= map.Get("remotePath").As<Napi::String>().Utf8Value();
+			map_local.path
+				= map.Get("localPath").As<Napi::String>().Utf8Value();
+
+			if (map_remote.path.empty() || map_local.path.empty()) {
+				Napi::TypeError::New(env, "'mappings' item path is empty")
+					.ThrowAsJavaScriptException();
+				return;
+			}
+
+			map_remotes.push_back(map_remote);
+			map_locals.push_back(map_local);
+		}
+	}
+
+	if (!map_remotes.empty()
+		&& (arg.Has("remotePath") || arg.Has("localPath"))) {
+		Napi::TypeError::New(env,
+			"'mappings' can't be mixed with 'remotePath' and 'localPath'")
+			.ThrowAsJavaScriptException();
+		return;
+	}
+
 	if (arg.Has("remotePath")) {
 		if (!arg.Get("remotePath").IsString()
 			|| arg.Get("remotePath").IsEmpty()) {
@@ -212,6 +284,14 @@ SftpNode::SftpNode(const Napi::CallbackInfo& info)
 		}
 
 		remote_dir.path = arg.Get("remotePath").As<Napi::String>().Utf8Value();
+	} else if (!map_remotes.empty()) {
+		// first mapping becomes the main root, so root index equals the
+		// index in 'mappings'
+		remote_dir = map_remotes.front();
+		local_dir  = map_locals.front();
+
+		map_remotes.erase(map_remotes.begin());
+		map_locals.erase(map_locals.begin());
 	} else {
 		Napi::TypeError::New(env, "'remotePath' is undefined")
 			.ThrowAsJavaScriptException();
@@ -272,6 +352,10 @@ SftpNode::SftpNode(const Napi::CallbackInfo& info)
 
 	SftpWatch::set_user_data(this->ctx, static_cast<UserData_t>(this));
 
+	for (size_t i = 0; i < map_remotes.size(); i++) {
+		SftpWatch::add_root(this->ctx, map_remotes[i], map_locals[i]);
+	}
+
 	// -------------------- Optional properties --------------------------------
 	if (arg.Has("port")) {
 		uint32_t tmp = arg.Get("port").As<Napi::Number>().Uint32Value();
@@ -298,6 +382,268 @@ SftpNode::SftpNode(const Napi::CallbackInfo& info)
 			= arg.Get("useKeyboard").As<Napi::Boolean>().Value();
 	}
 
+	if (arg.Has("sharedEngine")) {
+		this->ctx->use_engine
+			= arg.Get("sharedEngine").As<Napi::Boolean>().Value();
+	}
+
+	if (arg.Has("mode")) {
+		std::string mode = arg.Get("mode").ToString().Utf8Value();
+
+		if (mode == "download") {
+			this->ctx->mode = SNOD_MODE_DOWNLOAD;
+		} else if (mode == "upload") {
+			this->ctx->mode = SNOD_MODE_UPLOAD;
+		} else if (mode == "bidirectional") {
+			this->ctx->mode = SNOD_MODE_BIDIR;
+		} else {
+			Napi::TypeError::New(env, "'mode' is invalid")
+				.ThrowAsJavaScriptException();
+			return;
+		}
+	}
+
+	if (arg.Has("verifyEvery")) {
+		this->ctx->verify_every
+			= arg.Get("verifyEvery").As<Napi::Number>().Uint32Value();
+	}
+
+	if (arg.Has("priority") && arg.Get("priority").IsObject()) {
+		Napi::Object    prio = arg.Get("priority").As<Napi::Object>();
+		SyncPriority_t* conf = &this->ctx->priority;
+
+		if (prio.Has("patterns") && prio.Get("patterns").IsArray()) {
+			Napi::Array arr = prio.Get("patterns").As<Napi::Array>();
+
+			for (uint32_t i = 0; i < arr.Length(); i++) {
+				conf->patterns.push_back(arr.Get(i).ToString().Utf8Value());
+			}
+		}
+
+		if (prio.Has("order")) {
+			std::string order = prio.Get("order").ToString().Utf8Value();
+
+			if (order == "smallest") {
+				conf->order = SNOD_ORDER_SMALLEST;
+			} else if (order == "oldest") {
+				conf->order = SNOD_ORDER_OLDEST;
+			} else if (order == "scan") {
+				conf->order = SNOD_ORDER_SCAN;
+			} else {
+				Napi::TypeError::New(env, "'priority.order' is invalid")
+					.ThrowAsJavaScriptException();
+				return;
+			}
+		}
+
+		if (prio.Has("largeFileSize")) {
+			conf->large_size = static_cast<uint64_t>(
+				prio.Get("largeFileSize").As<Napi::Number>().Int64Value());
+		}
+
+		if (prio.Has("smallPerLarge")) {
+			conf->small_per_large
+				= prio.Get("smallPerLarge").As<Napi::Number>().Uint32Value();
+		}
+	}
+
+	if (arg.Has("deleteChannels")) {
+		uint32_t tmp
+			= arg.Get("deleteChannels").As<Napi::Number>().Uint32Value();
+
+		if (tmp < 1 || tmp > UINT8_MAX) {
+			Napi::TypeError::New(env, "'deleteChannels' must be 1 - 255")
+				.ThrowAsJavaScriptException();
+			return;
+		}
+
+		this->ctx->delete_channels = static_cast<uint8_t>(tmp);
+	}
+
+	if (arg.Has("appendWindow")) {
+		this->ctx->append_window
+			= arg.Get("appendWindow").As<Napi::Number>().Uint32Value();
+	}
+
+	if (arg.Has("delta") && arg.Get("delta").IsObject()) {
+		Napi::Object delta = arg.Get("delta").As<Napi::Object>();
+		SyncDelta_t* conf  = &this->ctx->delta;
+
+		if (delta.Has("minSize")) {
+			conf->min_size = static_cast<uint64_t>(
+				delta.Get("minSize").As<Napi::Number>().Int64Value());
+		}
+
+		if (delta.Has("blockSize")) {
+			uint32_t tmp
+				= delta.Get("blockSize").As<Napi::Number>().Uint32Value();
+			if (tmp > 0) conf->block = tmp;
+		}
+
+		if (delta.Has("command")) {
+			conf->command
+				= delta.Get("command").As<Napi::String>().Utf8Value();
+		}
+	}
+
+	if (arg.Has("batch") && arg.Get("batch").IsObject()) {
+		Napi::Object batch = arg.Get("batch").As<Napi::Object>();
+		SyncBatch_t* conf  = &this->ctx->batch;
+
+		if (batch.Has("maxSize")) {
+			conf->max_size = static_cast<uint64_t>(
+				batch.Get("maxSize").As<Napi::Number>().Int64Value());
+		}
+
+		if (batch.Has("maxFiles")) {
+			uint32_t tmp
+				= batch.Get("maxFiles").As<Napi::Number>().Uint32Value();
+			if (tmp > 0) conf->max_files = tmp;
+		}
+
+		if (batch.Has("maxBytes")) {
+			int64_t tmp
+				= batch.Get("maxBytes").As<Napi::Number>().Int64Value();
+			if (tmp > 0) conf->max_bytes = static_cast<uint64_t>(tmp);
+		}
+	}
+
+	if (arg.Has("algorithms") && arg.Get("algorithms").IsObject()) {
+		Napi::Object algo = arg.Get("algorithms").As<Napi::Object>();
+		SyncAlgo_t*  conf = &this->ctx->algo;
+
+		if (algo.Has("kex")) {
+			conf->kex = algo.Get("kex").As<Napi::String>().Utf8Value();
+		}
+
+		if (algo.Has("hostkey")) {
+			conf->hostkey = algo.Get("hostkey").As<Napi::String>().Utf8Value();
+		}
+
+		if (algo.Has("cipher")) {
+			conf->cipher = algo.Get("cipher").As<Napi::String>().Utf8Value();
+		}
+
+		if (algo.Has("mac")) {
+			conf->mac = algo.Get("mac").As<Napi::String>().Utf8Value();
+		}
+
+		if (algo.Has("rankByLocalCpu")) {
+			conf->rank_local
+				= algo.Get("rankByLocalCpu").As<Napi::Boolean>().Value();
+		}
+	}
+
+	if (arg.Has("writer") && arg.Get("writer").IsObject()) {
+		Napi::Object  writer = arg.Get("writer").As<Napi::Object>();
+		SyncWriter_t* conf   = &this->ctx->writer;
+
+		if (writer.Has("blockSize")) {
+			uint32_t tmp
+				= writer.Get("blockSize").As<Napi::Number>().Uint32Value();
+			if (tmp > 0) conf->block = tmp;
+		}
+
+		if (writer.Has("preallocate")) {
+			conf->preallocate
+				= writer.Get("preallocate").As<Napi::Boolean>().Value();
+		}
+
+		if (writer.Has("direct")) {
+			conf->direct = writer.Get("direct").As<Napi::Boolean>().Value();
+		}
+
+		if (writer.Has("dropCache")) {
+			conf->drop_cache
+				= writer.Get("dropCache").As<Napi::Boolean>().Value();
+		}
+
+		if (writer.Has("fsync")) {
+			std::string fsync = writer.Get("fsync").ToString().Utf8Value();
+
+			if (fsync == "none") {
+				conf->fsync = SNOD_FSYNC_NONE;
+			} else if (fsync == "file") {
+				conf->fsync = SNOD_FSYNC_FILE;
+			} else if (fsync == "batch") {
+				conf->fsync = SNOD_FSYNC_BATCH;
+			} else {
+				Napi::TypeError::New(env, "'writer.fsync' is invalid")
+					.ThrowAsJavaScriptException();
+				return;
+			}
+		}
+	}
+
+	if (arg.Has("compare")) {
+		std::string compare = arg.Get("compare").ToString().Utf8Value();
+
+		if (compare == "mtime") {
+			this->ctx->compare = SNOD_COMPARE_MTIME;
+		} else if (compare == "hash") {
+			this->ctx->compare = SNOD_COMPARE_HASH;
+		} else {
+			Napi::TypeError::New(env, "'compare' is invalid")
+				.ThrowAsJavaScriptException();
+			return;
+		}
+	}
+
+	if (arg.Has("hashCache")) {
+		this->ctx->hash_cache.path
+			= arg.Get("hashCache").As<Napi::String>().Utf8Value();
+	}
+
+	if (arg.Has("bufferSize")) {
+		uint32_t tmp = arg.Get("bufferSize").As<Napi::Number>().Uint32Value();
+		if (tmp > 0) SftpPool::init(&this->ctx->buffers, tmp);
+	}
+
+	if (arg.Has("mmapSize")) {
+		this->ctx->mmap_size = static_cast<uint64_t>(
+			arg.Get("mmapSize").As<Napi::Number>().Int64Value());
+	}
+
+	if (arg.Has("sparse")) {
+		this->ctx->sparse = arg.Get("sparse").As<Napi::Boolean>().Value();
+	}
+
+	if (arg.Has("staged")) {
+		this->ctx->staged = arg.Get("staged").As<Napi::Boolean>().Value();
+	}
+
+	if (arg.Has("stagingDir")) {
+		this->ctx->staging_dir
+			= arg.Get("stagingDir").As<Napi::String>().Utf8Value();
+	}
+
+	if (arg.Has("checksum")) {
+		this->ctx->checksum = arg.Get("checksum").As<Napi::Boolean>().Value();
+	}
+
+	if (arg.Has("shareConnection")) {
+		this->ctx->share_conn
+			= arg.Get("shareConnection").As<Napi::Boolean>().Value();
+	}
+
+	if (arg.Has("traceSize")) {
+		uint32_t tmp = arg.Get("traceSize").As<Napi::Number>().Uint32Value();
+		if (tmp > 0) SftpTrace::enable(&this->ctx->trace, true, tmp);
+	}
+
+	if (arg.Has("engineThreads")) {
+		uint32_t tmp
+			= arg.Get("engineThreads").As<Napi::Number>().Uint32Value();
+
+		if (tmp < 1 || tmp > UINT8_MAX) {
+			Napi::TypeError::New(env, "'engineThreads' must be 1 - 255")
+				.ThrowAsJavaScriptException();
+			return;
+		}
+
+		this->ctx->engine_threads = static_cast<uint8_t>(tmp);
+	}
+
 	Napi::Object o_error = Napi::Object::New(env);
 	obj_err              = Napi::Persistent(o_error);
 	obj_err.SuppressDestruct();
@@ -311,7 +657,7 @@ SftpNode::SftpNode(const Napi::CallbackInfo& info)
 		this);
 
 	this->id = ctx->host + ":" + std::to_string(ctx->port) + "@"
-		+ this->ctx->remote_path + ":" + this->ctx->local_path;
+		+ this->ctx->root->remote_path + ":" + this->ctx->root->local_path;
 }
 
 SftpNode::~SftpNode()
@@ -319,13 +665,15 @@ SftpNode::~SftpNode()
 	delete this->stop;
 }
 
-EvtFile_t* SftpNode::set_file_event(
-	EventFile_t& ev, bool& status, DirItem_t* file)
+EvtFile_t* SftpNode::set_file_event(EventFile_t& ev, bool& status,
+	DirItem_t* file, const std::string* prev)
 {
 	this->ev_file         = new EvtFile_t;
 	this->ev_file->ev     = static_cast<uint8_t>(ev);
 	this->ev_file->status = status;
+	this->ev_file->root   = this->ctx->root->index;
 	this->ev_file->file   = file;
+	this->ev_file->prev   = prev;
 
 	return this->ev_file;
 }
@@ -349,7 +697,7 @@ SftpWatch_t* SftpNode::get_watch_ctx()
 void SftpNode::cleanup()
 {
 	SftpWatch::disconnect(ctx);
-	this->ctx->thread.join();
+	SftpWatch::join(this->ctx);
 
 	// FIXME: Restart after cleaning up
 	SftpWatch::clear(this->ctx);
@@ -543,6 +891,163 @@ Napi::Value SftpNode::fingerprint(const Napi::CallbackInfo& info)
 	return Napi::Buffer<uint8_t>::Copy(env, fp.data(), fp.size());
 }
 
+Napi::Value SftpNode::get_stats(const Napi::CallbackInfo& info)
+{
+	Napi::Env    env   = info.Env();
+	Napi::Object obj   = Napi::Object::New(env);
+	Napi::Object queue = Napi::Object::New(env);
+
+	auto num = [&env](uint64_t val) {
+		return Napi::Number::New(env, static_cast<double>(val));
+	};
+
+	queue.Set("localNew", num(SNOD_STAT_GET(this->ctx, que_l_new)));
+	queue.Set("remoteNew", num(SNOD_STAT_GET(this->ctx, que_r_new)));
+	queue.Set("localDel", num(SNOD_STAT_GET(this->ctx, que_l_del)));
+	queue.Set("remoteDel", num(SNOD_STAT_GET(this->ctx, que_r_del)));
+
+	obj.Set("cycles", num(SNOD_STAT_GET(this->ctx, cycles)));
+	obj.Set("cycleUs", num(SNOD_STAT_GET(this->ctx, cycle_us)));
+	obj.Set("localScanUs", num(SNOD_STAT_GET(this->ctx, local_scan_us)));
+	obj.Set("remoteScanUs", num(SNOD_STAT_GET(this->ctx, remote_scan_us)));
+	obj.Set("localDirs", num(SNOD_STAT_GET(this->ctx, local_dirs)));
+	obj.Set("remoteDirs", num(SNOD_STAT_GET(this->ctx, remote_dirs)));
+	obj.Set("localEntries", num(SNOD_STAT_GET(this->ctx, local_entries)));
+	obj.Set("remoteEntries", num(SNOD_STAT_GET(this->ctx, remote_entries)));
+	obj.Set("queue", queue);
+	obj.Set("bytesUp", num(SNOD_STAT_GET(this->ctx, bytes_up)));
+	obj.Set("bytesDown", num(SNOD_STAT_GET(this->ctx, bytes_down)));
+	obj.Set("uploads", num(SNOD_STAT_GET(this->ctx, uploads)));
+	obj.Set("downloads", num(SNOD_STAT_GET(this->ctx, downloads)));
+	obj.Set("localDels", num(SNOD_STAT_GET(this->ctx, local_dels)));
+	obj.Set("remoteDels", num(SNOD_STAT_GET(this->ctx, remote_dels)));
+	obj.Set("moves", num(SNOD_STAT_GET(this->ctx, moves)));
+	obj.Set("appends", num(SNOD_STAT_GET(this->ctx, appends)));
+	obj.Set("deltas", num(SNOD_STAT_GET(this->ctx, deltas)));
+	obj.Set("bytesSaved", num(SNOD_STAT_GET(this->ctx, bytes_saved)));
+	obj.Set("batches", num(SNOD_STAT_GET(this->ctx, batches)));
+	obj.Set("hashed", num(SNOD_STAT_GET(this->ctx, hashed)));
+	obj.Set("attrSyncs", num(SNOD_STAT_GET(this->ctx, attr_syncs)));
+	obj.Set("verified", num(SNOD_STAT_GET(this->ctx, verified)));
+	obj.Set("reconnects", num(SNOD_STAT_GET(this->ctx, reconnects)));
+	obj.Set("errors", num(SNOD_STAT_GET(this->ctx, errors)));
+	obj.Set("roundTripsSaved", num(SNOD_STAT_GET(this->ctx, rtt_saved)));
+	obj.Set("cycleRoundTripsSaved",
+		num(SNOD_STAT_GET(this->ctx, cycle_rtt_saved)));
+
+	return obj;
+}
+
+Napi::Value SftpNode::get_latency(const Napi::CallbackInfo& info)
+{
+	Napi::Env env = info.Env();
+
+	std::vector<double> pcts = { 50.0, 90.0, 99.0, 99.9 };
+	bool                reset = false;
+
+	if (info.Length() > 0 && !info[0].IsUndefined()) {
+		if (!info[0].IsArray()) {
+			Napi::TypeError::New(env, "Percentiles must be an array")
+				.ThrowAsJavaScriptException();
+			return env.Undefined();
+		}
+
+		Napi::Array arr = info[0].As<Napi::Array>();
+
+		pcts.clear();
+		for (uint32_t i = 0; i < arr.Length(); i++) {
+			pcts.push_back(arr.Get(i).As<Napi::Number>().DoubleValue());
+		}
+	}
+
+	if (info.Length() > 1 && info[1].IsBoolean()) {
+		reset = info[1].As<Napi::Boolean>().Value();
+	}
+
+	Napi::Object obj = Napi::Object::New(env);
+
+	for (uint8_t op = 0; op < LAT_OP_COUNT; op++) {
+		LatHist_t*   hist  = &this->ctx->latency[op];
+		Napi::Object o_op  = Napi::Object::New(env);
+		Napi::Array  o_pct = Napi::Array::New(env, pcts.size());
+
+		uint64_t count = hist->count.load(std::memory_order_relaxed);
+		uint64_t sum   = hist->sum.load(std::memory_order_relaxed);
+		uint64_t min   = hist->min.load(std::memory_order_relaxed);
+		uint64_t max   = hist->max.load(std::memory_order_relaxed);
+
+		for (uint32_t i = 0; i < pcts.size(); i++) {
+			uint64_t val = SftpStats::percentile(hist, pcts[i]);
+			o_pct.Set(i, Napi::Number::New(env, static_cast<double>(val)));
+		}
+
+		double mean = count ? static_cast<double>(sum) / count : 0.0;
+
+		o_op.Set("count", Napi::Number::New(env, static_cast<double>(count)));
+		o_op.Set("min",
+			Napi::Number::New(env, count ? static_cast<double>(min) : 0.0));
+		o_op.Set("max", Napi::Number::New(env, static_cast<double>(max)));
+		o_op.Set("mean", Napi::Number::New(env, mean));
+		o_op.Set("percentiles", o_pct);
+
+		obj.Set(SftpStats::op_name(op), o_op);
+
+		if (reset) SftpStats::reset(hist);
+	}
+
+	return obj;
+}
+
+Napi::Value SftpNode::set_trace(const Napi::CallbackInfo& info)
+{
+	Napi::Env env = info.Env();
+
+	if (info.Length() < 1 || !info[0].IsBoolean()) {
+		Napi::TypeError::New(env, "Expected a boolean")
+			.ThrowAsJavaScriptException();
+		return env.Undefined();
+	}
+
+	bool     enabled = info[0].As<Napi::Boolean>().Value();
+	uint32_t size    = 0;
+
+	if (info.Length() > 1 && info[1].IsNumber()) {
+		size = info[1].As<Napi::Number>().Uint32Value();
+	}
+
+	SftpTrace::enable(&this->ctx->trace, enabled, size);
+
+	return info.This();
+}
+
+Napi::Value SftpNode::get_trace(const Napi::CallbackInfo& info)
+{
+	Napi::Env env   = info.Env();
+	bool      clear = false;
+
+	if (info.Length() > 0 && info[0].IsBoolean()) {
+		clear = info[0].As<Napi::Boolean>().Value();
+	}
+
+	return Napi::String::New(env, SftpTrace::dump(&this->ctx->trace, clear));
+}
+
+Napi::Value SftpNode::trigger_sync(const Napi::CallbackInfo& info)
+{
+	Napi::Env   env = info.Env();
+	std::string path;
+
+	if (!this->is_running) return Napi::Boolean::New(env, false);
+
+	if (info.Length() > 0 && info[0].IsString()) {
+		path = info[0].As<Napi::String>().Utf8Value();
+	}
+
+	SftpWatch::trigger(this->ctx, path);
+
+	return Napi::Boolean::New(env, true);
+}
+
 Napi::Object init_napi(Napi::Env env, Napi::Object exports)
 {
 	std::initializer_list<Napi::ClassPropertyDescriptor<SftpNode>> properties
@@ -553,6 +1058,11 @@ Napi::Object init_napi(Napi::Env env, Napi::Object exports)
 			  SftpNode::InstanceMethod("on", &SftpNode::listen_to),
 			  SftpNode::InstanceMethod("getError", &SftpNode::get_error),
 			  SftpNode::InstanceMethod("fingerprint", &SftpNode::fingerprint),
+			  SftpNode::InstanceMethod("getStats", &SftpNode::get_stats),
+			  SftpNode::InstanceMethod("getLatency", &SftpNode::get_latency),
+			  SftpNode::InstanceMethod("setTrace", &SftpNode::set_trace),
+			  SftpNode::InstanceMethod("getTrace", &SftpNode::get_trace),
+			  SftpNode::InstanceMethod("triggerSync", &SftpNode::trigger_sync),
 		  };
 
 	Napi::Function func = SftpNode::DefineClass(env, "SftpNode", properties);
@@ -17,11 +17,12 @@ public:
 
 	std::binary_semaphore sem_main;
 
+	/** callbacks are awaited by signals, engine tasks are suspended */
 	Napi::ThreadSafeFunction tsfn_sync = nullptr;
-	std::binary_semaphore    sem_sync;
+	EngineSignal_t           sig_sync;
 
 	Napi::ThreadSafeFunction tsfn_err = nullptr;
-	std::binary_semaphore    sem_err;
+	EngineSignal_t           sig_err;
 	Napi::ObjectReference    obj_err;
 
 	static void tsfn_sync_finalizer(
@@ -29,7 +30,7 @@ public:
 	static void tsfn_sync_cb(
 		Napi::Env env, Napi::Function js_cb, SftpNode* node_ctx);
 	static void tsfn_sync_js_call(SftpWatch_t* ctx, UserData_t data,
-		DirItem_t* file, bool status, EventFile_t ev);
+		DirItem_t* file, bool status, EventFile_t ev, const std::string* prev);
 
 	static void tsfn_err_cb(
 		Napi::Env env, Napi::Function js_cb, SftpNode* node_ctx);
@@ -50,7 +51,8 @@ public:
 
 	void         cleanup();
 	SftpWatch_t* get_watch_ctx();
-	EvtFile_t*   set_file_event(EventFile_t& ev, bool& status, DirItem_t* file);
+	EvtFile_t*   set_file_event(EventFile_t& ev, bool& status, DirItem_t* file,
+		const std::string* prev);
 	EvtFile_t*   get_file_event();
 	void         delete_file_event();
 
@@ -60,6 +62,11 @@ public:
 	Napi::Value listen_to(const Napi::CallbackInfo& info);
 	Napi::Value get_error(const Napi::CallbackInfo& info);
 	Napi::Value fingerprint(const Napi::CallbackInfo& info);
+	Napi::Value get_stats(const Napi::CallbackInfo& info);
+	Napi::Value get_latency(const Napi::CallbackInfo& info);
+	Napi::Value set_trace(const Napi::CallbackInfo& info);
+	Napi::Value get_trace(const Napi::CallbackInfo& info);
+	Napi::Value trigger_sync(const Napi::CallbackInfo& info);
 
 	StopWorker_t* stop       = nullptr;
 	SyncErr_t*    last_error = nullptr;
@@ -90,7 +97,10 @@ struct StopWorker_s {
 struct EvtFile_s {
 	bool       status;
 	uint8_t    ev;
+	uint16_t   root; /**< index of the mapping which the file belongs to */
 	DirItem_t* file;
+
+	const std::string* prev; /**< previous name of moved file */
 };
 
 #endif
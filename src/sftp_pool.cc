@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+
+#include "sftp_pool.hpp"
+
+#if defined(_WIN32)
+#	include <malloc.h>
+#endif
+
+namespace { // start of unnamed namespace for static function
+
+static void prv_release(BufPool_t* pool)
+{
+	for (char* mem : pool->idle) SftpPool::free_aligned(mem);
+
+	pool->count -= pool->idle.size();
+	pool->idle.clear();
+}
+
+} // end of unnamed namespace for static function
+
+BufPool_s::~BufPool_s()
+{
+	prv_release(this);
+}
+
+void SftpPool::init(BufPool_t* pool, size_t size)
+{
+	size = std::clamp<size_t>(size, SNOD_POOL_MIN_SIZE, SNOD_POOL_MAX_SIZE);
+
+	std::lock_guard<std::mutex> lock(pool->mtx);
+
+	if (size == pool->size) return;
+
+	prv_release(pool);
+	pool->size = size;
+}
+
+char* SftpPool::get(BufPool_t* pool, size_t* size)
+{
+	{
+		std::lock_guard<std::mutex> lock(pool->mtx);
+
+		*size = pool->size;
+
+		if (!pool->idle.empty()) {
+			char* mem = pool->idle.back();
+			pool->idle.pop_back();
+			return mem;
+		}
+
+		pool->count++;
+	}
+
+	// allocate outside of the lock, it's only the first use of this buffer
+	char* mem = SftpPool::alloc_aligned(*size, SNOD_POOL_ALIGN);
+
+	if (!mem) {
+		std::lock_guard<std::mutex> lock(pool->mtx);
+		pool->count--;
+		errno = ENOMEM;
+	}
+
+	return mem;
+}
+
+void SftpPool::put(BufPool_t* pool, char* mem, size_t size)
+{
+	std::lock_guard<std::mutex> lock(pool->mtx);
+
+	// taken before the size has changed
+	if (size != pool->size) {
+		SftpPool::free_aligned(mem);
+		pool->count--;
+		return;
+	}
+
+	pool->idle.push_back(mem);
+}
+
+char* SftpPool::alloc_aligned(size_t size, size_t align)
+{
+#if defined(_WIN32)
+	return static_cast<char*>(_aligned_malloc(size, align));
+#else
+	void* ptr = nullptr;
+	if (posix_memalign(&ptr, align, size)) return nullptr;
+
+	return static_cast<char*>(ptr);
+#endif
+}
+
+void SftpPool::free_aligned(char* ptr)
+{
+#if defined(_WIN32)
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
@@ -0,0 +1,103 @@
+#ifndef _SFTP_POOL_HPP
+#define _SFTP_POOL_HPP
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/*
+ * Pools of buffers of one instance, one for transfers and one for blocks of
+ * the local writer. All buffers of a pool have the same size, and they are
+ * page aligned. Buffers are allocated on first use and reused afterwards, so
+ * transfers neither allocate per file nor keep large arrays on thread stacks.
+ * */
+
+/*
+ * Default to 30000, as it is the value of max SFTP Packet. Limits of the
+ * server aren't queried by limits@openssh.com, libssh2 can't send extended
+ * requests, and it splits longer buffers into 30000 byte requests anyway.
+ * */
+#ifndef SFTP_READ_BUFFER_SIZE
+#	define SFTP_READ_BUFFER_SIZE 30000
+#endif
+
+/** smallest transfer buffer, see #BufPool_t */
+#ifndef SNOD_POOL_MIN_SIZE
+#	define SNOD_POOL_MIN_SIZE 4096U
+#endif
+
+/** largest transfer buffer, SFTP reads return their length as int32 */
+#ifndef SNOD_POOL_MAX_SIZE
+#	define SNOD_POOL_MAX_SIZE (64U * 1024U * 1024U)
+#endif
+
+/** alignment of pooled buffers */
+#ifndef SNOD_POOL_ALIGN
+#	define SNOD_POOL_ALIGN 4096U
+#endif
+
+typedef struct BufPool_s BufPool_t;
+
+struct BufPool_s {
+	size_t size = SFTP_READ_BUFFER_SIZE; /**< size of each buffer */
+
+	std::mutex         mtx;
+	std::vector<char*> idle;      /**< buffers ready to be taken */
+	size_t             count = 0; /**< allocated buffers */
+
+	BufPool_s() { }
+	BufPool_s(const BufPool_s&)            = delete;
+	BufPool_s& operator=(const BufPool_s&) = delete;
+
+	~BufPool_s();
+};
+
+namespace SftpPool {
+
+/**
+ * @brief set buffer size, idle buffers of the old size are released. Busy
+ * ones are released when they are put back.
+ * */
+void init(BufPool_t* pool, size_t size);
+
+/**
+ * @brief take a buffer, its length is stored into size
+ * @return nullptr and ENOMEM on failure
+ * */
+char* get(BufPool_t* pool, size_t* size);
+
+/**
+ * @brief give a buffer back with the size it was taken with. Buffers taken
+ * before the pool size has changed are released, and no longer counted.
+ * */
+void put(BufPool_t* pool, char* mem, size_t size);
+
+/** memory aligned to align, which is a power of 2. nullptr on failure */
+char* alloc_aligned(size_t size, size_t align);
+void  free_aligned(char* ptr);
+
+/** Hold a pooled buffer until going out of scope */
+typedef struct PoolBuf_s {
+	BufPool_t* pool;
+	char*      mem;
+	size_t     size;
+
+	PoolBuf_s(BufPool_t* pool)
+		: pool(pool)
+		, size(0)
+	{
+		mem = SftpPool::get(pool, &size);
+	}
+
+	PoolBuf_s(const PoolBuf_s&)            = delete;
+	PoolBuf_s& operator=(const PoolBuf_s&) = delete;
+
+	~PoolBuf_s()
+	{
+		if (mem) SftpPool::put(pool, mem, size);
+	}
+} PoolBuf_t;
+
+}
+
+#endif
@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+
+#include "debug.hpp"
+#include "sftp_reader.hpp"
+
+#if defined(_POSIX_VERSION)
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+
+#	define SNOD_HAS_MMAP 1
+#elif defined(_WIN32)
+#	define fseeko _fseeki64
+#else
+#	error "UNKNOWN ENVIRONMENT"
+#endif
+
+namespace { // start of unnamed namespace for static function
+
+static void prv_unmap(LocalReader_t* rd)
+{
+#ifdef SNOD_HAS_MMAP
+	if (rd->map) munmap(rd->map, rd->map_len);
+#endif
+
+	rd->map     = nullptr;
+	rd->map_len = 0;
+}
+
+/** map the window holding the next chunk, page aligned */
+static int32_t prv_remap(LocalReader_t* rd)
+{
+#ifdef SNOD_HAS_MMAP
+	prv_unmap(rd);
+
+	// file might be truncated meanwhile, never map beyond its end
+	struct stat st;
+	if (fstat(fileno(rd->fd), &st)) return -1;
+
+	rd->size = static_cast<uint64_t>(st.st_size);
+	if (rd->pos >= rd->size) return 0;
+
+	static const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+
+	rd->map_off = rd->pos / page * page;
+	rd->map_len = static_cast<size_t>(
+		std::min<uint64_t>(SNOD_MMAP_WINDOW, rd->size - rd->map_off));
+
+	void* map = mmap(nullptr, rd->map_len, PROT_READ, MAP_SHARED,
+		fileno(rd->fd), static_cast<off_t>(rd->map_off));
+
+	if (map == MAP_FAILED) {
+		rd->map_len = 0;
+		return -1;
+	}
+
+	rd->map = static_cast<char*>(map);
+	madvise(rd->map, rd->map_len, MADV_SEQUENTIAL);
+#endif
+
+	return 0;
+}
+
+} // end of unnamed namespace for static function
+
+LocalReader_s::~LocalReader_s()
+{
+	prv_unmap(this);
+
+	if (mem) SftpPool::put(pool, mem, chunk);
+}
+
+void SftpReader::open(SftpWatch_t* ctx, LocalReader_t* rd, FILE* fd,
+	uint64_t offset, uint64_t size)
+{
+	rd->fd       = fd;
+	rd->pos      = offset;
+	rd->size     = size;
+	rd->data_end = offset;
+	rd->chunk    = ctx->buffers.size;
+
+#ifdef SNOD_HAS_MMAP
+	rd->is_mmap = ctx->mmap_size && size >= ctx->mmap_size;
+#else
+	rd->is_mmap = false;
+#endif
+
+#ifdef SEEK_DATA
+	// file with fewer allocated blocks than its size has holes
+	struct stat st;
+
+	rd->is_sparse = ctx->sparse && !fstat(fileno(fd), &st)
+		&& static_cast<uint64_t>(st.st_blocks) * 512U
+			< static_cast<uint64_t>(st.st_size);
+#endif
+
+	if (!rd->is_sparse) rd->data_end = UINT64_MAX;
+
+	if (rd->is_mmap) return;
+
+	// failure is reported by the first read
+	rd->pool = &ctx->buffers;
+	rd->mem  = SftpPool::get(rd->pool, &rd->chunk);
+
+	fseeko(fd, static_cast<int64_t>(offset), SEEK_SET);
+}
+
+int64_t SftpReader::next(LocalReader_t* rd, const char** ptr)
+{
+#ifdef SEEK_DATA
+	// end of data extent, jump over the hole to the next one
+	if (rd->is_sparse && rd->pos >= rd->data_end) {
+		int   fd   = fileno(rd->fd);
+		off_t data = lseek(fd, static_cast<off_t>(rd->pos), SEEK_DATA);
+
+		// only hole is left until the end of file
+		if (data < 0) return errno == ENXIO ? 0 : -1;
+
+		off_t hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0) return -1;
+
+		rd->pos      = static_cast<uint64_t>(data);
+		rd->data_end = static_cast<uint64_t>(hole);
+
+		if (!rd->is_mmap) fseeko(rd->fd, data, SEEK_SET);
+	}
+#endif
+
+	rd->chunk_off = rd->pos;
+
+	if (!rd->is_mmap) {
+		if (!rd->mem) return -1;
+
+		size_t len = static_cast<size_t>(
+			std::min<uint64_t>(rd->chunk, rd->data_end - rd->pos));
+
+		size_t nread = fread(rd->mem, 1, len, rd->fd);
+		if (!nread) return ferror(rd->fd) ? -1 : 0;
+
+		*ptr = rd->mem;
+		rd->pos += nread;
+
+		return static_cast<int64_t>(nread);
+	}
+
+	// window is consumed, or file has grown after the last window
+	if (!rd->map || rd->pos < rd->map_off
+		|| rd->pos >= rd->map_off + rd->map_len) {
+		if (prv_remap(rd)) return -1;
+		if (!rd->map) return 0;
+	}
+
+	uint64_t left = std::min(rd->map_off + rd->map_len, rd->data_end) - rd->pos;
+	size_t   len
+		= static_cast<size_t>(std::min<uint64_t>(left, rd->chunk));
+
+	*ptr = rd->map + (rd->pos - rd->map_off);
+	rd->pos += len;
+
+	return static_cast<int64_t>(len);
+}
@@ -0,0 +1,70 @@
+#ifndef _SFTP_READER_HPP
+#define _SFTP_READER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "sftp_watch.hpp"
+
+/*
+ * Local reader of uploaded files. Large files are mapped into memory by
+ * windows, and chunks are handed to SFTP write as pointers into the mapping,
+ * without copying them into a buffer first. Other files, or platforms
+ * without mmap, are read by stdio into a pooled buffer, see sftp_pool.hpp.
+ *
+ * A mapped file truncated by another process while it's being read raises
+ * SIGBUS. The size is checked before each window, but the window being read
+ * isn't protected, that's why mapping is opt-in, see #SftpWatch_t::mmap_size.
+ *
+ * Holes of sparse files are skipped by SEEK_DATA and SEEK_HOLE, so only data
+ * extents are read. Offset of each chunk tells where it has to be written.
+ * */
+
+/** size of each mapped window, multiple of page size */
+#ifndef SNOD_MMAP_WINDOW
+#	define SNOD_MMAP_WINDOW (16U * 1024U * 1024U)
+#endif
+
+typedef struct LocalReader_s LocalReader_t;
+
+struct LocalReader_s {
+	FILE*    fd      = NULL;    /**< owned by caller */
+	char*    map     = nullptr; /**< current window. nullptr for stdio */
+	size_t   map_len = 0;
+	uint64_t map_off = 0; /**< file offset of the window */
+	uint64_t pos     = 0; /**< file offset of the next chunk */
+	uint64_t size    = 0; /**< file size known so far */
+	bool     is_mmap = false;
+
+	bool     is_sparse = false; /**< holes are skipped */
+	uint64_t data_end  = 0;     /**< end of the current data extent */
+	uint64_t chunk_off = 0;     /**< file offset of the last chunk */
+
+	BufPool_t* pool  = nullptr;
+	char*      mem   = nullptr; /**< pooled buffer of stdio reads */
+	size_t     chunk = 0;       /**< largest chunk, size of pooled buffers */
+
+	LocalReader_s() { }
+	LocalReader_s(const LocalReader_s&)            = delete;
+	LocalReader_s& operator=(const LocalReader_s&) = delete;
+
+	~LocalReader_s();
+};
+
+namespace SftpReader {
+
+/** start reading the opened file from the offset */
+void open(SftpWatch_t* ctx, LocalReader_t* rd, FILE* fd, uint64_t offset,
+	uint64_t size);
+
+/**
+ * @brief get the next chunk, its offset is kept in #LocalReader_t::chunk_off.
+ * The pointer is valid until the next call.
+ * @return length of the chunk, 0 at end of file, negative on error
+ * */
+int64_t next(LocalReader_t* rd, const char** ptr);
+
+}
+
+#endif
@@ -21,6 +21,7 @@
 #	include <sys/utime.h> // _utime(), _utimbuf
 
 #	define poll   WSAPoll
+#	define fseeko _fseeki64
 
 #	define SHUT_RDWR     SD_BOTH
 #	define stat          _stat
@@ -30,13 +31,24 @@
 #endif
 
 #include "debug.hpp"
+#include "sftp_algo.hpp"
+#include "sftp_delta.hpp"
 #include "sftp_err.hpp"
+#include "sftp_hash.hpp"
 #include "sftp_local.hpp"
+#include "sftp_reader.hpp"
 #include "sftp_remote.hpp"
+#include "sftp_writer.hpp"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #define FN_RC_EAGAIN(rc, fn)   (((rc) = (fn)) == LIBSSH2_ERROR_EAGAIN)
 #define FN_ACTUAL_ERROR(err)   ((err) != LIBSSH2_ERROR_EAGAIN)
@@ -69,11 +81,18 @@ enum RemoteOpenDirection_e {
 	SNOD_REMOTE_OPEN_READ = LIBSSH2_FXF_READ,
 	SNOD_REMOTE_OPEN_WRITE
 	= (LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC),
+	SNOD_REMOTE_OPEN_APPEND = (LIBSSH2_FXF_READ | LIBSSH2_FXF_WRITE),
 };
 
 static bool is_inited = false; /**< Whether libssh2 is initialized or nor */
 
+/** shareable connections, keyed by host and credentials */
+static std::mutex                                       conn_mtx;
+static std::map<std::string, std::weak_ptr<SftpConn_t>> conn_list;
+
 static int32_t              waitsocket(SftpWatch_t* ctx);
+static int32_t              prv_waitsocket(libssh2_socket_t sock,
+				 LIBSSH2_SESSION* session, int16_t timeout_sec);
 static int32_t              prv_auth_password(SftpWatch_t* ctx);
 static LIBSSH2_SFTP_HANDLE* prv_open_file(
 	SftpWatch_t* ctx, const char* remote_path, uint8_t direction, long mode);
@@ -84,21 +103,27 @@ static void kbd_callback(const char* name, int name_len,
 
 static int32_t waitsocket(SftpWatch_t* ctx)
 {
-	const int32_t timeout_ms = ctx->timeout_sec * 1000;
+	return prv_waitsocket(ctx->sock, ctx->session, ctx->timeout_sec);
+}
+
+static int32_t prv_waitsocket(
+	libssh2_socket_t sock, LIBSSH2_SESSION* session, int16_t timeout_sec)
+{
+	const int32_t timeout_ms = timeout_sec * 1000;
 	struct pollfd pfd        = {
-			   .fd      = ctx->sock,
+			   .fd      = sock,
 			   .events  = 0,
 			   .revents = 0,
 	};
 
-	int32_t dir = libssh2_session_block_directions(ctx->session);
+	int32_t dir = libssh2_session_block_directions(session);
 
 	if (dir & LIBSSH2_SESSION_BLOCK_INBOUND) pfd.events |= POLLIN;
 
 	if (dir & LIBSSH2_SESSION_BLOCK_OUTBOUND) pfd.events |= POLLOUT;
 
-	// since we only have 1 fd, harcode the size
-	int32_t rc = poll(&pfd, 1, timeout_ms);
+	// since we only have 1 fd, harcode the size. Engine task is suspended
+	int32_t rc = SftpEngine::poll(&pfd, 1, timeout_ms);
 
 	return rc;
 }
@@ -149,6 +174,8 @@ static int32_t prv_auth_password(SftpWatch_t* ctx)
 static LIBSSH2_SFTP_HANDLE* prv_open_file(
 	SftpWatch_t* ctx, const char* remote_path, uint8_t direction, long mode)
 {
+	SNOD_LAT_SCOPE(ctx, LAT_OPEN_FILE);
+
 	LIBSSH2_SFTP_HANDLE* handle = NULL;
 
 	// try to open remote file and wait until socket ready
@@ -179,6 +206,601 @@ static LIBSSH2_SFTP_HANDLE* prv_open_file(
 	return handle;
 }
 
+static std::string prv_conn_key(SftpWatch_t* ctx)
+{
+	// credentials are part of the key, so different users never share session
+	std::string key = ctx->username + "@" + ctx->host + ":"
+		+ std::to_string(ctx->port) + "\n" + ctx->pubkey + "\n" + ctx->privkey
+		+ "\n" + ctx->password + "\n" + (ctx->use_keyboard ? "k" : "p");
+
+	// session negotiated with other algorithms isn't what was asked for
+	const SyncAlgo_t* algo = &ctx->algo;
+
+	key += "\n" + algo->kex + "\n" + algo->hostkey + "\n" + algo->cipher
+		+ "\n" + algo->mac + "\n" + (algo->rank_local ? "r" : "-");
+
+	return key;
+}
+
+/**
+ * @brief deleter of shared connection. Called by the last instance which
+ * releases the connection.
+ * */
+static void prv_conn_free(SftpConn_t* conn)
+{
+	int32_t rc = 0;
+
+	if (conn->session) {
+		while ((rc = libssh2_session_disconnect(conn->session, "normal"))
+			== LIBSSH2_ERROR_EAGAIN) {
+			prv_waitsocket(conn->sock, conn->session, conn->timeout_sec);
+		}
+
+		while ((rc = libssh2_session_free(conn->session))
+			== LIBSSH2_ERROR_EAGAIN) {
+			prv_waitsocket(conn->sock, conn->session, conn->timeout_sec);
+		}
+	}
+
+	if (conn->sock != LIBSSH2_INVALID_SOCKET) {
+		::shutdown(conn->sock, SHUT_RDWR);
+		LIBSSH2_SOCKET_CLOSE(conn->sock);
+	}
+
+	delete conn;
+}
+
+/**
+ * @brief reuse an authenticated connection of another instance.
+ * @return true if connection is found
+ * */
+static bool prv_conn_attach(SftpWatch_t* ctx)
+{
+	std::lock_guard<std::mutex> lock(conn_mtx);
+
+	auto found = conn_list.find(prv_conn_key(ctx));
+	if (found == conn_list.end()) return false;
+
+	std::shared_ptr<SftpConn_t> conn = found->second.lock();
+	if (!conn || conn->is_broken) {
+		conn_list.erase(found);
+		return false;
+	}
+
+	ctx->conn        = conn;
+	ctx->sock        = conn->sock;
+	ctx->session     = conn->session;
+	ctx->fingerprint = conn->fingerprint;
+
+	return true;
+}
+
+static void prv_conn_register(SftpWatch_t* ctx)
+{
+	std::lock_guard<std::mutex> lock(conn_mtx);
+
+	// drop connections which are already released
+	for (auto it = conn_list.begin(); it != conn_list.end();) {
+		if (it->second.expired()) {
+			it = conn_list.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	conn_list[prv_conn_key(ctx)] = ctx->conn;
+}
+
+/** set algorithm preferences of the new session, before handshake */
+static int32_t prv_method_pref(SftpWatch_t* ctx)
+{
+	const SyncAlgo_t* algo   = &ctx->algo;
+	std::string       cipher = algo->cipher;
+
+	if (algo->rank_local) cipher = SftpAlgo::rank(ctx->session, algo->cipher);
+
+	const struct {
+		int                method;
+		const std::string* pref;
+	} prefs[] = {
+		{ LIBSSH2_METHOD_KEX, &algo->kex },
+		{ LIBSSH2_METHOD_HOSTKEY, &algo->hostkey },
+		{ LIBSSH2_METHOD_CRYPT_CS, &cipher },
+		{ LIBSSH2_METHOD_CRYPT_SC, &cipher },
+		{ LIBSSH2_METHOD_MAC_CS, &algo->mac },
+		{ LIBSSH2_METHOD_MAC_SC, &algo->mac },
+	};
+
+	for (const auto& item : prefs) {
+		if (item.pref->empty()) continue;
+
+		int32_t rc = libssh2_session_method_pref(
+			ctx->session, item.method, item.pref->c_str());
+
+		// none of the listed algorithms is supported by libssh2
+		if (rc) {
+			SftpRemote::set_error(ctx);
+			LOG_ERR("Invalid algorithm preference '%s'\n", item.pref->c_str());
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief look up an item in remote snapshot, so its remote stat is known.
+ * @return 1 if found, 0 if its parent directory has been listed without it
+ * (known to be absent), -1 if unknown
+ * */
+static int8_t prv_snap_lookup(
+	SftpWatch_t* ctx, const std::string& name, LIBSSH2_SFTP_ATTRIBUTES* attrs)
+{
+	DirSnapshot_t& snap = ctx->root->remote_snap;
+
+	size_t      pos    = name.find_last_of(SNOD_SEP_CHAR);
+	std::string parent = (pos == std::string::npos)
+		? std::string(SNOD_SEP)
+		: SNOD_SEP + name.substr(0, pos);
+
+	if (!snap.contains(parent)) return -1;
+
+	PathFile_t& list = snap.at(parent);
+	if (!list.contains(name)) return 0;
+
+	*attrs = list.at(name).attrs;
+
+	return 1;
+}
+
+/**
+ * @brief check whether a growing file only has been appended, by comparing
+ * trailing window of the old content on both sides. Local file is left at
+ * unspecified position.
+ * @param size old size, which is the size of the smaller file
+ * @return 0 if the tail is the same, 1 if it differs, or negative if remote
+ * file couldn't be read in time. Unless it's 0, read requests might still be
+ * in flight, so the handle has to be closed instead of being used again.
+ * */
+static int32_t prv_tail_cmp(SftpWatch_t* ctx, LIBSSH2_SFTP_HANDLE* handle,
+	FILE* fd_local, uint64_t size)
+{
+	uint64_t window = std::min<uint64_t>(ctx->append_window, size);
+	uint64_t offset = size - window;
+
+	std::vector<char> local(window);
+	std::vector<char> remote(window);
+
+	if (fseeko(fd_local, static_cast<int64_t>(offset), SEEK_SET)) return 1;
+	if (fread(local.data(), 1, window, fd_local) != window) return 1;
+
+	libssh2_sftp_seek64(handle, offset);
+
+	for (size_t total = 0; total < window;) {
+		ssize_t nread = libssh2_sftp_read(
+			handle, remote.data() + total, window - total);
+
+		if (nread == LIBSSH2_ERROR_EAGAIN) {
+			int32_t rc = waitsocket(ctx);
+
+			if (rc <= 0) return rc ? rc : LIBSSH2_ERROR_TIMEOUT;
+			continue;
+		}
+
+		if (nread < 0) return static_cast<int32_t>(nread);
+
+		// remote file has been truncated since it was listed
+		if (nread == 0) return 1;
+
+		total += static_cast<size_t>(nread);
+	}
+
+	return memcmp(local.data(), remote.data(), window) ? 1 : 0;
+}
+
+/**
+ * @brief close remote handle of an upload which failed before it started,
+ * and remove its temporary file, so staged upload leaves nothing behind.
+ * */
+static void prv_up_abort(SftpWatch_t* ctx, LIBSSH2_SFTP_HANDLE* handle,
+	const std::string& write_file, bool is_staged)
+{
+	int32_t rc = 0;
+
+	if (handle) {
+		WAIT_EAGAIN(ctx, rc, libssh2_sftp_close(handle));
+	}
+
+	if (is_staged) {
+		WAIT_EAGAIN(ctx, rc,
+			libssh2_sftp_unlink(ctx->sftp_session, write_file.c_str()));
+	}
+}
+
+static int32_t prv_rmdir_recursive(SftpWatch_t* ctx, DirItem_t* dir)
+{
+	int32_t rc = 0;
+
+	std::string remote_dir = ctx->root->remote_path + SNOD_SEP + dir->name;
+
+	Directory_t target;
+	target.rela = dir->name;
+	target.path = remote_dir;
+
+	// open remote dir first
+	if ((rc = SftpRemote::open_dir(ctx, &target))) return rc;
+
+	DirItem_t item;
+	while ((rc = SftpRemote::read_dir(ctx, target, &item))) {
+		if (item.name.empty()) continue;
+
+		if (item.type == IS_DIR) {
+			DirItem_t subdir;
+			subdir.name = item.name;
+			prv_rmdir_recursive(ctx, &subdir);
+		} else {
+			SftpRemote::remove(ctx, &item);
+		}
+	}
+
+	SftpRemote::close_dir(ctx, &target);
+
+	WAIT_EAGAIN(
+		ctx, rc, libssh2_sftp_rmdir(ctx->sftp_session, remote_dir.c_str()));
+
+	return rc;
+}
+
+static size_t prv_depth(const std::string& path)
+{
+	return std::count(path.begin(), path.end(), SNOD_SEP_CHAR);
+}
+
+/**
+ * @brief collect remote subtree of a directory, including itself. Remote
+ * snapshot is used if the directory has been listed, otherwise the subtree is
+ * listed once.
+ * */
+static void prv_collect_tree(SftpWatch_t* ctx, DirItem_t* dir,
+	std::vector<std::string>* files, std::vector<std::string>* dirs)
+{
+	DirSnapshot_t& snap   = ctx->root->remote_snap;
+	std::string    prefix = SNOD_SEP + dir->name;
+	std::string    root   = ctx->root->remote_path + SNOD_SEP;
+
+	dirs->push_back(dir->name);
+
+	if (snap.contains(prefix)) {
+		// keys with the same prefix are adjacent in sorted map
+		for (auto it = snap.lower_bound(prefix); it != snap.end(); ++it) {
+			const std::string& key = it->first;
+
+			if (key.compare(0, prefix.size(), prefix)) break;
+
+			// skip sibling with the same prefix, i.e. 'dir-1' for 'dir'
+			bool is_sub = key.size() == prefix.size()
+				|| key[prefix.size()] == SNOD_SEP_CHAR;
+			if (!is_sub) continue;
+
+			for (const auto& [path, item] : it->second) {
+				if (item.type == IS_DIR) {
+					dirs->push_back(item.name);
+				} else {
+					files->push_back(root + item.name);
+				}
+			}
+		}
+	} else {
+		for (size_t i = 0; i < dirs->size(); i++) {
+			Directory_t target;
+			target.rela = (*dirs)[i];
+			target.path = root + target.rela;
+
+			if (SftpRemote::open_dir(ctx, &target)) continue;
+
+			DirItem_t item;
+			while (SftpRemote::read_dir(ctx, target, &item)) {
+				if (item.name.empty()) continue;
+
+				if (item.type == IS_DIR) {
+					dirs->push_back(item.name);
+				} else {
+					files->push_back(root + item.name);
+				}
+			}
+
+			SftpRemote::close_dir(ctx, &target);
+		}
+	}
+
+	// deepest directories first, so each one is empty when it's removed
+	std::stable_sort(dirs->begin(), dirs->end(),
+		[](const std::string& a, const std::string& b) {
+			return prv_depth(a) > prv_depth(b);
+		});
+
+	for (std::string& path : *dirs) path = root + path;
+}
+
+/** SFTP v3 packet types of raw delete requests, see #DeleteChan_t */
+typedef enum FxpType_e {
+	FXP_REMOVE = 13U,
+	FXP_RMDIR  = 15U,
+	FXP_STATUS = 101U,
+} FxpType_t;
+
+/**
+ * Dedicated SFTP channel carrying raw delete requests. libssh2 keeps a single
+ * unlink or rmdir in flight per SFTP channel, so requests are written to the
+ * channel directly, and their status replies are matched by id. The channel
+ * is never used by libssh2 SFTP functions meanwhile, only shut down after.
+ * */
+typedef struct DeleteChan_s {
+	SftpCoro::Channel_t        chan;
+	LIBSSH2_CHANNEL*           channel = nullptr;
+	uint32_t                   next_id = 0;
+	std::string                in;       /**< received bytes of replies */
+	std::map<uint32_t, size_t> inflight; /**< request id to path index */
+	char                       mem[4096];
+} DeleteChan_t;
+
+/** items of one delete step, taken by all channels */
+typedef struct DeleteRun_s {
+	const std::vector<std::string>* paths;
+	size_t                          next   = 0;
+	size_t                          end    = 0;
+	bool                            is_dir = false;
+	uint32_t                        failed = 0; /**< replied with error */
+} DeleteRun_t;
+
+static void prv_put_u32(std::string* out, uint32_t value)
+{
+	const char bytes[4] = {
+		static_cast<char>(value >> 24),
+		static_cast<char>(value >> 16),
+		static_cast<char>(value >> 8),
+		static_cast<char>(value),
+	};
+
+	out->append(bytes, sizeof(bytes));
+}
+
+static uint32_t prv_get_u32(const char* ptr)
+{
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(ptr);
+
+	return (static_cast<uint32_t>(bytes[0]) << 24)
+		| (static_cast<uint32_t>(bytes[1]) << 16)
+		| (static_cast<uint32_t>(bytes[2]) << 8) | bytes[3];
+}
+
+/** take complete status replies. Returns -1 on unexpected reply */
+static int32_t prv_delete_replies(DeleteChan_t* dc, DeleteRun_t* run)
+{
+	size_t pos = 0;
+
+	while (dc->in.size() - pos >= 4) {
+		uint32_t len = prv_get_u32(dc->in.data() + pos);
+
+		// type, id and status code
+		if (len < 9 || len > SFTP_READ_BUFFER_SIZE) return -1;
+		if (dc->in.size() - pos - 4 < len) break;
+
+		const char* pkt   = dc->in.data() + pos + 4;
+		uint32_t    id    = prv_get_u32(pkt + 1);
+		auto        it    = dc->inflight.find(id);
+		bool        is_ok = static_cast<uint8_t>(pkt[0]) == FXP_STATUS
+			&& it != dc->inflight.end();
+
+		if (!is_ok) return -1;
+
+		if (prv_get_u32(pkt + 5) != LIBSSH2_FX_OK) run->failed++;
+
+		dc->inflight.erase(it);
+		pos += 4 + len;
+	}
+
+	dc->in.erase(0, pos);
+
+	return 0;
+}
+
+/**
+ * Each worker keeps up to SNOD_DELETE_WINDOW requests in flight on its own
+ * channel, sending new ones as replies arrive.
+ * */
+static SftpCoro::Task prv_delete_worker(DeleteChan_t* dc, DeleteRun_t* run)
+{
+	std::string out;
+
+	while (run->next < run->end || !dc->inflight.empty()) {
+		out.clear();
+
+		while (run->next < run->end
+			&& dc->inflight.size() < SNOD_DELETE_WINDOW) {
+			const std::string& path = (*run->paths)[run->next];
+
+			// length, type, id and path string
+			prv_put_u32(&out, static_cast<uint32_t>(9 + path.size()));
+			out.push_back(
+				static_cast<char>(run->is_dir ? FXP_RMDIR : FXP_REMOVE));
+			prv_put_u32(&out, dc->next_id);
+			prv_put_u32(&out, static_cast<uint32_t>(path.size()));
+			out.append(path);
+
+			dc->inflight[dc->next_id++] = run->next++;
+		}
+
+		for (size_t off = 0; off < out.size();) {
+			ssize_t nwrite = co_await SftpCoro::channel_write(
+				&dc->chan, dc->channel, out.data() + off, out.size() - off);
+
+			if (nwrite < 0) co_return static_cast<int32_t>(nwrite);
+			off += static_cast<size_t>(nwrite);
+		}
+
+		ssize_t nread = co_await SftpCoro::channel_read(
+			&dc->chan, dc->channel, dc->mem, sizeof(dc->mem));
+
+		// channel closed by the server
+		if (nread <= 0) co_return nread ? static_cast<int32_t>(nread) : -1;
+
+		dc->in.append(dc->mem, static_cast<size_t>(nread));
+
+		if (prv_delete_replies(dc, run)) {
+			LOG_ERR("Unexpected reply of pipelined delete\n");
+			co_return -1;
+		}
+	}
+
+	co_return 0;
+}
+
+static int32_t prv_delete_run(SftpWatch_t* ctx, SftpCoro::Reactor* reactor,
+	std::vector<DeleteChan_t>& chans, DeleteRun_t* run)
+{
+	std::vector<SftpCoro::Task> tasks;
+	std::vector<DeleteChan_t*>  used;
+
+	tasks.reserve(chans.size());
+
+	for (DeleteChan_t& dc : chans) {
+		if (!dc.channel) continue;
+
+		tasks.push_back(prv_delete_worker(&dc, run));
+		used.push_back(&dc);
+		reactor->spawn(tasks.back());
+	}
+
+	int32_t rc = 0;
+
+	if (!tasks.empty()) rc = reactor->run(SNOD_SEC2MS(ctx->timeout_sec));
+	if (rc) return rc;
+
+	// replies of a broken channel won't come, it's no longer used
+	for (size_t i = 0; i < tasks.size(); i++) {
+		if (!tasks[i].result()) continue;
+
+		run->failed += static_cast<uint32_t>(used[i]->inflight.size());
+		used[i]->inflight.clear();
+		used[i]->channel = nullptr;
+	}
+
+	// every channel is broken before all items are sent
+	if (run->next < run->end) {
+		run->failed += static_cast<uint32_t>(run->end - run->next);
+		run->next = run->end;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief delete remote directory tree with many requests in flight. Files
+ * are unlinked first, then directories are removed level by level, deepest
+ * first. Failed items are left for recursive delete.
+ * @param left entries without reply on timeout, relative to remote root
+ * @return 0 if the directory itself is removed, 1 if recursive delete should
+ * be performed, or negative on timeout
+ * */
+static int32_t prv_rmdir_pipelined(
+	SftpWatch_t* ctx, DirItem_t* dir, std::vector<std::string>* left)
+{
+	std::vector<std::string> files;
+	std::vector<std::string> dirs;
+
+	prv_collect_tree(ctx, dir, &files, &dirs);
+
+	SftpCoro::Reactor         reactor;
+	std::vector<DeleteChan_t> chans;
+
+	// small trees fit in the window of a single channel
+	size_t items  = files.size() + dirs.size();
+	size_t n_chan = std::min<size_t>(
+		ctx->delete_channels, items / SNOD_DELETE_WINDOW + 1);
+	if (items < SNOD_DELETE_PIPELINE_MIN) n_chan = 1;
+
+	// main SFTP channel is driven by libssh2, requests use dedicated ones
+	chans.resize(n_chan);
+
+	for (size_t i = 0; i < chans.size(); i++) {
+		if (SftpRemote::open_channel(ctx, &reactor, &chans[i].chan)) {
+			chans.resize(i);
+			break;
+		}
+
+		chans[i].channel = libssh2_sftp_get_channel(chans[i].chan.sftp);
+	}
+
+	if (chans.empty()) return 1;
+
+	DeleteRun_t run;
+	int32_t     rc = 0;
+
+	run.paths = &files;
+	run.end   = files.size();
+	rc        = prv_delete_run(ctx, &reactor, chans, &run);
+
+	// directories with the same depth can be removed concurrently
+	for (size_t begin = 0; !rc && begin < dirs.size();) {
+		size_t depth = prv_depth(dirs[begin]);
+		size_t end   = begin + 1;
+
+		while (end < dirs.size() && prv_depth(dirs[end]) == depth) end++;
+
+		run.paths  = &dirs;
+		run.next   = begin;
+		run.end    = end;
+		run.is_dir = true;
+		rc         = prv_delete_run(ctx, &reactor, chans, &run);
+
+		begin = end;
+	}
+
+	/*
+	 * Requests without reply are abandoned with their channels, main SFTP
+	 * channel has been left untouched, so the session is still usable.
+	 * */
+	size_t root_len = ctx->root->remote_path.size() + 1;
+
+	for (DeleteChan_t& dc : chans) {
+		if (rc) {
+			for (const auto& [id, index] : dc.inflight) {
+				left->push_back((*run.paths)[index].substr(root_len));
+			}
+		}
+
+		SftpRemote::close_channel(ctx, &dc.chan);
+	}
+
+	if (rc) {
+		LOG_ERR("Pipelined delete of '%s' didn't finish [%d], %zu left\n",
+			dir->name.c_str(), rc, left->size());
+		SftpRemote::set_error(ctx, rc, "Pipelined delete didn't finish");
+		return rc;
+	}
+
+	/*
+	 * Snapshot might be outdated, or some items couldn't be deleted. Either
+	 * way a directory is left, so recursive delete should be performed.
+	 * */
+	return run.failed ? 1 : 0;
+}
+
+/**
+ * @brief wait for a file to become stable. Caller holds the session, see
+ * SftpRemote::lock(), it's released meanwhile so other instances sharing it
+ * aren't stalled.
+ * */
+static void prv_delay_stable(SftpWatch_t* ctx)
+{
+	if (ctx->conn) ctx->conn->mtx.unlock();
+
+	SNOD_DELAY_MS(SNOD_WAIT_STABLE);
+
+	if (ctx->conn) ctx->conn->mtx.lock();
+}
+
 } // end of unnamed namespace for static function
 
 void SftpRemote::set_error(SftpWatch_t* ctx)
@@ -241,6 +863,12 @@ int32_t SftpRemote::connect(SftpWatch_t* ctx)
 		is_inited = true;
 	}
 
+	if (ctx->share_conn && prv_conn_attach(ctx)) {
+		LOG_DBG_FINGERPRINT(ctx->fingerprint);
+		ctx->status = SNOD_CONNECTED;
+		return 0;
+	}
+
 	struct addrinfo  hints;
 	struct addrinfo* res = NULL;
 
@@ -301,6 +929,8 @@ int32_t SftpRemote::connect(SftpWatch_t* ctx)
 	libssh2_session_set_timeout(ctx->session, ctx->timeout_sec);
 	libssh2_session_flag(ctx->session, LIBSSH2_FLAG_COMPRESS, 1);
 
+	if (prv_method_pref(ctx)) return -1;
+
 	WAIT_EAGAIN(ctx, rc, libssh2_session_handshake(ctx->session, ctx->sock));
 
 	if (rc) {
@@ -309,12 +939,23 @@ int32_t SftpRemote::connect(SftpWatch_t* ctx)
 		return -1;
 	}
 
+	LOG_DBG("Negotiated cipher %s, mac %s\n",
+		libssh2_session_methods(ctx->session, LIBSSH2_METHOD_CRYPT_CS),
+		libssh2_session_methods(ctx->session, LIBSSH2_METHOD_MAC_CS));
+
 	const char* fp;
 	if ((fp = libssh2_hostkey_hash(ctx->session, SNOD_HOSTKEY_HASH))) {
 		ctx->fingerprint = std::vector<uint8_t>(fp, fp + SNOD_FINGERPRINT_LEN);
 		LOG_DBG_FINGERPRINT(ctx->fingerprint);
 	}
 
+	ctx->conn = std::shared_ptr<SftpConn_t>(new SftpConn_t, prv_conn_free);
+
+	ctx->conn->sock        = ctx->sock;
+	ctx->conn->session     = ctx->session;
+	ctx->conn->timeout_sec = ctx->timeout_sec;
+	ctx->conn->fingerprint = ctx->fingerprint;
+
 	ctx->status = SNOD_CONNECTED;
 
 	return 0;
@@ -327,42 +968,68 @@ int32_t SftpRemote::auth(SftpWatch_t* ctx)
 	int32_t rc;
 
 	/*
-	 * Authentication will prioritize pubkey over password.
-	 * A valid pubkey auth needs both pubkey and privkey to be not empty.
-	 *
-	 * If one of pubkey or privkey is empty, then password authentication will
-	 * be performed only if password is not empty.
-	 *
-	 * Otherwise error will be returned. In short words, a valid auth method
-	 * can be determined based on this condition
-	 *
-	 * `valid = (!pubkey.empty() && !privkey.empty()) || !password.empty()`
+	 * Session isn't registered until it's authenticated, so no other instance
+	 * can be using it here. Shared session is never locked by this function,
+	 * since it's called from JavaScript thread.
 	 * */
 
-	if (!ctx->pubkey.empty() && !ctx->privkey.empty()) {
-		WAIT_EAGAIN(ctx, rc,
-			libssh2_userauth_publickey_fromfile(ctx->session,
-				ctx->username.c_str(), ctx->pubkey.c_str(),
-				ctx->privkey.c_str(), ctx->password.c_str()));
-
-		if (rc) {
-			SftpRemote::set_error(ctx, rc, nullptr);
-			return -1;
-		}
-	} else if (!ctx->password.empty()) {
-		rc = prv_auth_password(ctx);
-		if (rc) {
-			SftpRemote::set_error(ctx);
-			LOG_ERR("Authentication by password failed %d [%s].\n", rc,
-				ctx->username.c_str());
-			return -1;
+	// shared session is already authenticated by another instance
+	if (!ctx->conn->is_authed) {
+		/*
+		 * Authentication will prioritize pubkey over password.
+		 * A valid pubkey auth needs both pubkey and privkey to be not empty.
+		 *
+		 * If one of pubkey or privkey is empty, then password authentication
+		 * will be performed only if password is not empty.
+		 *
+		 * Otherwise error will be returned. In short words, a valid auth method
+		 * can be determined based on this condition
+		 *
+		 * `valid = (!pubkey.empty() && !privkey.empty()) || !password.empty()`
+		 * */
+
+		if (!ctx->pubkey.empty() && !ctx->privkey.empty()) {
+			WAIT_EAGAIN(ctx, rc,
+				libssh2_userauth_publickey_fromfile(ctx->session,
+					ctx->username.c_str(), ctx->pubkey.c_str(),
+					ctx->privkey.c_str(), ctx->password.c_str()));
+
+			if (rc) {
+				SftpRemote::set_error(ctx, rc, nullptr);
+				return -1;
+			}
+		} else if (!ctx->password.empty()) {
+			rc = prv_auth_password(ctx);
+			if (rc) {
+				SftpRemote::set_error(ctx);
+				LOG_ERR("Authentication by password failed %d [%s].\n", rc,
+					ctx->username.c_str());
+				return -1;
+			}
+		} else {
+			SftpRemote::set_error(
+				ctx, -80, "No Valid Authentication is provided");
+			LOG_ERR("No Valid Authentication is provided.\n");
+			return -2;
 		}
-	} else {
-		SftpRemote::set_error(ctx, -80, "No Valid Authentication is provided");
-		LOG_ERR("No Valid Authentication is provided.\n");
-		return -2;
+
+		ctx->conn->is_authed = true;
 	}
 
+	ctx->status = SNOD_AUTHENTICATED;
+
+	if (ctx->share_conn) prv_conn_register(ctx);
+
+	return 0;
+}
+
+int32_t SftpRemote::open_sftp(SftpWatch_t* ctx)
+{
+	if (ctx->status < SNOD_AUTHENTICATED) return -1;
+	if (ctx->sftp_session) return 0;
+
+	std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
+
 	do {
 		ctx->sftp_session = libssh2_sftp_init(ctx->session);
 
@@ -373,11 +1040,21 @@ int32_t SftpRemote::auth(SftpWatch_t* ctx)
 		}
 	} while (!ctx->sftp_session);
 
-	ctx->status = SNOD_AUTHENTICATED;
-
 	return 0;
 }
 
+void SftpRemote::close_sftp(SftpWatch_t* ctx)
+{
+	if (!ctx->sftp_session) return;
+
+	int32_t rc = 0;
+
+	std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
+
+	WAIT_EAGAIN(ctx, rc, libssh2_sftp_shutdown(ctx->sftp_session));
+	ctx->sftp_session = nullptr;
+}
+
 int32_t SftpRemote::close_dir(SftpWatch_t* ctx, Directory_t* dir)
 {
 	if (!dir->is_opened) return 0;
@@ -400,6 +1077,8 @@ int32_t SftpRemote::open_dir(SftpWatch_t* ctx, Directory_t* dir)
 {
 	if (dir->is_opened) SftpRemote::close_dir(ctx, dir);
 
+	SNOD_LAT_SCOPE(ctx, LAT_OPEN_DIR);
+
 	do {
 		dir->handle
 			= libssh2_sftp_opendir(ctx->sftp_session, dir->path.c_str());
@@ -415,8 +1094,11 @@ int32_t SftpRemote::open_dir(SftpWatch_t* ctx, Directory_t* dir)
 	return 0;
 }
 
-int32_t SftpRemote::read_dir(Directory_t& dir, DirItem_t* file)
+int32_t SftpRemote::read_dir(
+	SftpWatch_t* ctx, Directory_t& dir, DirItem_t* file)
 {
+	SNOD_LAT_SCOPE(ctx, LAT_READ_DIR);
+
 	int32_t rc = 0;
 	char    filename[SFTP_FILENAME_MAX_LEN];
 
@@ -428,7 +1110,8 @@ int32_t SftpRemote::read_dir(Directory_t& dir, DirItem_t* file)
 	if (rc > 0) {
 		std::string name(filename);
 
-		if (name == "." || name == "..") {
+		// partially written files aren't synchronized
+		if (name == "." || name == ".." || SftpWatch::is_temp(name)) {
 			file->name           = "";
 			file->type           = IS_INVALID;
 			file->attrs.filesize = 0;
@@ -453,27 +1136,27 @@ void SftpRemote::disconnect(SftpWatch_t* ctx)
 {
 	if (ctx->status == SNOD_DISCONNECTED) return;
 
-	int32_t rc = 0;
+	// already closed by sync thread, unless called from there on reconnection
+	SftpRemote::close_sftp(ctx);
 
-	if (ctx->sftp_session) {
-		WAIT_EAGAIN(ctx, rc, libssh2_sftp_shutdown(ctx->sftp_session));
-		ctx->sftp_session = nullptr;
-	}
+	// session is closed by the last instance which is using it
+	ctx->conn.reset();
 
-	if (ctx->session) {
-		WAIT_EAGAIN(
-			ctx, rc, libssh2_session_disconnect(ctx->session, "normal"));
-		WAIT_EAGAIN(ctx, rc, libssh2_session_free(ctx->session));
-		ctx->sftp_session = nullptr;
-	}
+	ctx->session = nullptr;
+	ctx->sock    = LIBSSH2_INVALID_SOCKET;
+	ctx->status  = SNOD_DISCONNECTED;
+}
 
-	if (ctx->sock != LIBSSH2_INVALID_SOCKET) {
-		// NOTE: this is how to prevent name conflict with extern "C"
-		::shutdown(ctx->sock, SHUT_RDWR);
-		LIBSSH2_SOCKET_CLOSE(ctx->sock);
-	}
+std::unique_lock<EngineMutex_t> SftpRemote::lock(SftpWatch_t* ctx)
+{
+	if (!ctx->conn) return std::unique_lock<EngineMutex_t>();
+
+	return std::unique_lock<EngineMutex_t>(ctx->conn->mtx);
+}
 
-	ctx->status = SNOD_DISCONNECTED;
+void SftpRemote::mark_broken(SftpWatch_t* ctx)
+{
+	if (ctx->conn) ctx->conn->is_broken = true;
 }
 
 void SftpRemote::shutdown()
@@ -493,8 +1176,8 @@ int32_t SftpRemote::down_symlink(SftpWatch_t* ctx, DirItem_t* file)
 	// FIXME: symlink in windows
 	return SftpRemote::down_file(ctx, file);
 #else
-	std::string remote_file = ctx->remote_path + SNOD_SEP + file->name;
-	std::string local_file  = ctx->local_path + SNOD_SEP + file->name;
+	std::string remote_file = ctx->root->remote_path + SNOD_SEP + file->name;
+	std::string local_file  = ctx->root->local_path + SNOD_SEP + file->name;
 	struct stat st;
 
 	int32_t rc        = 0;
@@ -531,10 +1214,14 @@ int32_t SftpRemote::down_symlink(SftpWatch_t* ctx, DirItem_t* file)
 
 int32_t SftpRemote::up_file(SftpWatch_t* ctx, DirItem_t* file)
 {
+	SNOD_LAT_SCOPE(ctx, LAT_UP_FILE);
+
 	int32_t rc = 0;
 
-	std::string remote_file = ctx->remote_path + SNOD_SEP + file->name;
-	std::string local_file  = ctx->local_path + SNOD_SEP + file->name;
+	file->hash.clear();
+
+	std::string remote_file = ctx->root->remote_path + SNOD_SEP + file->name;
+	std::string local_file  = ctx->root->local_path + SNOD_SEP + file->name;
 
 	/*
 	 * FIXME: How to wait until file is stable in non-blocking way?
@@ -543,7 +1230,7 @@ int32_t SftpRemote::up_file(SftpWatch_t* ctx, DirItem_t* file)
 	bool                    is_stable = false;
 	SftpLocal::filestat(ctx, local_file, &attrs);
 	while (!is_stable) {
-		SNOD_DELAY_MS(SNOD_WAIT_STABLE);
+		prv_delay_stable(ctx);
 
 		SftpLocal::filestat(ctx, local_file, &attrs);
 		is_stable = file->attrs.filesize == attrs.filesize;
@@ -551,8 +1238,36 @@ int32_t SftpRemote::up_file(SftpWatch_t* ctx, DirItem_t* file)
 		memcpy(&file->attrs, &attrs, sizeof(attrs));
 	}
 
-	LIBSSH2_SFTP_HANDLE* handle = prv_open_file(ctx, remote_file.c_str(),
-		SNOD_REMOTE_OPEN_WRITE, SNOD_FILE_PERM(file->attrs));
+	/*
+	 * Growing file known to be smaller on remote is opened without truncation,
+	 * only the new tail is written if the old content is still the same.
+	 * */
+	LIBSSH2_SFTP_ATTRIBUTES old_attrs;
+	uint64_t                offset = 0;
+
+	bool is_known = prv_snap_lookup(ctx, file->name, &old_attrs) > 0
+		&& old_attrs.filesize;
+	bool is_append = ctx->append_window && is_known
+		&& old_attrs.filesize < file->attrs.filesize;
+
+	// other changes of existing file only send changed blocks, if possible
+	bool is_delta = !is_append && is_known && ctx->delta.min_size
+		&& file->attrs.filesize >= ctx->delta.min_size;
+
+	if (is_delta && !SftpDelta::up_file(ctx, file)) return 0;
+
+	/*
+	 * Staged upload is written into a temporary file, which replaces the
+	 * destination once it's complete. Appended tail is written in place.
+	 * */
+	bool        is_staged  = ctx->staged && !is_append;
+	std::string write_file = remote_file;
+
+	if (is_staged) write_file = SftpWatch::temp_path(remote_file);
+
+	LIBSSH2_SFTP_HANDLE* handle = prv_open_file(ctx, write_file.c_str(),
+		is_append ? SNOD_REMOTE_OPEN_APPEND : SNOD_REMOTE_OPEN_WRITE,
+		SNOD_FILE_PERM(file->attrs));
 
 	if (!handle) {
 		SftpRemote::set_error(ctx);
@@ -564,22 +1279,88 @@ int32_t SftpRemote::up_file(SftpWatch_t* ctx, DirItem_t* file)
 	if (!fd_local) {
 		SftpLocal::set_error(ctx);
 		LOG_ERR("Error opening file '%s'!\n", local_file.c_str());
+		prv_up_abort(ctx, handle, write_file, is_staged);
 		return -2;
 	}
 
+	int32_t tail_rc = 1;
+
+	if (is_append) {
+		tail_rc = prv_tail_cmp(ctx, handle, fd_local, old_attrs.filesize);
+	}
+
+	if (is_append && !tail_rc) {
+		offset = old_attrs.filesize;
+		SNOD_STAT_ADD(ctx, appends, 1);
+		SNOD_STAT_ADD(ctx, bytes_saved, offset);
+	} else if (is_append) {
+		// content has been changed, start over with truncated file
+		if (tail_rc < 0) {
+			SftpRemote::set_error(ctx, tail_rc, "Unable to read remote tail");
+			prv_up_abort(ctx, handle, write_file, is_staged);
+			fclose(fd_local);
+			return -3;
+		}
+
+		int32_t close_rc = 0;
+		WAIT_EAGAIN(ctx, close_rc, libssh2_sftp_close(handle));
+
+		is_staged = ctx->staged;
+		if (is_staged) write_file = SftpWatch::temp_path(remote_file);
+
+		handle = prv_open_file(ctx, write_file.c_str(),
+			SNOD_REMOTE_OPEN_WRITE, SNOD_FILE_PERM(file->attrs));
+
+		if (!handle) {
+			SftpRemote::set_error(ctx);
+			fclose(fd_local);
+			return -3;
+		}
+	}
+
+	// whole content is hashed, the kept head is read from the local file
+	Hash_t hash;
+	bool   is_hashed = ctx->checksum && !SftpHash::init(&hash)
+		&& !SftpHash::update_file(&hash, fd_local, 0, offset);
+
+	libssh2_sftp_seek64(handle, offset);
+
+	// large file is mapped, chunks are written from the mapping directly
+	LocalReader_t reader;
+	SftpReader::open(ctx, &reader, fd_local, offset, file->attrs.filesize);
+
 	// connection loop, check if socket is ready
-	int32_t nwritten = 0;
+	int32_t  nwritten   = 0;
+	uint64_t remote_pos = offset;
 	do {
-		char* ptr;
-		char  mem[SFTP_READ_BUFFER_SIZE];
+		const char* ptr;
 
-		int32_t nread = fread(mem, 1, SFTP_READ_BUFFER_SIZE, fd_local);
-		if (nread <= 0) {
+		int64_t nread = SftpReader::next(&reader, &ptr);
+		if (nread < 0) {
+			rc = -2;
+			SftpLocal::set_error(ctx);
+			LOG_ERR("Error reading file '%s'!\n", local_file.c_str());
 			break;
+		} else if (nread == 0) {
+			break;
+		}
+
+		// hole of sparse file is skipped, it's left unwritten on remote too
+		if (reader.chunk_off != remote_pos) {
+			uint64_t hole = reader.chunk_off - remote_pos;
+
+			if (is_hashed) SftpHash::update_zeros(&hash, hole);
+			SNOD_STAT_ADD(ctx, bytes_saved, hole);
+
+			libssh2_sftp_seek64(handle, reader.chunk_off);
+			remote_pos = reader.chunk_off;
 		}
 
-		rc  = 0;
-		ptr = mem;
+		remote_pos += static_cast<uint64_t>(nread);
+
+		if (is_hashed) SftpHash::update(&hash, ptr, nread);
+
+		rc = 0;
 
 		// write to remote untill all read bytes are written
 		do {
@@ -605,37 +1386,92 @@ int32_t SftpRemote::up_file(SftpWatch_t* ctx, DirItem_t* file)
 
 			if (nwritten < 0) break;
 
-			ptr = &mem[nwritten];
+			SNOD_STAT_ADD(ctx, bytes_up, nwritten);
+
+			ptr += nwritten;
 			nread -= nwritten;
 		} while (nread > 0 && !rc);
 	} while (nwritten > 0);
 
+	// trailing hole only exists as file size
+	uint64_t size = std::max<uint64_t>(remote_pos, file->attrs.filesize);
+
+	if (!rc && reader.is_sparse && remote_pos < size) {
+		if (is_hashed) SftpHash::update_zeros(&hash, size - remote_pos);
+		SNOD_STAT_ADD(ctx, bytes_saved, size - remote_pos);
+	}
+
+	if (!rc && is_hashed) file->hash = SftpHash::finish(&hash);
+
+	/*
+	 * Set attributes on the opened handle instead of path based SETSTAT after
+	 * closing, the request doesn't need to resolve path again. All writes are
+	 * already acknowledged, so mtime won't be changed afterward.
+	 * */
+	if (!rc) {
+		SNOD_LAT_SCOPE(ctx, LAT_SET_FILESTAT);
+
+		// create copy to preserve original in case failure happens
+		LIBSSH2_SFTP_ATTRIBUTES remote_attrs = file->attrs;
+		int32_t                 stat_rc      = 0;
+
+		if (reader.is_sparse) {
+			remote_attrs.filesize = size;
+			remote_attrs.flags |= LIBSSH2_SFTP_ATTR_SIZE;
+		}
+
+		WAIT_EAGAIN(ctx, stat_rc, libssh2_sftp_fsetstat(handle, &remote_attrs));
+		if (stat_rc) SftpRemote::set_error(ctx);
+	}
+
 	// close both sftp and file handle
-	while (FN_RC_EAGAIN(rc, libssh2_sftp_close(handle))) {
+	int32_t close_rc = 0;
+	while (FN_RC_EAGAIN(close_rc, libssh2_sftp_close(handle))) {
 		waitsocket(ctx);
 	}
 	fclose(fd_local);
 
-	SftpRemote::set_filestat(ctx, remote_file, &file->attrs);
+	if (!is_staged) return rc;
+
+	if (!rc && (rc = SftpRemote::replace(ctx, write_file, remote_file))) {
+		SftpRemote::set_error(ctx);
+	}
+
+	/*
+	 * Partial temporary file is never left behind. Complete one is the only
+	 * copy when the target is already removed, it's overwritten by retry.
+	 * */
+	if (rc && rc != SNOD_REPLACE_REMOVED) {
+		int32_t unlink_rc = 0;
+		WAIT_EAGAIN(ctx, unlink_rc,
+			libssh2_sftp_unlink(ctx->sftp_session, write_file.c_str()));
+	}
 
 	return rc;
 }
 
 int32_t SftpRemote::down_file(SftpWatch_t* ctx, DirItem_t* file)
 {
+	SNOD_LAT_SCOPE(ctx, LAT_DOWN_FILE);
+
 	int32_t rc = 0;
 
-	std::string remote_file = ctx->remote_path + SNOD_SEP + file->name;
-	std::string local_file  = ctx->local_path + SNOD_SEP + file->name;
+	file->hash.clear();
+
+	std::string remote_file = ctx->root->remote_path + SNOD_SEP + file->name;
+	std::string local_file  = ctx->root->local_path + SNOD_SEP + file->name;
 
 	/*
 	 * FIXME: How to wait until file is stable in non-blocking way?
 	 * */
 	LIBSSH2_SFTP_ATTRIBUTES attrs;
 	bool                    is_stable = false;
-	SftpRemote::get_filestat(ctx, remote_file, &attrs);
+
+	// scanned attributes are the first sample, compare them with a new stat
+	SNOD_STAT_ADD(ctx, rtt_saved, 1);
+
 	while (!is_stable) {
-		SNOD_DELAY_MS(SNOD_WAIT_STABLE);
+		prv_delay_stable(ctx);
 
 		SftpRemote::get_filestat(ctx, remote_file, &attrs);
 		is_stable = file->attrs.filesize == attrs.filesize;
@@ -643,6 +1479,22 @@ int32_t SftpRemote::down_file(SftpWatch_t* ctx, DirItem_t* file)
 		memcpy(&file->attrs, &attrs, sizeof(attrs));
 	}
 
+	/*
+	 * Changed file which exists on local only fetches changed blocks, unless
+	 * it's a growing file, which is left for append check below.
+	 * */
+	struct stat st;
+	bool        is_delta = ctx->delta.min_size
+		&& file->attrs.filesize >= ctx->delta.min_size
+		&& !stat(local_file.c_str(), &st) && st.st_size > 0;
+
+	if (is_delta && ctx->append_window
+		&& static_cast<uint64_t>(st.st_size) < file->attrs.filesize) {
+		is_delta = false;
+	}
+
+	if (is_delta && !SftpDelta::down_file(ctx, file)) return 0;
+
 	LIBSSH2_SFTP_HANDLE* handle
 		= prv_open_file(ctx, remote_file.c_str(), SNOD_REMOTE_OPEN_READ, 0);
 
@@ -651,25 +1503,114 @@ int32_t SftpRemote::down_file(SftpWatch_t* ctx, DirItem_t* file)
 		return -3;
 	}
 
-	FILE* fd_local = fopen(local_file.c_str(), "wb");
+	/*
+	 * Growing file which is smaller on local is kept, only the new tail is
+	 * downloaded if the old content is still the same.
+	 * */
+	FILE*    fd_local = NULL;
+	uint64_t offset   = 0;
+
+	if (ctx->append_window) fd_local = fopen(local_file.c_str(), "rb");
 
-	if (!fd_local) {
+	if (fd_local) {
+		struct stat st;
+		uint64_t    size = 0;
+
+		if (!fstat(fileno(fd_local), &st)) size = st.st_size;
+
+		bool    is_grown = size && size < file->attrs.filesize;
+		int32_t tail_rc  = 1;
+
+		if (is_grown) tail_rc = prv_tail_cmp(ctx, handle, fd_local, size);
+
+		if (!tail_rc) {
+			offset = size;
+			SNOD_STAT_ADD(ctx, appends, 1);
+			SNOD_STAT_ADD(ctx, bytes_saved, offset);
+		} else {
+			fclose(fd_local);
+			fd_local = NULL;
+		}
+
+		// reads of the tail might still be in flight, don't reuse the handle
+		if (is_grown && tail_rc) {
+			int32_t close_rc = 0;
+			WAIT_EAGAIN(ctx, close_rc, libssh2_sftp_close(handle));
+
+			if (tail_rc < 0) {
+				SftpRemote::set_error(
+					ctx, tail_rc, "Unable to read remote tail");
+				return -3;
+			}
+
+			handle = prv_open_file(
+				ctx, remote_file.c_str(), SNOD_REMOTE_OPEN_READ, 0);
+
+			if (!handle) {
+				SftpRemote::set_error(ctx);
+				return -3;
+			}
+		}
+	}
+
+	// whole content is hashed, the kept head is read from the local file
+	Hash_t hash;
+	bool   is_hashed = ctx->checksum && !SftpHash::init(&hash)
+		&& (!fd_local || !SftpHash::update_file(&hash, fd_local, 0, offset));
+
+	if (fd_local) fclose(fd_local);
+
+	/*
+	 * Staged download is written into a temporary file, which replaces the
+	 * destination once it's complete. Appended tail is written in place.
+	 * */
+	bool        is_staged  = ctx->staged && !offset;
+	std::string write_file = local_file;
+
+	if (is_staged) write_file = SftpWatch::stage_path(ctx, local_file);
+
+	// new content is written in large blocks, see sftp_writer.hpp
+	LocalWriter_t       writer;
+	SftpPool::PoolBuf_t buf(&ctx->buffers);
+
+	if (!buf.mem
+		|| SftpWriter::open(
+			ctx, &writer, write_file, offset, file->attrs.filesize)) {
 		SftpLocal::set_error(ctx);
-		LOG_ERR("Error opening file '%s'!\n", local_file.c_str());
+		LOG_ERR("Error opening file '%s'!\n", write_file.c_str());
+
+		int32_t close_rc = 0;
+		WAIT_EAGAIN(ctx, close_rc, libssh2_sftp_close(handle));
 		return -2;
 	}
 
+	libssh2_sftp_seek64(handle, offset);
+
 	// connection loop, check if socket is ready
 	while (1) {
 		int32_t nread = 0;
 
 		// remote read loop, loop until failed or no remaining bytes
 		do {
-			char mem[SFTP_READ_BUFFER_SIZE];
-			nread = libssh2_sftp_read(handle, mem, sizeof(mem));
-			if (nread > 0) fwrite(mem, static_cast<size_t>(nread), 1, fd_local);
+			nread = libssh2_sftp_read(handle, buf.mem, buf.size);
+			if (nread <= 0) break;
+
+			rc = SftpWriter::write(
+				&writer, buf.mem, static_cast<size_t>(nread));
+
+			if (rc) {
+				errno = rc;
+				SftpLocal::set_error(ctx);
+				LOG_ERR("Failed to write file '%s'!\n", local_file.c_str());
+				break;
+			}
+
+			if (is_hashed) SftpHash::update(&hash, buf.mem, nread);
+			SNOD_STAT_ADD(ctx, bytes_down, nread);
 		} while (nread > 0);
 
+		if (rc) break;
+
 		// error or end of file
 		if (nread != LIBSSH2_ERROR_EAGAIN) {
 			if (nread < 0) rc = nread;
@@ -695,12 +1636,26 @@ int32_t SftpRemote::down_file(SftpWatch_t* ctx, DirItem_t* file)
 	}
 
 	// close both sftp and file handle
-	WAIT_EAGAIN(ctx, rc, libssh2_sftp_close(handle));
+	int32_t close_rc = 0;
+	WAIT_EAGAIN(ctx, close_rc, libssh2_sftp_close(handle));
+	if (!rc) rc = close_rc;
 
-	fclose(fd_local);
+	int32_t write_rc = SftpWriter::close(ctx, &writer);
 
-	// return now if error
-	if (rc) return rc;
+	if (write_rc && !rc) {
+		rc    = write_rc;
+		errno = write_rc;
+		SftpLocal::set_error(ctx);
+		LOG_ERR("Failed to write file '%s'!\n", local_file.c_str());
+	}
+
+	// return now if error, partial temporary file is never left behind
+	if (rc) {
+		if (is_staged) ::remove(write_file.c_str());
+		return rc;
+	}
+
+	if (is_hashed) file->hash = SftpHash::finish(&hash);
 
 	// set modification time for local file to match the remote one
 	// this must be done AFTER CLOSING the file handle
@@ -710,27 +1665,37 @@ int32_t SftpRemote::down_file(SftpWatch_t* ctx, DirItem_t* file)
 	};
 
 	// set modified & access time time to match remote
-	if (utime(local_file.c_str(), &times)) {
+	if (utime(write_file.c_str(), &times)) {
 		SftpLocal::set_error(ctx);
 		LOG_ERR("Failed to set mtime [%d]\n", errno);
 	}
 
 #ifdef _POSIX_VERSION
 	// set file attribute to match remote. non-windows only
-	if (chmod(local_file.c_str(), SNOD_FILE_PERM(file->attrs))) {
+	if (chmod(write_file.c_str(), SNOD_FILE_PERM(file->attrs))) {
 		SftpLocal::set_error(ctx);
 		LOG_ERR("Failed to set attributes: %d\n", errno);
 	}
 #endif
 
+	// staging directory must be on the same file system as the destination
+	if (is_staged && ::rename(write_file.c_str(), local_file.c_str())) {
+		rc = -2;
+		SftpLocal::set_error(ctx);
+		LOG_ERR("Failed to replace file '%s'!\n", local_file.c_str());
+		::remove(write_file.c_str());
+	}
+
 	return rc;
 }
 
 int32_t SftpRemote::remove(SftpWatch_t* ctx, DirItem_t* file)
 {
+	SNOD_LAT_SCOPE(ctx, LAT_REMOVE);
+
 	int32_t rc = 0;
 
-	std::string remote_file = ctx->remote_path + SNOD_SEP + file->name;
+	std::string remote_file = ctx->root->remote_path + SNOD_SEP + file->name;
 
 	WAIT_EAGAIN(
 		ctx, rc, libssh2_sftp_unlink(ctx->sftp_session, remote_file.c_str()));
@@ -738,6 +1703,65 @@ int32_t SftpRemote::remove(SftpWatch_t* ctx, DirItem_t* file)
 	return rc;
 }
 
+int32_t SftpRemote::rename(SftpWatch_t* ctx, DirItem_t* from, DirItem_t* to)
+{
+	SNOD_LAT_SCOPE(ctx, LAT_RENAME);
+
+	int32_t rc = 0;
+
+	std::string remote_from = ctx->root->remote_path + SNOD_SEP + from->name;
+	std::string remote_to   = ctx->root->remote_path + SNOD_SEP + to->name;
+
+	// never overwrite, destination is known to be absent from snapshots
+	long flags = LIBSSH2_SFTP_RENAME_ATOMIC | LIBSSH2_SFTP_RENAME_NATIVE;
+
+	WAIT_EAGAIN(ctx, rc,
+		libssh2_sftp_rename_ex(ctx->sftp_session, remote_from.c_str(),
+			static_cast<unsigned int>(remote_from.length()), remote_to.c_str(),
+			static_cast<unsigned int>(remote_to.length()), flags));
+
+	return rc;
+}
+
+int32_t SftpRemote::replace(
+	SftpWatch_t* ctx, const std::string& from, const std::string& to)
+{
+	SNOD_LAT_SCOPE(ctx, LAT_RENAME);
+
+	int32_t rc = 0;
+
+	WAIT_EAGAIN(ctx, rc,
+		libssh2_sftp_posix_rename_ex(ctx->sftp_session, from.c_str(),
+			from.length(), to.c_str(), to.length()));
+
+	if (!rc) return 0;
+
+	// other failures would fail plain rename as well, target is kept then
+	if (rc != LIBSSH2_ERROR_SFTP_PROTOCOL
+		|| libssh2_sftp_last_error(ctx->sftp_session)
+			!= LIBSSH2_FX_OP_UNSUPPORTED) {
+		return rc;
+	}
+
+	/*
+	 * SFTP v3 rename fails on existing target. Without posix-rename extension
+	 * the target is removed first, which isn't atomic anymore.
+	 * */
+	WAIT_EAGAIN(ctx, rc, libssh2_sftp_unlink(ctx->sftp_session, to.c_str()));
+
+	bool is_removed = !rc;
+
+	WAIT_EAGAIN(ctx, rc,
+		libssh2_sftp_rename_ex(ctx->sftp_session, from.c_str(),
+			static_cast<unsigned int>(from.length()), to.c_str(),
+			static_cast<unsigned int>(to.length()),
+			LIBSSH2_SFTP_RENAME_ATOMIC | LIBSSH2_SFTP_RENAME_NATIVE));
+
+	if (rc && is_removed) return SNOD_REPLACE_REMOVED;
+
+	return rc;
+}
+
 int32_t SftpRemote::mkdir(SftpWatch_t* ctx, DirItem_t* dir)
 {
 	/*
@@ -750,18 +1774,37 @@ int32_t SftpRemote::mkdir(SftpWatch_t* ctx, DirItem_t* dir)
 	 * basically do nothing.
 	 * */
 
+	SNOD_LAT_SCOPE(ctx, LAT_MKDIR);
+
 	int32_t rc = 0;
 
-	std::string remote_dir = ctx->remote_path + SNOD_SEP + dir->name;
+	std::string remote_dir = ctx->root->remote_path + SNOD_SEP + dir->name;
 	long        mode       = SNOD_FILE_PERM(dir->attrs);
 
 	LIBSSH2_SFTP_ATTRIBUTES attrs;
 
+	memset(&attrs, 0, sizeof(attrs));
+
+	// skip stat if remote snapshot already knows whether the directory exists
+	int8_t known  = prv_snap_lookup(ctx, dir->name, &attrs);
+	bool   exists = known > 0;
+
+	if (known < 0) {
+		exists = !SftpRemote::get_filestat(ctx, remote_dir, &attrs);
+	} else {
+		SNOD_STAT_ADD(ctx, rtt_saved, 1);
+	}
+
 	// create directory if it doesn't exist yet
-	if (SftpRemote::get_filestat(ctx, remote_dir, &attrs)) {
+	if (!exists) {
 		WAIT_EAGAIN(ctx, rc,
 			libssh2_sftp_mkdir(ctx->sftp_session, remote_dir.c_str(), mode));
 
+		// snapshot is outdated, directory has been created meanwhile
+		if (rc && !known) {
+			rc = SftpRemote::get_filestat(ctx, remote_dir, &attrs);
+		}
+
 		if (rc) {
 			SftpRemote::set_error(ctx);
 			return rc;
@@ -786,43 +1829,25 @@ int32_t SftpRemote::mkdir(SftpWatch_t* ctx, DirItem_t* dir)
 	return rc;
 }
 
-int32_t SftpRemote::rmdir(SftpWatch_t* ctx, DirItem_t* dir)
+int32_t SftpRemote::rmdir(
+	SftpWatch_t* ctx, DirItem_t* dir, std::vector<std::string>* left)
 {
-	int32_t rc = 0;
-
-	std::string remote_dir = ctx->remote_path + SNOD_SEP + dir->name;
+	std::vector<std::string> ignored;
 
-	Directory_t target;
-	target.rela = dir->name;
-	target.path = remote_dir;
-
-	// open remote dir first
-	if ((rc = SftpRemote::open_dir(ctx, &target))) return rc;
-
-	DirItem_t item;
-	while ((rc = SftpRemote::read_dir(target, &item))) {
-		if (item.name.empty()) continue;
-
-		if (item.type == IS_DIR) {
-			DirItem_t subdir;
-			subdir.name = item.name;
-			SftpRemote::rmdir(ctx, &subdir);
-		} else {
-			SftpRemote::remove(ctx, &item);
-		}
+	if (ctx->delete_channels > 1) {
+		int32_t rc = prv_rmdir_pipelined(ctx, dir, left ? left : &ignored);
+		if (rc <= 0) return rc;
 	}
 
-	SftpRemote::close_dir(ctx, &target);
-
-	WAIT_EAGAIN(
-		ctx, rc, libssh2_sftp_rmdir(ctx->sftp_session, remote_dir.c_str()));
-
-	return rc;
+	// some items are left or pipelined delete isn't available
+	return prv_rmdir_recursive(ctx, dir);
 }
 
 int32_t SftpRemote::set_filestat(
 	SftpWatch_t* ctx, std::string& path, LIBSSH2_SFTP_ATTRIBUTES* attrs)
 {
+	SNOD_LAT_SCOPE(ctx, LAT_SET_FILESTAT);
+
 	int32_t rc = 0;
 
 	// create copy to preserve original in case failure happens
@@ -835,9 +1860,25 @@ int32_t SftpRemote::set_filestat(
 	return rc;
 }
 
+int32_t SftpRemote::set_attrs(SftpWatch_t* ctx, DirItem_t* file)
+{
+	std::string remote_file = ctx->root->remote_path + SNOD_SEP + file->name;
+
+	// size and owner are left as they are
+	LIBSSH2_SFTP_ATTRIBUTES attrs = file->attrs;
+	attrs.flags = LIBSSH2_SFTP_ATTR_PERMISSIONS | LIBSSH2_SFTP_ATTR_ACMODTIME;
+
+	int32_t rc = SftpRemote::set_filestat(ctx, remote_file, &attrs);
+	if (rc) SftpRemote::set_error(ctx);
+
+	return rc;
+}
+
 int32_t SftpRemote::get_filestat(
 	SftpWatch_t* ctx, std::string& path, LIBSSH2_SFTP_ATTRIBUTES* attrs)
 {
+	SNOD_LAT_SCOPE(ctx, LAT_GET_FILESTAT);
+
 	int32_t rc = 0;
 
 	WAIT_EAGAIN(ctx, rc,
@@ -848,3 +1889,202 @@ int32_t SftpRemote::get_filestat(
 
 	return rc;
 }
+
+int32_t SftpRemote::open_channel(
+	SftpWatch_t* ctx, SftpCoro::Reactor* reactor, SftpCoro::Channel_t* chan)
+{
+	if (ctx->status < SNOD_AUTHENTICATED) return -1;
+
+	LIBSSH2_SFTP* sftp = nullptr;
+
+	// additional SFTP channel on the same session, for coroutine operations
+	do {
+		sftp = libssh2_sftp_init(ctx->session);
+
+		if (!sftp) {
+			if (FN_LAST_ERRNO_ERROR(ctx->session)) {
+				SftpRemote::set_error(ctx);
+				LOG_ERR("Unable to init SFTP channel\n");
+				return -3;
+			}
+
+			waitsocket(ctx);
+		}
+	} while (!sftp);
+
+	chan->reactor = reactor;
+	chan->session = ctx->session;
+	chan->sftp    = sftp;
+	chan->sock    = ctx->sock;
+
+	return 0;
+}
+
+void SftpRemote::close_channel(SftpWatch_t* ctx, SftpCoro::Channel_t* chan)
+{
+	if (!chan->sftp) return;
+
+	int32_t rc = 0;
+
+	WAIT_EAGAIN(ctx, rc, libssh2_sftp_shutdown(chan->sftp));
+	chan->sftp = nullptr;
+}
+
+int32_t SftpRemote::exec(
+	SftpWatch_t* ctx, const std::string& cmd, std::string* out)
+{
+	LIBSSH2_CHANNEL* channel = nullptr;
+
+	int32_t rc = SftpRemote::exec_open(ctx, cmd, &channel);
+	if (rc) return rc;
+
+	SftpPool::PoolBuf_t buf(&ctx->buffers);
+
+	while (buf.mem) {
+		ssize_t nread
+			= SftpRemote::exec_read(ctx, channel, buf.mem, buf.size);
+
+		// error or end of file
+		if (nread <= 0) {
+			rc = static_cast<int32_t>(nread);
+			break;
+		}
+
+		out->append(buf.mem, static_cast<size_t>(nread));
+	}
+
+	if (!buf.mem) rc = -1;
+
+	int32_t exit_rc = SftpRemote::exec_close(ctx, channel);
+
+	return rc ? rc : exit_rc;
+}
+
+int32_t SftpRemote::exec_open(
+	SftpWatch_t* ctx, const std::string& cmd, LIBSSH2_CHANNEL** channel)
+{
+	int32_t rc = 0;
+
+	do {
+		*channel = libssh2_channel_open_session(ctx->session);
+
+		if (!*channel) {
+			if (FN_LAST_ERRNO_ERROR(ctx->session)) {
+				SftpRemote::set_error(ctx);
+				LOG_ERR("Unable to open exec channel\n");
+				return libssh2_session_last_errno(ctx->session);
+			}
+
+			waitsocket(ctx);
+		}
+	} while (!*channel);
+
+	// unread stderr would fill up channel window, and the command would hang
+	WAIT_EAGAIN(ctx, rc,
+		libssh2_channel_handle_extended_data2(
+			*channel, LIBSSH2_CHANNEL_EXTENDED_DATA_IGNORE));
+
+	WAIT_EAGAIN(ctx, rc, libssh2_channel_exec(*channel, cmd.c_str()));
+
+	if (rc) {
+		int32_t free_rc = 0;
+
+		SftpRemote::set_error(ctx);
+		WAIT_EAGAIN(ctx, free_rc, libssh2_channel_free(*channel));
+		*channel = nullptr;
+		return rc;
+	}
+
+	return 0;
+}
+
+ssize_t SftpRemote::exec_read(
+	SftpWatch_t* ctx, LIBSSH2_CHANNEL* channel, char* mem, size_t len)
+{
+	while (1) {
+		ssize_t nread = libssh2_channel_read(channel, mem, len);
+
+		if (nread != LIBSSH2_ERROR_EAGAIN) {
+			if (nread < 0) SftpRemote::set_error(ctx);
+			return nread;
+		}
+
+		if (waitsocket(ctx) <= 0) return LIBSSH2_ERROR_TIMEOUT;
+	}
+}
+
+int32_t SftpRemote::exec_write(
+	SftpWatch_t* ctx, LIBSSH2_CHANNEL* channel, const char* mem, size_t len)
+{
+	while (len) {
+		ssize_t nwritten = libssh2_channel_write(channel, mem, len);
+
+		if (nwritten == LIBSSH2_ERROR_EAGAIN) {
+			if (waitsocket(ctx) <= 0) return LIBSSH2_ERROR_TIMEOUT;
+			continue;
+		}
+
+		if (nwritten < 0) {
+			SftpRemote::set_error(ctx);
+			return static_cast<int32_t>(nwritten);
+		}
+
+		mem += nwritten;
+		len -= static_cast<size_t>(nwritten);
+	}
+
+	return 0;
+}
+
+int32_t SftpRemote::exec_eof(SftpWatch_t* ctx, LIBSSH2_CHANNEL* channel)
+{
+	int32_t rc = 0;
+
+	WAIT_EAGAIN(ctx, rc, libssh2_channel_send_eof(channel));
+	if (rc) SftpRemote::set_error(ctx);
+
+	return rc;
+}
+
+int32_t SftpRemote::exec_close(
+	SftpWatch_t* ctx, LIBSSH2_CHANNEL* channel, bool is_eof)
+{
+	int32_t rc = 0;
+
+	// command reading standard input finishes on end of file
+	if (!is_eof) WAIT_EAGAIN(ctx, rc, libssh2_channel_send_eof(channel));
+
+	// the rest of output is discarded, exit status comes after it
+	SftpPool::PoolBuf_t buf(&ctx->buffers);
+
+	while (buf.mem && !libssh2_channel_eof(channel)) {
+		ssize_t nread
+			= SftpRemote::exec_read(ctx, channel, buf.mem, buf.size);
+
+		if (nread <= 0) break;
+	}
+
+	WAIT_EAGAIN(ctx, rc, libssh2_channel_close(channel));
+	WAIT_EAGAIN(ctx, rc, libssh2_channel_wait_closed(channel));
+
+	int32_t exit_rc = rc ? rc : libssh2_channel_get_exit_status(channel);
+
+	WAIT_EAGAIN(ctx, rc, libssh2_channel_free(channel));
+
+	return exit_rc;
+}
+
+std::string SftpRemote::quote(const std::string& arg)
+{
+	std::string res = "'";
+
+	for (char c : arg) {
+		if (c == '\'') {
+			res += "'\\''";
+		} else {
+			res += c;
+		}
+	}
+
+	return res + "'";
+}
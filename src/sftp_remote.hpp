@@ -1,8 +1,15 @@
 #ifndef _SFTP_REMOTE_HPP
 #define _SFTP_REMOTE_HPP
 
+#include "sftp_coro.hpp"
 #include "sftp_watch.hpp"
 #include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/** replace() removed the target, but couldn't rename the source over it */
+#define SNOD_REPLACE_REMOVED 1
 
 namespace SftpRemote {
 
@@ -12,20 +19,96 @@ void    set_error(SftpWatch_t* ctx, int32_t rc, const char* msg);
 int32_t connect(SftpWatch_t* ctx);
 void    disconnect(SftpWatch_t* ctx);
 int32_t auth(SftpWatch_t* ctx);
+
+/**
+ * @brief open and close SFTP channel of the instance on its session. Shared
+ * session is locked, so they're called from sync thread only, never from
+ * JavaScript thread.
+ * */
+int32_t open_sftp(SftpWatch_t* ctx);
+void    close_sftp(SftpWatch_t* ctx);
+
 int32_t open_dir(SftpWatch_t* ctx, Directory_t* dir);
 int32_t close_dir(SftpWatch_t* ctx, Directory_t* dir);
 int32_t mkdir(SftpWatch_t* ctx, DirItem_t* dir);
-int32_t rmdir(SftpWatch_t* ctx, DirItem_t* dir);
-int32_t read_dir(Directory_t& dir, DirItem_t* file);
+
+/**
+ * @brief delete remote directory tree, see #SftpWatch_t::delete_channels.
+ * @param left entries still waiting for reply when pipelined delete timed
+ * out, relative to remote root. Optional
+ * */
+int32_t rmdir(SftpWatch_t* ctx, DirItem_t* dir,
+	std::vector<std::string>* left = nullptr);
+
+int32_t read_dir(SftpWatch_t* ctx, Directory_t& dir, DirItem_t* file);
 int32_t down_symlink(SftpWatch_t* ctx, DirItem_t* file);
 int32_t down_file(SftpWatch_t* ctx, DirItem_t* file);
 int32_t up_file(SftpWatch_t* ctx, DirItem_t* file);
 int32_t remove(SftpWatch_t* ctx, DirItem_t* file);
+int32_t rename(SftpWatch_t* ctx, DirItem_t* from, DirItem_t* to);
 int32_t set_filestat(
 	SftpWatch_t* ctx, std::string& path, LIBSSH2_SFTP_ATTRIBUTES* attrs);
 int32_t get_filestat(
 	SftpWatch_t* ctx, std::string& path, LIBSSH2_SFTP_ATTRIBUTES* attrs);
 
+/**
+ * @brief rename remote path replacing existing target, atomically if the
+ * server supports posix-rename@openssh.com. Otherwise the target is removed
+ * first.
+ * @return 0 on success, #SNOD_REPLACE_REMOVED, or negative libssh2 error
+ * */
+int32_t replace(
+	SftpWatch_t* ctx, const std::string& from, const std::string& to);
+
+/** set times and permission of remote file to match the item */
+int32_t set_attrs(SftpWatch_t* ctx, DirItem_t* file);
+
+int32_t open_channel(
+	SftpWatch_t* ctx, SftpCoro::Reactor* reactor, SftpCoro::Channel_t* chan);
+void    close_channel(SftpWatch_t* ctx, SftpCoro::Channel_t* chan);
+void    mark_broken(SftpWatch_t* ctx);
+
+/**
+ * @brief run a command over exec channel on the same session and collect its
+ * standard output. Standard error is discarded.
+ * @return 0 on success, exit status of the command, or negative libssh2 error
+ * */
+int32_t exec(SftpWatch_t* ctx, const std::string& cmd, std::string* out);
+
+/**
+ * @brief start a command over exec channel, for streaming its input and
+ * output with exec_read() and exec_write(). Standard error is discarded.
+ * @return 0 on success, or negative libssh2 error
+ * */
+int32_t exec_open(
+	SftpWatch_t* ctx, const std::string& cmd, LIBSSH2_CHANNEL** channel);
+
+/** @return number of bytes read, 0 on end of output, or negative error */
+ssize_t exec_read(
+	SftpWatch_t* ctx, LIBSSH2_CHANNEL* channel, char* mem, size_t len);
+
+/** write all bytes to standard input of the command */
+int32_t exec_write(
+	SftpWatch_t* ctx, LIBSSH2_CHANNEL* channel, const char* mem, size_t len);
+
+/** close standard input, while output of the command is still read */
+int32_t exec_eof(SftpWatch_t* ctx, LIBSSH2_CHANNEL* channel);
+
+/**
+ * @brief close standard input, wait for the command to exit, then free the
+ * channel.
+ * @param is_eof standard input has been closed by exec_eof() already
+ * @return exit status of the command, or negative libssh2 error
+ * */
+int32_t exec_close(
+	SftpWatch_t* ctx, LIBSSH2_CHANNEL* channel, bool is_eof = false);
+
+/** quote argument for POSIX shell */
+std::string quote(const std::string& arg);
+
+/** lock the SSH session, which may be shared with other instances */
+std::unique_lock<EngineMutex_t> lock(SftpWatch_t* ctx);
+
 }
 
 #endif
@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <cstdint>
+
+#include "sftp_sched.hpp"
+
+namespace {
+
+typedef struct Ranked_s {
+	uint32_t   rank = 0; /**< index of the first matching pattern */
+	uint64_t   key  = 0; /**< order within the same rank */
+	DirItem_t* item = nullptr;
+} Ranked_t;
+
+static bool prv_match(const char* p, const char* s)
+{
+	while (*p) {
+		if (p[0] == '*' && p[1] == '*') {
+			p += 2;
+
+			// '**/' only matches whole directories, including none at all
+			bool is_dir = (*p == SNOD_SEP_CHAR);
+			if (is_dir) p++;
+
+			for (const char* t = s;; t++) {
+				bool at_dir = !is_dir || t == s || t[-1] == SNOD_SEP_CHAR;
+				if (at_dir && prv_match(p, t)) return true;
+				if (!*t) return false;
+			}
+		}
+
+		if (*p == '*') {
+			p++;
+
+			for (const char* t = s;; t++) {
+				if (prv_match(p, t)) return true;
+				if (!*t || *t == SNOD_SEP_CHAR) return false;
+			}
+		}
+
+		if (!*s) return false;
+
+		if (*p == '?') {
+			if (*s == SNOD_SEP_CHAR) return false;
+		} else if (*p != *s) {
+			return false;
+		}
+
+		p++;
+		s++;
+	}
+
+	return !*s;
+}
+
+static uint32_t prv_rank(SyncPriority_t* prio, DirItem_t* item)
+{
+	uint32_t n = static_cast<uint32_t>(prio->patterns.size());
+
+	for (uint32_t i = 0; i < n; i++) {
+		if (SftpSched::match(prio->patterns[i], item->name)) return i;
+	}
+
+	return n;
+}
+
+}
+
+bool SftpSched::match(const std::string& pattern, const std::string& path)
+{
+	if (pattern.find(SNOD_SEP_CHAR) != std::string::npos) {
+		return prv_match(pattern.c_str(), path.c_str());
+	}
+
+	size_t pos = path.find_last_of(SNOD_SEP_CHAR);
+	size_t off = (pos == std::string::npos) ? 0 : pos + 1;
+
+	return prv_match(pattern.c_str(), path.c_str() + off);
+}
+
+void SftpSched::arrange(SftpWatch_t* ctx, std::vector<DirItem_t*>& items)
+{
+	SyncPriority_t* prio = &ctx->priority;
+
+	// nothing to be reordered, keep scan order
+	if (prio->patterns.empty() && prio->order == SNOD_ORDER_SCAN
+		&& !prio->large_size) {
+		return;
+	}
+
+	std::vector<DirItem_t*> others;
+	std::vector<Ranked_t>   files;
+
+	for (DirItem_t* item : items) {
+		if (item->type != IS_REG_FILE) {
+			others.push_back(item);
+			continue;
+		}
+
+		Ranked_t ranked;
+		ranked.rank = prv_rank(prio, item);
+		ranked.item = item;
+
+		switch (prio->order) {
+
+		case SNOD_ORDER_SMALLEST: {
+			ranked.key = item->attrs.filesize;
+		} break;
+
+		case SNOD_ORDER_OLDEST: {
+			ranked.key = item->attrs.mtime;
+		} break;
+
+		default: {
+			// keep scan order
+		} break;
+		}
+
+		files.push_back(ranked);
+	}
+
+	std::stable_sort(files.begin(), files.end(),
+		[](const Ranked_t& a, const Ranked_t& b) {
+			return (a.rank != b.rank) ? a.rank < b.rank : a.key < b.key;
+		});
+
+	std::vector<DirItem_t*> small;
+	std::vector<DirItem_t*> large;
+
+	for (Ranked_t& ranked : files) {
+		uint64_t size = ranked.item->attrs.filesize;
+
+		if (prio->large_size && size >= prio->large_size) {
+			large.push_back(ranked.item);
+		} else {
+			small.push_back(ranked.item);
+		}
+	}
+
+	// directories first, then a batch of small files for each large file
+	items.swap(others);
+
+	size_t i_small = 0;
+	size_t i_large = 0;
+	size_t n_batch = prio->small_per_large ? prio->small_per_large : 1;
+
+	while (i_small < small.size() || i_large < large.size()) {
+		for (size_t n = 0; n < n_batch && i_small < small.size(); n++) {
+			items.push_back(small[i_small++]);
+		}
+
+		if (i_large < large.size()) items.push_back(large[i_large++]);
+	}
+}
@@ -0,0 +1,34 @@
+#ifndef _SFTP_SCHED_HPP
+#define _SFTP_SCHED_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "sftp_watch.hpp"
+
+/*
+ * Transfer scheduler. Orders queued items before they are transferred.
+ *
+ * Directories and other non regular files keep scan order and always go
+ * first, so parent directories exist before their contents. Regular files are
+ * ranked by the first matching priority pattern, then ordered by the selected
+ * order. Files are split into small and large lanes by size, and the lanes
+ * are interleaved, so a bulk of large files can't delay small files for more
+ * than one large transfer.
+ * */
+
+namespace SftpSched {
+
+/**
+ * @brief glob match. '*' and '?' don't match separator, '**' matches any
+ * number of directories. Pattern without separator only matches base name.
+ * */
+bool match(const std::string& pattern, const std::string& path);
+
+/** reorder items following #SyncPriority_t of the instance */
+void arrange(SftpWatch_t* ctx, std::vector<DirItem_t*>& items);
+
+}
+
+#endif
@@ -0,0 +1,111 @@
+#include <bit>
+#include <cstdint>
+
+#include "sftp_stats.hpp"
+
+namespace {
+
+static const char* lat_op_names[LAT_OP_COUNT] = {
+	"openDir",
+	"readDir",
+	"getFilestat",
+	"setFilestat",
+	"openFile",
+	"mkdir",
+	"remove",
+	"rename",
+	"downFile",
+	"upFile",
+};
+
+static uint32_t prv_bucket_index(uint64_t value)
+{
+	if (value < SNOD_HIST_SUB_COUNT) return static_cast<uint32_t>(value);
+
+	// value is within [2^msb, 2^(msb + 1)), so (value >> shift) is within
+	// upper half of sub buckets [SNOD_HIST_HALF_COUNT, SNOD_HIST_SUB_COUNT)
+	uint32_t msb   = 63U - std::countl_zero(value);
+	uint32_t shift = msb - (SNOD_HIST_SUB_BITS - 1U);
+	uint32_t sub   = static_cast<uint32_t>(value >> shift);
+
+	return SNOD_HIST_SUB_COUNT + (shift - 1U) * SNOD_HIST_HALF_COUNT
+		+ (sub - SNOD_HIST_HALF_COUNT);
+}
+
+/** highest value which is counted in the same bucket */
+static uint64_t prv_bucket_value(uint32_t index)
+{
+	if (index < SNOD_HIST_SUB_COUNT) return index;
+
+	uint32_t shift = (index - SNOD_HIST_SUB_COUNT) / SNOD_HIST_HALF_COUNT + 1U;
+	uint64_t sub   = (index - SNOD_HIST_SUB_COUNT) % SNOD_HIST_HALF_COUNT
+		+ SNOD_HIST_HALF_COUNT;
+
+	return ((sub + 1U) << shift) - 1U;
+}
+
+}
+
+const char* SftpStats::op_name(uint8_t op)
+{
+	return op < LAT_OP_COUNT ? lat_op_names[op] : nullptr;
+}
+
+void SftpStats::record(LatHist_t* hist, uint64_t value)
+{
+	const uint64_t max_value = (1ULL << SNOD_HIST_MAX_BITS) - 1U;
+	if (value > max_value) value = max_value;
+
+	hist->buckets[prv_bucket_index(value)].fetch_add(
+		1, std::memory_order_relaxed);
+	hist->count.fetch_add(1, std::memory_order_relaxed);
+	hist->sum.fetch_add(value, std::memory_order_relaxed);
+
+	uint64_t prev = hist->min.load(std::memory_order_relaxed);
+	while (value < prev
+		&& !hist->min.compare_exchange_weak(
+			prev, value, std::memory_order_relaxed)) { }
+
+	prev = hist->max.load(std::memory_order_relaxed);
+	while (value > prev
+		&& !hist->max.compare_exchange_weak(
+			prev, value, std::memory_order_relaxed)) { }
+}
+
+uint64_t SftpStats::percentile(LatHist_t* hist, double pct)
+{
+	uint64_t count = hist->count.load(std::memory_order_relaxed);
+	if (!count) return 0;
+
+	if (pct < 0.0) pct = 0.0;
+	if (pct > 100.0) pct = 100.0;
+
+	// rank of the requested value, at least the first recorded value
+	uint64_t rank = static_cast<uint64_t>(pct / 100.0 * count + 0.5);
+	if (rank < 1) rank = 1;
+
+	uint64_t max  = hist->max.load(std::memory_order_relaxed);
+	uint64_t seen = 0;
+
+	for (uint32_t i = 0; i < SNOD_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i].load(std::memory_order_relaxed);
+		if (seen < rank) continue;
+
+		uint64_t value = prv_bucket_value(i);
+		return value < max ? value : max;
+	}
+
+	return max;
+}
+
+void SftpStats::reset(LatHist_t* hist)
+{
+	for (auto& bucket : hist->buckets) {
+		bucket.store(0, std::memory_order_relaxed);
+	}
+
+	hist->count.store(0, std::memory_order_relaxed);
+	hist->sum.store(0, std::memory_order_relaxed);
+	hist->min.store(UINT64_MAX, std::memory_order_relaxed);
+	hist->max.store(0, std::memory_order_relaxed);
+}
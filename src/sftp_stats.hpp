@@ -0,0 +1,89 @@
+#ifndef _SFTP_STATS_HPP
+#define _SFTP_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*
+ * Log-linear latency histogram, similar to HdrHistogram. Values below
+ * 2^SNOD_HIST_SUB_BITS are counted exactly, larger values are grouped into
+ * 2^(SNOD_HIST_SUB_BITS - 1) buckets per power of 2, giving relative error
+ * below 1 / 2^(SNOD_HIST_SUB_BITS - 1).
+ * */
+
+#ifndef SNOD_HIST_SUB_BITS
+#	define SNOD_HIST_SUB_BITS 5U
+#endif
+
+/** values are clamped to 2^SNOD_HIST_MAX_BITS - 1. ~12.7 days in microsec */
+#ifndef SNOD_HIST_MAX_BITS
+#	define SNOD_HIST_MAX_BITS 40U
+#endif
+
+#define SNOD_HIST_SUB_COUNT  (1U << (SNOD_HIST_SUB_BITS))
+#define SNOD_HIST_HALF_COUNT (SNOD_HIST_SUB_COUNT >> 1)
+#define SNOD_HIST_BUCKETS                                                      \
+	(SNOD_HIST_SUB_COUNT                                                       \
+		+ (SNOD_HIST_MAX_BITS - SNOD_HIST_SUB_BITS) * SNOD_HIST_HALF_COUNT)
+
+/** Remote operations whose latency is recorded */
+typedef enum LatencyOp_e {
+	LAT_OPEN_DIR = 0,
+	LAT_READ_DIR,
+	LAT_GET_FILESTAT,
+	LAT_SET_FILESTAT,
+	LAT_OPEN_FILE,
+	LAT_MKDIR,
+	LAT_REMOVE,
+	LAT_RENAME,
+	LAT_DOWN_FILE,
+	LAT_UP_FILE,
+	LAT_OP_COUNT,
+} LatencyOp_t;
+
+typedef struct LatHist_s LatHist_t;
+
+struct LatHist_s {
+	std::atomic<uint64_t> count = 0;
+	std::atomic<uint64_t> sum   = 0;
+	std::atomic<uint64_t> min   = UINT64_MAX;
+	std::atomic<uint64_t> max   = 0;
+
+	std::atomic<uint64_t> buckets[SNOD_HIST_BUCKETS] = {};
+};
+
+namespace SftpStats {
+
+const char* op_name(uint8_t op);
+void        record(LatHist_t* hist, uint64_t value);
+uint64_t    percentile(LatHist_t* hist, double pct);
+void        reset(LatHist_t* hist);
+
+/** Record elapsed microseconds into histogram when going out of scope */
+typedef struct LatScope_s {
+	LatHist_t*                            hist;
+	std::chrono::steady_clock::time_point start;
+
+	LatScope_s(LatHist_t* hist)
+		: hist(hist)
+		, start(std::chrono::steady_clock::now())
+	{
+		// empty constructor
+	}
+
+	~LatScope_s()
+	{
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		record(hist,
+			std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+				.count());
+	}
+} LatScope_t;
+
+}
+
+#define SNOD_LAT_SCOPE(ctx, op)                                                \
+	SftpStats::LatScope_t lat_scope_##op(&(ctx)->latency[(op)])
+
+#endif
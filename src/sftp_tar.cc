@@ -0,0 +1,310 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "sftp_tar.hpp"
+
+#define SNOD_TAR_NAME_LEN   100U
+#define SNOD_TAR_PREFIX_LEN 155U
+#define SNOD_TAR_LONG_NAME  "././@LongLink"
+
+namespace { // start of unnamed namespace for static function
+
+typedef enum TarKind_e {
+	TAR_KIND_SKIP = 0U,
+	TAR_KIND_FILE = 1U,
+	TAR_KIND_LONG = 2U, /**< GNU long name */
+	TAR_KIND_PAX  = 3U, /**< pax extended header */
+} TarKind_t;
+
+/** offset and length of ustar header fields */
+typedef enum TarField_e {
+	TAR_OFF_NAME   = 0U,
+	TAR_OFF_MODE   = 100U,
+	TAR_OFF_UID    = 108U,
+	TAR_OFF_GID    = 116U,
+	TAR_OFF_SIZE   = 124U,
+	TAR_OFF_MTIME  = 136U,
+	TAR_OFF_CHKSUM = 148U,
+	TAR_OFF_TYPE   = 156U,
+	TAR_OFF_MAGIC  = 257U,
+	TAR_OFF_PREFIX = 345U,
+} TarField_t;
+
+static void prv_octal(char* field, size_t len, uint64_t value)
+{
+	snprintf(field, len, "%0*llo", static_cast<int>(len - 1),
+		static_cast<unsigned long long>(value));
+}
+
+static uint32_t prv_checksum(const char* block)
+{
+	uint32_t sum = 0;
+
+	for (size_t i = 0; i < SNOD_TAR_BLOCK; i++) {
+		bool is_chksum = i >= TAR_OFF_CHKSUM && i < TAR_OFF_CHKSUM + 8;
+		sum += is_chksum ? ' ' : static_cast<unsigned char>(block[i]);
+	}
+
+	return sum;
+}
+
+static uint64_t prv_number(const char* field, size_t len)
+{
+	uint64_t value = 0;
+
+	// base-256 for values not fitting in octal digits
+	if (static_cast<unsigned char>(field[0]) & 0x80) {
+		for (size_t i = 1; i < len; i++) {
+			value = (value << 8) | static_cast<unsigned char>(field[i]);
+		}
+
+		return value;
+	}
+
+	for (size_t i = 0; i < len && field[i]; i++) {
+		if (field[i] < '0' || field[i] > '7') continue;
+		value = (value << 3) | static_cast<uint64_t>(field[i] - '0');
+	}
+
+	return value;
+}
+
+static std::string prv_string(const char* field, size_t len)
+{
+	return std::string(field, strnlen(field, len));
+}
+
+static std::string prv_block(
+	const std::string& name, const std::string& prefix, uint64_t size,
+	uint32_t mode, uint64_t mtime, char type)
+{
+	std::string block(SNOD_TAR_BLOCK, '\0');
+	char*       ptr = &block[0];
+
+	memcpy(ptr + TAR_OFF_NAME, name.data(),
+		std::min<size_t>(name.size(), SNOD_TAR_NAME_LEN));
+	memcpy(ptr + TAR_OFF_PREFIX, prefix.data(),
+		std::min<size_t>(prefix.size(), SNOD_TAR_PREFIX_LEN));
+
+	prv_octal(ptr + TAR_OFF_MODE, 8, mode);
+	prv_octal(ptr + TAR_OFF_UID, 8, 0);
+	prv_octal(ptr + TAR_OFF_GID, 8, 0);
+	prv_octal(ptr + TAR_OFF_SIZE, 12, size);
+	prv_octal(ptr + TAR_OFF_MTIME, 12, mtime);
+
+	ptr[TAR_OFF_TYPE] = type;
+	memcpy(ptr + TAR_OFF_MAGIC, "ustar\0" "00", 8);
+
+	// 6 octal digits, NUL and space
+	prv_octal(ptr + TAR_OFF_CHKSUM, 7, prv_checksum(ptr));
+	ptr[TAR_OFF_CHKSUM + 7] = ' ';
+
+	return block;
+}
+
+/** pick value of 'path' from pax extended header records */
+static std::string prv_pax_path(const std::string& meta)
+{
+	size_t pos = 0;
+
+	while (pos < meta.size()) {
+		size_t space = meta.find(' ', pos);
+		if (space == std::string::npos) break;
+
+		size_t len = strtoul(meta.c_str() + pos, NULL, 10);
+		if (!len || pos + len > meta.size()) break;
+
+		std::string record = meta.substr(space + 1, pos + len - space - 2);
+
+		if (record.compare(0, 5, "path=") == 0) return record.substr(5);
+
+		pos += len;
+	}
+
+	return "";
+}
+
+static int32_t prv_header(TarReader_t* rd, tar_entry_cb cb, void* user)
+{
+	const char* block = rd->block;
+
+	// end of archive
+	if (std::all_of(block, block + SNOD_TAR_BLOCK,
+			[](char c) { return c == '\0'; })) {
+		rd->is_end = true;
+		return 0;
+	}
+
+	uint64_t chksum = prv_number(block + TAR_OFF_CHKSUM, 8);
+	if (chksum != prv_checksum(block)) return -1;
+
+	TarEntry_t* entry = &rd->entry;
+
+	entry->name  = prv_string(block + TAR_OFF_NAME, SNOD_TAR_NAME_LEN);
+	entry->size  = prv_number(block + TAR_OFF_SIZE, 12);
+	entry->mtime = prv_number(block + TAR_OFF_MTIME, 12);
+	entry->mode  = static_cast<uint32_t>(prv_number(block + TAR_OFF_MODE, 8));
+	entry->type  = block[TAR_OFF_TYPE];
+
+	// GNU archive uses prefix area for other fields
+	if (memcmp(block + TAR_OFF_MAGIC, "ustar\0", 6) == 0) {
+		std::string prefix
+			= prv_string(block + TAR_OFF_PREFIX, SNOD_TAR_PREFIX_LEN);
+
+		if (!prefix.empty()) entry->name = prefix + "/" + entry->name;
+	}
+
+	if (!rd->name.empty()) {
+		entry->name = rd->name;
+		rd->name.clear();
+	}
+
+	rd->left = entry->size;
+	rd->pad  = SftpTar::padding(entry->size);
+	rd->meta.clear();
+
+	switch (entry->type) {
+
+	case '0':
+	case '\0': {
+		rd->kind = TAR_KIND_FILE;
+
+		int32_t rc = cb(user, TAR_EVT_BEGIN, entry, NULL, 0);
+		if (rc) return rc;
+
+		if (!rd->left) return cb(user, TAR_EVT_END, entry, NULL, 0);
+	} break;
+
+	case 'L': {
+		rd->kind = TAR_KIND_LONG;
+	} break;
+
+	case 'x': {
+		rd->kind = TAR_KIND_PAX;
+	} break;
+
+	default: {
+		rd->kind = TAR_KIND_SKIP;
+	} break;
+	}
+
+	return 0;
+}
+
+static int32_t prv_data(TarReader_t* rd, const char* data, size_t len,
+	tar_entry_cb cb, void* user)
+{
+	switch (rd->kind) {
+
+	case TAR_KIND_FILE: {
+		int32_t rc = cb(user, TAR_EVT_DATA, &rd->entry, data, len);
+		if (rc) return rc;
+	} break;
+
+	case TAR_KIND_LONG:
+	case TAR_KIND_PAX: {
+		rd->meta.append(data, len);
+	} break;
+
+	default: {
+		// skipped entry
+	} break;
+	}
+
+	rd->left -= len;
+	if (rd->left) return 0;
+
+	switch (rd->kind) {
+
+	case TAR_KIND_FILE: {
+		return cb(user, TAR_EVT_END, &rd->entry, NULL, 0);
+	} break;
+
+	case TAR_KIND_LONG: {
+		rd->name = rd->meta.c_str();
+	} break;
+
+	case TAR_KIND_PAX: {
+		rd->name = prv_pax_path(rd->meta);
+	} break;
+
+	default: {
+		// skipped entry
+	} break;
+	}
+
+	return 0;
+}
+
+} // end of unnamed namespace for static function
+
+std::string SftpTar::header(
+	const std::string& name, uint64_t size, uint32_t mode, uint64_t mtime)
+{
+	if (name.size() <= SNOD_TAR_NAME_LEN) {
+		return prv_block(name, "", size, mode, mtime, '0');
+	}
+
+	// split at a separator so both parts fit in their fields
+	size_t pos = name.find_last_of('/', SNOD_TAR_PREFIX_LEN);
+
+	if (pos != std::string::npos && pos && name.size() - pos - 1 > 0
+		&& name.size() - pos - 1 <= SNOD_TAR_NAME_LEN) {
+		return prv_block(
+			name.substr(pos + 1), name.substr(0, pos), size, mode, mtime, '0');
+	}
+
+	// GNU long name entry, followed by the entry with truncated name
+	std::string res = prv_block(
+		SNOD_TAR_LONG_NAME, "", name.size() + 1, 0, 0, 'L');
+
+	res += name;
+	res += std::string(1 + SftpTar::padding(name.size() + 1), '\0');
+	res += prv_block(name, "", size, mode, mtime, '0');
+
+	return res;
+}
+
+size_t SftpTar::padding(uint64_t size)
+{
+	return static_cast<size_t>(
+		(SNOD_TAR_BLOCK - size % SNOD_TAR_BLOCK) % SNOD_TAR_BLOCK);
+}
+
+std::string SftpTar::trailer()
+{
+	return std::string(SNOD_TAR_BLOCK * 2, '\0');
+}
+
+int32_t SftpTar::feed(TarReader_t* rd, const char* data, size_t len,
+	tar_entry_cb cb, void* user)
+{
+	int32_t rc = 0;
+
+	while (len && !rd->is_end && !rc) {
+		size_t n = 0;
+
+		if (rd->left) {
+			n  = static_cast<size_t>(std::min<uint64_t>(len, rd->left));
+			rc = prv_data(rd, data, n, cb, user);
+		} else if (rd->pad) {
+			n = static_cast<size_t>(std::min<uint64_t>(len, rd->pad));
+			rd->pad -= n;
+		} else {
+			n = std::min<size_t>(len, SNOD_TAR_BLOCK - rd->filled);
+			memcpy(rd->block + rd->filled, data, n);
+			rd->filled += n;
+
+			if (rd->filled == SNOD_TAR_BLOCK) {
+				rd->filled = 0;
+				rc         = prv_header(rd, cb, user);
+			}
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	return rc;
+}
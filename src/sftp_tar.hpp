@@ -0,0 +1,78 @@
+#ifndef _SFTP_TAR_HPP
+#define _SFTP_TAR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Minimal tar archive writer and streaming reader, used to transfer batches of
+ * small files through tar over exec channel.
+ *
+ * Only regular files are written, as ustar entries. Names which don't fit in
+ * ustar name and prefix fields get a GNU long name entry. The reader accepts
+ * ustar, GNU and pax archives, long names from GNU 'L' and pax 'path' records
+ * are applied to the following entry. Other entry types are skipped.
+ * */
+
+#define SNOD_TAR_BLOCK 512U
+
+typedef struct TarEntry_s  TarEntry_t;
+typedef struct TarReader_s TarReader_t;
+
+typedef enum TarEvt_e {
+	TAR_EVT_BEGIN = 0U, /**< regular file entry starts, no data */
+	TAR_EVT_DATA  = 1U, /**< chunk of file content */
+	TAR_EVT_END   = 2U, /**< all content of the entry has been passed */
+} TarEvt_t;
+
+/**
+ * @brief called for regular file entries while the archive is read.
+ * @return 0 to continue, non zero to abort reading
+ * */
+typedef int32_t (*tar_entry_cb)(void* user, uint8_t evt, TarEntry_t* entry,
+	const char* data, size_t len);
+
+struct TarEntry_s {
+	std::string name;
+	uint64_t    size  = 0;
+	uint64_t    mtime = 0;
+	uint32_t    mode  = 0;
+	char        type  = 0;
+};
+
+struct TarReader_s {
+	char        block[SNOD_TAR_BLOCK]; /**< header being received */
+	size_t      filled = 0;            /**< received bytes of the header */
+	TarEntry_t  entry;                 /**< current entry */
+	uint64_t    left    = 0;           /**< data bytes left of the entry */
+	uint64_t    pad     = 0;           /**< padding bytes left */
+	uint8_t     kind    = 0;           /**< how data of the entry is handled */
+	std::string meta;                  /**< long name or pax records */
+	std::string name;                  /**< name for the next entry */
+	bool        is_end = false;        /**< end of archive reached */
+};
+
+namespace SftpTar {
+
+/** header blocks of a regular file entry */
+std::string header(
+	const std::string& name, uint64_t size, uint32_t mode, uint64_t mtime);
+
+/** number of zero bytes after entry data, to fill the last block */
+size_t padding(uint64_t size);
+
+/** two zero blocks marking end of archive */
+std::string trailer();
+
+/**
+ * @brief pass received archive bytes to the reader.
+ * @return 0 on success, -1 if archive is invalid, or non zero value returned
+ * by the callback
+ * */
+int32_t feed(TarReader_t* rd, const char* data, size_t len, tar_entry_cb cb,
+	void* user);
+
+}
+
+#endif
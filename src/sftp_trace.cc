@@ -0,0 +1,133 @@
+#include <chrono>
+#include <cstdio>
+
+#include "sftp_trace.hpp"
+
+namespace {
+
+static void prv_json_escape(std::string& out, const std::string& str)
+{
+	for (char c : str) {
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default: {
+			if (static_cast<unsigned char>(c) < 0x20) {
+				char hex[8];
+				snprintf(hex, sizeof(hex), "\\u%04x", c);
+				out += hex;
+			} else {
+				out += c;
+			}
+		} break;
+		}
+	}
+}
+
+/** last trace id given to an instance */
+static std::atomic<uint32_t> last_tid = 0;
+
+}
+
+uint64_t SftpTrace::now_us()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+void SftpTrace::enable(TraceBuf_t* buf, bool enabled, size_t size)
+{
+	std::lock_guard<std::mutex> lock(buf->mtx);
+
+	if (enabled) {
+		// keep current buffer if size is not specified
+		if (!size) size = buf->events.size();
+		if (!size) size = SNOD_TRACE_DEFAULT_SIZE;
+
+		if (buf->events.size() != size) {
+			buf->events.clear();
+			buf->events.resize(size);
+			buf->head  = 0;
+			buf->count = 0;
+		}
+	}
+
+	if (!buf->tid) buf->tid = ++last_tid;
+
+	buf->enabled = enabled;
+}
+
+void SftpTrace::record(TraceBuf_t* buf, const char* cat, const char* name,
+	const std::string* path, uint64_t start_us, uint64_t end_us)
+{
+	std::lock_guard<std::mutex> lock(buf->mtx);
+
+	if (buf->events.empty()) return;
+
+	TraceEvent_t& ev = buf->events[buf->head];
+
+	ev.cat    = cat;
+	ev.name   = name;
+	ev.ts_us  = start_us;
+	ev.dur_us = end_us - start_us;
+	ev.tid    = buf->tid;
+
+	if (path) {
+		ev.path = *path;
+	} else {
+		ev.path.clear();
+	}
+
+	// overwrite the oldest event when buffer is full
+	buf->head = (buf->head + 1) % buf->events.size();
+	if (buf->count < buf->events.size()) buf->count++;
+}
+
+std::string SftpTrace::dump(TraceBuf_t* buf, bool clear)
+{
+	std::lock_guard<std::mutex> lock(buf->mtx);
+
+	std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+	size_t size  = buf->events.size();
+	size_t first = size ? (buf->head + size - buf->count) % size : 0;
+
+	for (size_t i = 0; i < buf->count; i++) {
+		const TraceEvent_t& ev = buf->events[(first + i) % size];
+
+		char num[96];
+		snprintf(num, sizeof(num),
+			"\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"dur\":%llu",
+			ev.tid, static_cast<unsigned long long>(ev.ts_us),
+			static_cast<unsigned long long>(ev.dur_us));
+
+		if (i) out += ",";
+
+		out += "{\"name\":\"";
+		out += ev.name;
+		out += "\",\"cat\":\"";
+		out += ev.cat;
+		out += "\",";
+		out += num;
+
+		if (!ev.path.empty()) {
+			out += ",\"args\":{\"path\":\"";
+			prv_json_escape(out, ev.path);
+			out += "\"}";
+		}
+
+		out += "}";
+	}
+
+	out += "]}";
+
+	if (clear) {
+		buf->head  = 0;
+		buf->count = 0;
+	}
+
+	return out;
+}
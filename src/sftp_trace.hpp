@@ -0,0 +1,89 @@
+#ifndef _SFTP_TRACE_HPP
+#define _SFTP_TRACE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Span tracing of sync phases and file operations. Spans are stored in a ring
+ * buffer and can be dumped as Chrome trace-event JSON, which can be loaded in
+ * chrome://tracing or Perfetto. When disabled, a span only costs a relaxed
+ * atomic load.
+ * */
+
+#ifndef SNOD_TRACE_DEFAULT_SIZE
+#	define SNOD_TRACE_DEFAULT_SIZE 65536U
+#endif
+
+typedef struct TraceEvent_s TraceEvent_t;
+typedef struct TraceBuf_s   TraceBuf_t;
+
+struct TraceEvent_s {
+	const char* name   = nullptr; /**< static string, span name */
+	const char* cat    = nullptr; /**< static string, span category */
+	std::string path;             /**< file path, empty for phase spans */
+	uint64_t    ts_us  = 0;
+	uint64_t    dur_us = 0;
+	uint32_t    tid    = 0;
+};
+
+struct TraceBuf_s {
+	std::atomic<bool> enabled = false;
+
+	std::mutex                mtx;
+	std::vector<TraceEvent_t> events; /**< ring buffer */
+	size_t                    head  = 0;
+	size_t                    count = 0;
+
+	/**
+	 * trace id of the instance. Its sync runs on a shared worker thread
+	 * among other fibers, so thread id doesn't tell its spans apart
+	 * */
+	uint32_t tid = 0;
+};
+
+namespace SftpTrace {
+
+void        enable(TraceBuf_t* buf, bool enabled, size_t size);
+void        record(TraceBuf_t* buf, const char* cat, const char* name,
+	       const std::string* path, uint64_t start_us, uint64_t end_us);
+std::string dump(TraceBuf_t* buf, bool clear);
+uint64_t    now_us();
+
+/** Record a span from construction until going out of scope */
+typedef struct TraceScope_s {
+	TraceBuf_t*        buf;
+	const char*        cat;
+	const char*        name;
+	const std::string* path;
+	uint64_t           start_us = 0;
+
+	TraceScope_s(TraceBuf_t* buf, const char* cat, const char* name,
+		const std::string* path = nullptr)
+		: buf(buf)
+		, cat(cat)
+		, name(name)
+		, path(path)
+	{
+		if (buf->enabled.load(std::memory_order_relaxed)) start_us = now_us();
+	}
+
+	~TraceScope_s()
+	{
+		if (!start_us) return;
+		record(buf, cat, name, path, start_us, now_us());
+	}
+} TraceScope_t;
+
+}
+
+#define SNOD_TRACE_PHASE(ctx, name)                                            \
+	SftpTrace::TraceScope_t trace_scope((&(ctx)->trace), "phase", (name))
+#define SNOD_TRACE_FILE(ctx, name, path)                                       \
+	SftpTrace::TraceScope_t trace_scope((&(ctx)->trace), "file", (name), (path))
+
+#endif
@@ -1,33 +1,103 @@
+#include <algorithm>
 #include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "sftp_batch.hpp"
+#include "sftp_compare.hpp"
+#include "sftp_engine.hpp"
 #include "sftp_local.hpp"
 #include "sftp_remote.hpp"
+#include "sftp_sched.hpp"
 #include "sftp_watch.hpp"
+#include "sftp_writer.hpp"
 
 #include "debug.hpp"
 
-#define SNOD_PRV_WAIT_MS 50
-#define SNOD_THREAD_WAIT(i, sum, fl)                                           \
-	do {                                                                       \
-		for (uint32_t ms = (i); (fl) && ms <= sum; ms += (i))                  \
-			SNOD_DELAY_MS((i));                                                \
-	} while (0)
-
 /* ******************** Start of Static Functions *************************** */
 namespace {
 
+typedef std::chrono::steady_clock SyncClock_t;
+
+/** totals of a single cycle over all roots */
+typedef struct CycleTotal_s {
+	uint64_t local_scan_us  = 0;
+	uint64_t remote_scan_us = 0;
+	uint64_t que_l_new      = 0;
+	uint64_t que_r_new      = 0;
+	uint64_t que_l_del      = 0;
+	uint64_t que_r_del      = 0;
+} CycleTotal_t;
+
+/** item gone or appeared on one side, which might be a moved item */
+typedef struct MoveCand_s {
+	std::string        dir;             /**< snapshot key of parent dir */
+	std::string        name;            /**< copy, item might be moved */
+	DirItem_t*         item  = nullptr; /**< base item if gone */
+	uint64_t           ino   = 0;       /**< local inode, 0 if unknown */
+	struct MoveCand_s* match = nullptr;
+} MoveCand_t;
+
+/** candidates sharing the same key. Only unique pair is a move */
+typedef struct MoveSlot_s {
+	size_t gone   = SIZE_MAX;
+	size_t came   = SIZE_MAX;
+	bool   is_dup = false;
+} MoveSlot_t;
+
+typedef std::tuple<uint8_t, uint64_t, uint64_t> MoveKey_t;
+
+/** small files waiting to be transferred as one archive */
+typedef struct BatchGroup_s {
+	std::vector<DirItem_t*> files;
+	uint64_t                bytes   = 0;
+	bool                    is_down = false;
+} BatchGroup_t;
+
+static uint64_t prv_elapsed_us(SyncClock_t::time_point start)
+{
+	auto elapsed = SyncClock_t::now() - start;
+	return std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+		.count();
+}
+
+static void sync_report_err(SftpWatch_t* ctx, const char* path)
+{
+	SNOD_STAT_ADD(ctx, errors, 1);
+
+	ctx->last_error.path = path;
+	ctx->cb_err(ctx, ctx->user_data, &ctx->last_error);
+}
+
 static bool is_file_same(PathFile_t& list, std::string& key, DirItem_t& item)
 {
 	if (!list.contains(key)) return false;
 	return !SNOD_FILE_IS_DIFF(list.at(key), item);
 }
 
+/**
+ * @brief local file rewritten within the same second keeps size and mtime,
+ * only sub-second part tells it's been modified. Hash compare mode only.
+ * */
+static bool prv_is_touched(SftpWatch_t* ctx, DirItem_t* a, DirItem_t* b)
+{
+	if (ctx->compare != SNOD_COMPARE_HASH) return false;
+	if (a->type != IS_REG_FILE) return false;
+
+	return a->mtime_nsec != b->mtime_nsec;
+}
+
 static std::string prv_get_key(std::string root, std::string full)
 {
 	size_t pos = full.find(root);
@@ -53,11 +123,175 @@ static void prv_clear_dirs(DirList_t* dirs)
 	assert(dirs->size() == 1);
 }
 
+/**
+ * @brief check whether directory key is inside one of the subtrees. Both
+ * directory list keys and snapshot keys (with leading separator) are accepted.
+ * Empty subtrees means everything.
+ * */
+static bool prv_in_subtree(
+	std::string key, const std::vector<std::string>& subtrees)
+{
+	if (subtrees.empty()) return true;
+
+	if (!key.empty() && key[0] == SNOD_SEP_CHAR) key.erase(0, 1);
+
+	for (const std::string& sub : subtrees) {
+		if (key.compare(0, sub.size(), sub)) continue;
+		if (key.size() == sub.size() || key[sub.size()] == SNOD_SEP_CHAR) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * @brief resolve triggered paths of current root into directories which are
+ * already known, so they can be scanned. Unknown paths fall back to their
+ * nearest known parent. Returns empty list if whole root should be scanned.
+ * */
+static std::vector<std::string> prv_get_subtrees(
+	SftpWatch_t* ctx, const std::vector<std::string>& paths)
+{
+	std::vector<std::string> subtrees;
+
+	for (std::string path : paths) {
+		while (!path.empty() && !ctx->root->local_dirs.contains(path)
+			&& !ctx->root->remote_dirs.contains(path)) {
+			size_t pos = path.find_last_of(SNOD_SEP_CHAR);
+			path.erase(pos == std::string::npos ? 0 : pos);
+		}
+
+		if (path.empty()) return {};
+
+		subtrees.push_back(path);
+	}
+
+	return subtrees;
+}
+
+static DirItem_t* prv_snap_item(
+	DirSnapshot_t& snap, const std::string& dir, const std::string& path)
+{
+	auto it = snap.find(dir);
+	if (it == snap.end()) return nullptr;
+
+	auto item = it->second.find(path);
+	return (item == it->second.end()) ? nullptr : &item->second;
+}
+
+/** snapshot key of the parent directory. "a/b/c" is listed in "/a/b" */
+static std::string prv_parent_key(const std::string& name)
+{
+	size_t pos = name.find_last_of(SNOD_SEP_CHAR);
+	if (pos == std::string::npos) return SNOD_SEP;
+
+	return SNOD_SEP + name.substr(0, pos);
+}
+
+/**
+ * @brief replace leading directory of the path.
+ * @return false if path isn't inside the directory, path is left untouched
+ * */
+static bool prv_rebase(
+	std::string& path, const std::string& from, const std::string& to)
+{
+	if (path.compare(0, from.size(), from)) return false;
+	if (path.size() != from.size() && path[from.size()] != SNOD_SEP_CHAR) {
+		return false;
+	}
+
+	path.replace(0, from.size(), to);
+	return true;
+}
+
+/**
+ * @brief move item and its contents to a new name in snapshot. Entries already
+ * existing under the new name are kept, as they come from the latest scan.
+ * */
+static void prv_move_snap(
+	DirSnapshot_t& snap, const std::string& from, const std::string& to)
+{
+	DirItem_t* item = prv_snap_item(snap, prv_parent_key(from), from);
+
+	if (item) {
+		DirItem_t moved = *item;
+		moved.name      = to;
+
+		snap.at(prv_parent_key(from)).erase(from);
+		snap[prv_parent_key(to)].try_emplace(to, moved);
+	}
+
+	std::string from_key = SNOD_SEP + from;
+	std::string to_key   = SNOD_SEP + to;
+
+	for (auto it = snap.begin(); it != snap.end();) {
+		std::string key = it->first;
+
+		if (!prv_rebase(key, from_key, to_key)) {
+			++it;
+			continue;
+		}
+
+		PathFile_t contents;
+
+		for (auto& [path, old] : it->second) {
+			DirItem_t moved = old;
+			prv_rebase(moved.name, from, to);
+			contents.emplace(moved.name, moved);
+		}
+
+		it = snap.erase(it);
+		snap.try_emplace(key, std::move(contents));
+	}
+}
+
+/** same as #prv_move_snap for directory list */
+static void prv_move_dirs(DirList_t& dirs, const std::string& root_path,
+	const std::string& from, const std::string& to)
+{
+	for (auto it = dirs.begin(); it != dirs.end();) {
+		std::string rela = it->first;
+
+		if (!prv_rebase(rela, from, to)) {
+			++it;
+			continue;
+		}
+
+		Directory_t dir = it->second;
+		dir.rela        = rela;
+		dir.path        = root_path + SNOD_SEP + rela;
+		dir.depth       = static_cast<uint8_t>(
+			std::count(rela.begin(), rela.end(), SNOD_SEP_CHAR) + 1);
+
+		it = dirs.erase(it);
+		dirs.try_emplace(rela, dir);
+	}
+}
+
+/** remove contents of directory from all snapshots, keep the item itself */
+static void prv_forget_contents(SftpWatch_t* ctx, const std::string& name)
+{
+	std::string key = SNOD_SEP + name;
+
+	for (DirSnapshot_t* snap : { &ctx->root->base_snap, &ctx->root->local_snap,
+			 &ctx->root->remote_snap }) {
+		for (auto it = snap->begin(); it != snap->end();) {
+			std::string sub = it->first;
+			if (prv_rebase(sub, key, key)) {
+				it = snap->erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+}
+
 static int sync_dir_local(SftpWatch_t* ctx, Directory_t& dir, AllIns_t* ins)
 {
-	std::string snap_key = prv_get_key(ctx->local_path, dir.path);
-	PathFile_t& list     = ctx->local_snap[snap_key];
-	DirList_t&  dirs     = ctx->local_dirs;
+	std::string snap_key = prv_get_key(ctx->root->local_path, dir.path);
+	PathFile_t& list     = ctx->root->local_snap[snap_key];
+	DirList_t&  dirs     = ctx->root->local_dirs;
 
 	// use set to store current key. No need to store the item
 	std::unordered_set<std::string> current;
@@ -65,22 +299,28 @@ static int sync_dir_local(SftpWatch_t* ctx, Directory_t& dir, AllIns_t* ins)
 	DirItem_t item;
 	int32_t   rc;
 
-	// open local dir first
+	// open local dir first. Gone directory is a removed item of its parent
 	if ((rc = SftpLocal::open_dir(ctx, &dir))) {
-		return -1;
+		return (rc == ENOENT) ? 0 : -1;
 	}
 
 	ins->insert({ snap_key, {} });
+	SNOD_STAT_ADD(ctx, local_dirs, 1);
 
 	// read the opened directory
 	while ((rc = SftpLocal::read_dir(dir, &item))) {
 		if (item.name.empty()) continue;
 
+		SNOD_STAT_ADD(ctx, local_entries, 1);
+
 		std::string& key = item.name;
 		current.insert(key);
 
 		// Check for new or modified files
-		if (is_file_same(list, key, item)) continue;
+		if (is_file_same(list, key, item)
+			&& !prv_is_touched(ctx, &list.at(key), &item)) {
+			continue;
+		}
 
 		list[key] = item;
 		ins->at(snap_key).insert(key);
@@ -113,6 +353,9 @@ static int sync_dir_local(SftpWatch_t* ctx, Directory_t& dir, AllIns_t* ins)
 		list.erase(snap_key);
 		ins->at(snap_key).insert(it->second.name);
 
+		// keep inode of gone item for move detection
+		ctx->root->local_gone[it->first] = it->second;
+
 		it = list.erase(it);
 	}
 
@@ -124,10 +367,10 @@ static int sync_dir_local(SftpWatch_t* ctx, Directory_t& dir, AllIns_t* ins)
 
 static int sync_dir_remote(SftpWatch_t* ctx, Directory_t& dir, AllIns_t* ins)
 {
-	std::string snap_key = prv_get_key(ctx->remote_path, dir.path);
+	std::string snap_key = prv_get_key(ctx->root->remote_path, dir.path);
 	// we're gonna need pair for the directory. So, create it anyway use []
-	PathFile_t& list     = ctx->remote_snap[snap_key];
-	DirList_t&  dirs     = ctx->remote_dirs;
+	PathFile_t& list     = ctx->root->remote_snap[snap_key];
+	DirList_t&  dirs     = ctx->root->remote_dirs;
 
 	// use set to store current key. No need to store the item
 	std::unordered_set<std::string> current;
@@ -135,19 +378,27 @@ static int sync_dir_remote(SftpWatch_t* ctx, Directory_t& dir, AllIns_t* ins)
 	DirItem_t item;
 	int32_t   rc;
 
-	// open remote dir first
+	// open remote dir first. Gone directory is a removed item of its parent
 	if ((rc = SftpRemote::open_dir(ctx, &dir))) {
+		if (ctx->last_error.type == ERR_FROM_SFTP
+			&& ctx->last_error.code == LIBSSH2_FX_NO_SUCH_FILE) {
+			return 0;
+		}
+
 		++ctx->err_count;
 		return -1;
 	}
 
 	ins->insert({ snap_key, {} });
 	ctx->err_count = 0;
+	SNOD_STAT_ADD(ctx, remote_dirs, 1);
 
 	// read the opened directory
-	while ((rc = SftpRemote::read_dir(dir, &item))) {
+	while ((rc = SftpRemote::read_dir(ctx, dir, &item))) {
 		if (item.name.empty()) continue;
 
+		SNOD_STAT_ADD(ctx, remote_entries, 1);
+
 		std::string& key = item.name;
 		current.insert(key);
 
@@ -199,6 +450,10 @@ static int sync_dir_remote(SftpWatch_t* ctx, Directory_t& dir, AllIns_t* ins)
 static void sync_dir_check_conflict(SftpWatch_t* ctx, SyncQueue_t* que,
 	bool& b_path, const std::string& dir, const std::string& path)
 {
+	DirSnapshot_t& base_snap   = ctx->root->base_snap;
+	DirSnapshot_t& local_snap  = ctx->root->local_snap;
+	DirSnapshot_t& remote_snap = ctx->root->remote_snap;
+
 	/*
 	 * Conflict happens when path exists on remote and local snapshots.
 	 * When remote and local file is different, remote always wins for now.
@@ -219,36 +474,58 @@ static void sync_dir_check_conflict(SftpWatch_t* ctx, SyncQueue_t* que,
 	 *       if left-hand is true, right-hand won't be evaluated.
 	 *       So, it's okay if base_snap is still empty and will be added later.
 	 * */
-	bool lb_diff = !b_path
+	bool lb_touched = b_path
+		&& prv_is_touched(
+			ctx, &base_snap.at(dir).at(path), &local_snap.at(dir).at(path));
+	bool lb_diff = !b_path || lb_touched
 		|| SNOD_FILE_IS_DIFF(
-			ctx->base_snap.at(dir).at(path), ctx->local_snap.at(dir).at(path));
+			base_snap.at(dir).at(path), local_snap.at(dir).at(path));
 	bool rb_diff = !b_path
 		|| SNOD_FILE_IS_DIFF(
-			ctx->base_snap.at(dir).at(path), ctx->remote_snap.at(dir).at(path));
+			base_snap.at(dir).at(path), remote_snap.at(dir).at(path));
 
 	if (!lb_diff && !rb_diff) {
 		// skip. both files are the same
 		return;
+	} else if (ctx->mode != SNOD_MODE_BIDIR) {
+		// mirror modes, source side always wins
+		bool is_down = ctx->mode == SNOD_MODE_DOWNLOAD;
+
+		PathFile_t& src = is_down ? remote_snap.at(dir) : local_snap.at(dir);
+
+		bool lr_diff = SNOD_FILE_IS_DIFF(
+			local_snap.at(dir).at(path), remote_snap.at(dir).at(path));
+
+		base_snap[dir][path] = src.at(path);
+
+		// same size and mtime, but local content might be rewritten
+		if (!lr_diff && (is_down || !lb_touched)) return;
+
+		if (is_down) {
+			que->r_new.push_back(&base_snap[dir][path]);
+		} else {
+			que->l_new.push_back(&base_snap[dir][path]);
+		}
 	} else if (lb_diff && !rb_diff) {
 		// upload
-		ctx->base_snap[dir][path] = ctx->local_snap.at(dir).at(path);
-		que->l_new.push_back(&ctx->base_snap[dir][path]);
+		base_snap[dir][path] = local_snap.at(dir).at(path);
+		que->l_new.push_back(&base_snap[dir][path]);
 	} else if (!lb_diff && rb_diff) {
 		// download
-		ctx->base_snap[dir][path] = ctx->remote_snap.at(dir).at(path);
-		que->r_new.push_back(&ctx->base_snap[dir][path]);
+		base_snap[dir][path] = remote_snap.at(dir).at(path);
+		que->r_new.push_back(&base_snap[dir][path]);
 	} else if (lb_diff && rb_diff) {
-		bool lr_diff = SNOD_FILE_IS_DIFF(ctx->local_snap.at(dir).at(path),
-			ctx->remote_snap.at(dir).at(path));
+		bool lr_diff = SNOD_FILE_IS_DIFF(local_snap.at(dir).at(path),
+			remote_snap.at(dir).at(path));
 
 		// TODO: rule like 'remote-wins' or 'local-wins' could be applied here
 		if (lr_diff) {
 			// download
-			ctx->base_snap[dir][path] = ctx->remote_snap.at(dir).at(path);
-			que->r_new.push_back(&ctx->base_snap[dir][path]);
+			base_snap[dir][path] = remote_snap.at(dir).at(path);
+			que->r_new.push_back(&base_snap[dir][path]);
 		} else {
 			// actually the base is outdated
-			ctx->base_snap[dir][path] = ctx->remote_snap.at(dir).at(path);
+			base_snap[dir][path] = remote_snap.at(dir).at(path);
 		}
 	} else {
 		// no diff at all. Should be unreachable
@@ -257,8 +534,213 @@ static void sync_dir_check_conflict(SftpWatch_t* ctx, SyncQueue_t* que,
 	}
 }
 
-static void sync_dir_cmp_snap(SftpWatch_t* ctx, AllIns_t& ins, SyncQueue_t* que)
+static bool prv_can_move(DirItem_t* item)
+{
+	// empty files are cheaper to be created than matched
+	if (item->type == IS_REG_FILE) return item->attrs.filesize > 0;
+
+	return item->type == IS_DIR;
+}
+
+/**
+ * @brief pair gone and appeared candidates with the same key. Candidates
+ * sharing a key with any other candidate are ambiguous and left unmatched.
+ * */
+template <typename Key, typename KeyFn>
+static void prv_match_moves(std::vector<MoveCand_t>& gone,
+	std::vector<MoveCand_t>& came, KeyFn key_of)
+{
+	std::map<Key, MoveSlot_t> slots;
+	Key                       key;
+
+	for (size_t i = 0; i < gone.size(); i++) {
+		if (gone[i].match || !key_of(gone[i], &key)) continue;
+
+		MoveSlot_t& slot = slots[key];
+		slot.is_dup |= (slot.gone != SIZE_MAX);
+		slot.gone = i;
+	}
+
+	for (size_t i = 0; i < came.size(); i++) {
+		if (came[i].match || !key_of(came[i], &key)) continue;
+
+		MoveSlot_t& slot = slots[key];
+		slot.is_dup |= (slot.came != SIZE_MAX);
+		slot.came = i;
+	}
+
+	for (auto& [k, slot] : slots) {
+		if (slot.is_dup || slot.gone == SIZE_MAX || slot.came == SIZE_MAX) {
+			continue;
+		}
+
+		MoveCand_t& g = gone[slot.gone];
+		MoveCand_t& c = came[slot.came];
+
+		if (g.item->type != c.item->type) continue;
+		if (g.ino && c.ino && g.ino != c.ino) continue;
+
+		// moved file must be untouched, otherwise it's transferred anyway
+		bool is_file = g.item->type == IS_REG_FILE;
+		if (is_file && SNOD_FILE_IS_DIFF(*g.item, *c.item)) continue;
+
+		g.match = &c;
+		c.match = &g;
+	}
+}
+
+/**
+ * @brief apply a move on snapshots, as if it has been done on both sides.
+ * Moved item is queued to be renamed on the other side.
+ * */
+static void sync_dir_apply_move(SftpWatch_t* ctx, AllIns_t& ins,
+	SyncQueue_t* que, MoveCand_t& g, MoveCand_t& c, bool is_local)
 {
+	SyncRoot_t* root = ctx->root;
+
+	SyncMove_t  mov;
+	DirItem_t   item   = *c.item;
+	std::string to_key = SNOD_SEP + c.name;
+
+	mov.from = *g.item;
+
+	ins.at(g.dir).erase(g.name);
+	ins.at(c.dir).erase(c.name);
+
+	prv_move_snap(root->base_snap, g.name, c.name);
+	prv_move_snap(root->local_snap, g.name, c.name);
+	prv_move_snap(root->remote_snap, g.name, c.name);
+
+	root->base_snap[c.dir][c.name] = item;
+	mov.to = &root->base_snap[c.dir][c.name];
+
+	if (item.type == IS_DIR) {
+		prv_move_dirs(root->local_dirs, root->local_path, g.name, c.name);
+		prv_move_dirs(root->remote_dirs, root->remote_path, g.name, c.name);
+
+		// moved contents are walked, they aren't orphans
+		for (auto& [key, contents] : root->base_snap) {
+			std::string sub = key;
+			if (prv_rebase(sub, to_key, to_key)) ins.try_emplace(key);
+		}
+	}
+
+	if (is_local) {
+		que->l_mov.push_back(mov);
+	} else {
+		que->r_mov.push_back(mov);
+	}
+}
+
+/**
+ * @brief find items moved on one side within the same cycle. Gone and appeared
+ * items are matched by inode on local side, then by type, size and mtime.
+ * Matched paths are removed from ins, so they aren't deleted or transferred.
+ * @param is_local true to find items moved on local side
+ * */
+static void sync_dir_find_moves(
+	SftpWatch_t* ctx, AllIns_t& ins, SyncQueue_t* que, bool is_local)
+{
+	SyncRoot_t*    root = ctx->root;
+	DirSnapshot_t& base = root->base_snap;
+	DirSnapshot_t& src  = is_local ? root->local_snap : root->remote_snap;
+	DirSnapshot_t& dst  = is_local ? root->remote_snap : root->local_snap;
+
+	std::vector<MoveCand_t> gone;
+	std::vector<MoveCand_t> came;
+
+	for (const auto& [dir, lpath] : ins) {
+		for (const auto& path : lpath) {
+			DirItem_t* b_item = prv_snap_item(base, dir, path);
+			DirItem_t* s_item = prv_snap_item(src, dir, path);
+			DirItem_t* d_item = prv_snap_item(dst, dir, path);
+
+			MoveCand_t cand;
+			cand.dir  = dir;
+			cand.name = path;
+
+			if (b_item && !s_item && d_item && prv_can_move(b_item)) {
+				// file modified on the other side is a conflict, not a move
+				if (b_item->type == IS_REG_FILE
+					&& SNOD_FILE_IS_DIFF(*b_item, *d_item)) {
+					continue;
+				}
+
+				auto old  = root->local_gone.find(path);
+				cand.item = b_item;
+
+				if (is_local && old != root->local_gone.end()) {
+					cand.ino = old->second.ino;
+				}
+
+				gone.push_back(cand);
+			} else if (!b_item && s_item && !d_item && prv_can_move(s_item)) {
+				cand.item = s_item;
+				cand.ino  = is_local ? s_item->ino : 0;
+
+				came.push_back(cand);
+			}
+		}
+	}
+
+	if (gone.empty() || came.empty()) return;
+
+	// inode is reliable even if directory mtime has been changed by the move
+	if (is_local) {
+		prv_match_moves<uint64_t>(
+			gone, came, [](MoveCand_t& cand, uint64_t* key) {
+				*key = cand.ino;
+				return cand.ino != 0;
+			});
+	}
+
+	prv_match_moves<MoveKey_t>(
+		gone, came, [](MoveCand_t& cand, MoveKey_t* key) {
+			bool     is_dir = cand.item->type == IS_DIR;
+			uint64_t size   = is_dir ? 0 : cand.item->attrs.filesize;
+
+			*key = { cand.item->type, size, cand.item->attrs.mtime };
+			return true;
+		});
+
+	/*
+	 * Directories go first, contents of moved directories are moved with them.
+	 * Candidates inside moved directories are skipped by their names, as their
+	 * snapshot items have been moved.
+	 * */
+	std::vector<std::string> moved;
+
+	for (uint8_t type : { IS_DIR, IS_REG_FILE }) {
+		for (MoveCand_t& g : gone) {
+			if (!g.match) continue;
+
+			MoveCand_t& c = *g.match;
+
+			if (!moved.empty()
+				&& (prv_in_subtree(g.name, moved)
+					|| prv_in_subtree(c.name, moved))) {
+				continue;
+			}
+
+			if (g.item->type != type) continue;
+
+			sync_dir_apply_move(ctx, ins, que, g, c, is_local);
+
+			if (type == IS_DIR) {
+				moved.push_back(g.name);
+				moved.push_back(c.name);
+			}
+		}
+	}
+}
+
+static void sync_dir_cmp_snap(SftpWatch_t* ctx, AllIns_t& ins, SyncQueue_t* que,
+	const std::vector<std::string>& subtrees, bool is_partial)
+{
+	DirSnapshot_t& base_snap   = ctx->root->base_snap;
+	DirSnapshot_t& local_snap  = ctx->root->local_snap;
+	DirSnapshot_t& remote_snap = ctx->root->remote_snap;
+
 	/*
 	 * Compare snapshots to perform 3-way merge. Base snapshot is used as anchor
 	 * To select which operation would be done, will follow this table
@@ -274,42 +756,71 @@ static void sync_dir_cmp_snap(SftpWatch_t* ctx, AllIns_t& ins, SyncQueue_t* que)
 	 *
 	 * Orphaned Item is defined as a path whose parent directory no longer
 	 * exists both in remote and local. Orphaned items will be removed from
-	 * all snapshots.
+	 * all snapshots. Only directories inside scanned subtrees are checked.
+	 * When a scan has stopped on error, unvisited directories can't be told
+	 * from gone ones, so orphans are left for the next complete scan.
+	 *
+	 * Items moved on one side are matched before, and renamed on the other
+	 * side instead of being deleted and transferred again.
 	 * */
 	std::unordered_set<std::string> walked_dir;
 
+	if (ctx->mode != SNOD_MODE_DOWNLOAD) {
+		sync_dir_find_moves(ctx, ins, que, true);
+	}
+
+	if (ctx->mode != SNOD_MODE_UPLOAD) {
+		sync_dir_find_moves(ctx, ins, que, false);
+	}
+
 	for (const auto& [dir, lpath] : ins) {
 		walked_dir.insert(dir);
-		bool b_dir = ctx->base_snap.contains(dir);
-		bool l_dir = ctx->local_snap.contains(dir);
-		bool r_dir = ctx->remote_snap.contains(dir);
+		bool b_dir = base_snap.contains(dir);
+		bool l_dir = local_snap.contains(dir);
+		bool r_dir = remote_snap.contains(dir);
 
 		for (const auto& path : lpath) {
 			// NOTE: short-circuit AND. If left is false, right-hand is skipped
-			bool b_path = b_dir && ctx->base_snap.at(dir).contains(path);
-			bool l_path = l_dir && ctx->local_snap.at(dir).contains(path);
-			bool r_path = r_dir && ctx->remote_snap.at(dir).contains(path);
+			bool b_path = b_dir && base_snap.at(dir).contains(path);
+			bool l_path = l_dir && local_snap.at(dir).contains(path);
+			bool r_path = r_dir && remote_snap.at(dir).contains(path);
 
 			if (!b_path && !l_path && r_path) {
-				// download
-				ctx->base_snap[dir][path] = ctx->remote_snap.at(dir).at(path);
-				que->r_new.push_back(&ctx->base_snap[dir][path]);
+				// download. Remote only item is left as is when uploading
+				if (ctx->mode == SNOD_MODE_UPLOAD) continue;
+
+				base_snap[dir][path] = remote_snap.at(dir).at(path);
+				que->r_new.push_back(&base_snap[dir][path]);
 			} else if (!b_path && l_path && !r_path) {
-				// upload
-				ctx->base_snap[dir][path] = ctx->local_snap.at(dir).at(path);
-				que->l_new.push_back(&ctx->base_snap[dir][path]);
+				// upload. Local only item is left as is when downloading
+				if (ctx->mode == SNOD_MODE_DOWNLOAD) continue;
+
+				base_snap[dir][path] = local_snap.at(dir).at(path);
+				que->l_new.push_back(&base_snap[dir][path]);
 			} else if (b_path && l_path && !r_path) {
-				// remote removed
-				que->r_del.push_back(ctx->base_snap.at(dir).at(path));
-				ctx->base_snap.at(dir).erase(path);
-				ctx->remote_snap.at(dir).erase(path);
-				ctx->local_snap.at(dir).erase(path);
+				// remote removed. Restore it when uploading
+				if (ctx->mode == SNOD_MODE_UPLOAD) {
+					base_snap[dir][path] = local_snap.at(dir).at(path);
+					que->l_new.push_back(&base_snap[dir][path]);
+					continue;
+				}
+
+				que->r_del.push_back(base_snap.at(dir).at(path));
+				base_snap.at(dir).erase(path);
+				remote_snap.at(dir).erase(path);
+				local_snap.at(dir).erase(path);
 			} else if (b_path && !l_path && r_path) {
-				// local removed
-				que->l_del.push_back(ctx->base_snap.at(dir).at(path));
-				ctx->base_snap.at(dir).erase(path);
-				ctx->remote_snap.at(dir).erase(path);
-				ctx->local_snap.at(dir).erase(path);
+				// local removed. Restore it when downloading
+				if (ctx->mode == SNOD_MODE_DOWNLOAD) {
+					base_snap[dir][path] = remote_snap.at(dir).at(path);
+					que->r_new.push_back(&base_snap[dir][path]);
+					continue;
+				}
+
+				que->l_del.push_back(base_snap.at(dir).at(path));
+				base_snap.at(dir).erase(path);
+				remote_snap.at(dir).erase(path);
+				local_snap.at(dir).erase(path);
 			} else if (b_path && !l_path && !r_path) {
 				// remove base. Should be hanlded on Check Orphans
 			} else if (l_path && r_path) {
@@ -323,46 +834,312 @@ static void sync_dir_cmp_snap(SftpWatch_t* ctx, AllIns_t& ins, SyncQueue_t* que)
 		}
 	}
 
+	if (is_partial) return;
+
 	// Check for orphaned item in base snapshot
-	for (auto it = ctx->base_snap.begin(); it != ctx->base_snap.end();) {
+	for (auto it = base_snap.begin(); it != base_snap.end();) {
 		const std::string& dir      = it->first;
 		PathFile_t&        contents = it->second;
 
-		if (walked_dir.contains(dir)) {
+		if (walked_dir.contains(dir) || !prv_in_subtree(dir, subtrees)) {
 			++it;
 			continue;
 		}
 
+		// in mirror modes, only the destination side is removed
 		for (auto& [path, item] : contents) {
-			que->r_del.push_back(ctx->local_snap.at(dir).at(path));
-			que->l_del.push_back(ctx->remote_snap.at(dir).at(path));
+			if (ctx->mode != SNOD_MODE_UPLOAD) que->r_del.push_back(item);
+			if (ctx->mode != SNOD_MODE_DOWNLOAD) que->l_del.push_back(item);
+		}
+
+		local_snap.erase(dir);
+		remote_snap.erase(dir);
+		it = base_snap.erase(it);
+	}
+}
+
+/**
+ * @brief In mirror modes, destination side isn't scanned every cycle. Its
+ * snapshot is assumed to be the same as base snapshot once operations are done.
+ * */
+static void sync_trust_base(SftpWatch_t* ctx, AllIns_t& ins)
+{
+	if (ctx->mode == SNOD_MODE_BIDIR) return;
+
+	DirSnapshot_t& base = ctx->root->base_snap;
+	DirSnapshot_t& snap = (ctx->mode == SNOD_MODE_DOWNLOAD)
+		? ctx->root->local_snap
+		: ctx->root->remote_snap;
+
+	for (const auto& [dir, paths] : ins) {
+		if (base.contains(dir)) {
+			snap[dir] = base.at(dir);
+		} else {
+			snap.erase(dir);
+		}
+	}
+}
+
+/**
+ * @brief create missing parents of a moved item, in case the move target is
+ * inside a directory which is still queued to be created.
+ * */
+static int32_t sync_move_parents(
+	SftpWatch_t* ctx, const std::string& name, bool on_remote)
+{
+	size_t pos = name.find_last_of(SNOD_SEP_CHAR);
+
+	// root directory always exists
+	if (pos == std::string::npos) return 0;
+
+	std::string parent = name.substr(0, pos);
+	DirItem_t*  dir
+		= prv_snap_item(ctx->root->base_snap, prv_parent_key(parent), parent);
+
+	if (!dir || dir->type != IS_DIR) return -1;
+	if (sync_move_parents(ctx, parent, on_remote)) return -1;
+
+	return on_remote ? SftpRemote::mkdir(ctx, dir) : SftpLocal::mkdir(ctx, dir);
+}
+
+static int32_t sync_rename(
+	SftpWatch_t* ctx, DirItem_t* from, DirItem_t* to, bool on_remote)
+{
+	if (on_remote) return SftpRemote::rename(ctx, from, to);
+
+	return SftpLocal::rename(ctx, from, to);
+}
+
+/**
+ * @brief rename moved item on the other side. If rename fails, it falls back
+ * to delete and transfer. Contents of moved directory are transferred on the
+ * next cycle in that case.
+ * @param is_local true if the item was moved on local side
+ * */
+static void sync_dir_op_move(
+	SftpWatch_t* ctx, SyncQueue_t& que, SyncMove_t& mov, bool is_local)
+{
+	DirItem_t* from = &mov.from;
+	DirItem_t* to   = mov.to;
+
+	SNOD_TRACE_FILE(ctx, is_local ? "renameRemote" : "renameLocal", &to->name);
+
+	int32_t rc = 0;
+
+	{
+		std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
+
+		rc = sync_rename(ctx, from, to, is_local);
+
+		if (rc && !sync_move_parents(ctx, to->name, is_local)) {
+			rc = sync_rename(ctx, from, to, is_local);
+		}
+	}
+
+	if (!rc) {
+		EventFile_t ev = is_local ? EVT_FILE_LMOV : EVT_FILE_RMOV;
+
+		SNOD_STAT_ADD(ctx, moves, 1);
+		ctx->cb_file(ctx, ctx->user_data, to, true, ev, &from->name);
+		return;
+	}
+
+	LOG_ERR("Unable to rename '%s' to '%s', fall back to transfer\n",
+		from->name.c_str(), to->name.c_str());
+
+	if (to->type == IS_DIR) {
+		prv_forget_contents(ctx, to->name);
+
+		// the other side doesn't have any of the moved subdirectories
+		DirList_t& dirs
+			= is_local ? ctx->root->remote_dirs : ctx->root->local_dirs;
+
+		for (auto it = dirs.begin(); it != dirs.end();) {
+			std::string rela = it->first;
+			if (rela != to->name && prv_rebase(rela, to->name, to->name)) {
+				it = dirs.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	if (is_local) {
+		que.l_del.push_back(*from);
+		que.l_new.push_back(to);
+	} else {
+		que.r_del.push_back(*from);
+		que.r_new.push_back(to);
+	}
+}
+
+/**
+ * @brief transfer files of the group as one archive. Files which aren't
+ * transferred by the archive are transferred one by one.
+ * */
+static void sync_batch_flush(SftpWatch_t* ctx, BatchGroup_t* group)
+{
+	if (group->files.empty()) return;
+
+	bool        is_down = group->is_down;
+	EventFile_t evt     = is_down ? EVT_FILE_DOWN : EVT_FILE_UP;
+
+	for (DirItem_t* item : group->files) {
+		ctx->cb_file(ctx, ctx->user_data, item, false, evt, nullptr);
+	}
+
+	std::vector<int32_t> rcs;
+	int32_t              rc = 0;
+
+	{
+		SNOD_TRACE_FILE(ctx, is_down ? "batchDown" : "batchUp", nullptr);
+		std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
 
-			ctx->local_snap.at(dir).erase(path);
-			ctx->remote_snap.at(dir).erase(path);
+		rc = is_down ? SftpBatch::down(ctx, group->files, &rcs)
+					 : SftpBatch::up(ctx, group->files, &rcs);
+	}
+
+	if (!rc) SNOD_STAT_ADD(ctx, batches, 1);
+
+	for (size_t i = 0; i < group->files.size() && !ctx->is_stopped; i++) {
+		DirItem_t* item = group->files[i];
+
+		if (rcs[i]) {
+			std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
+
+			if (is_down) {
+				SNOD_TRACE_FILE(ctx, "download", &item->name);
+				rcs[i] = SftpRemote::down_file(ctx, item);
+			} else {
+				SNOD_TRACE_FILE(ctx, "upload", &item->name);
+				rcs[i] = SftpRemote::up_file(ctx, item);
+			}
 		}
 
-		ctx->local_snap.erase(dir);
-		ctx->remote_snap.erase(dir);
-		it = ctx->base_snap.erase(it);
+		if (rcs[i]) {
+			sync_report_err(ctx, item->name.c_str());
+		} else if (is_down) {
+			SNOD_STAT_ADD(ctx, downloads, 1);
+		} else {
+			SNOD_STAT_ADD(ctx, uploads, 1);
+		}
+
+		ctx->cb_file(ctx, ctx->user_data, item, true, evt, nullptr);
 	}
+
+	group->files.clear();
+	group->bytes = 0;
 }
 
+/**
+ * @brief put small file into batch group, the group is transferred once it's
+ * full. See #SyncBatch_t
+ * @return false if the file should be transferred on its own
+ * */
+static bool sync_batch_add(
+	SftpWatch_t* ctx, BatchGroup_t* group, DirItem_t* item)
+{
+	if (!SftpBatch::fits(ctx, item)) return false;
+
+	uint64_t size = item->attrs.filesize;
+
+	if (group->files.size() >= ctx->batch.max_files
+		|| group->bytes + size > ctx->batch.max_bytes) {
+		sync_batch_flush(ctx, group);
+	}
+
+	group->files.push_back(item);
+	group->bytes += size;
+
+	return true;
+}
+
+/**
+ * @brief compare hashes of transferred files with the remote files, many
+ * files per command. Different content is reported as error of the file
+ * */
+static void sync_verify(SftpWatch_t* ctx, std::vector<DirItem_t*>& files)
+{
+	for (size_t pos = 0; pos < files.size() && !ctx->is_stopped;
+		pos += SNOD_BATCH_FILES) {
+		size_t end = std::min<size_t>(files.size(), pos + SNOD_BATCH_FILES);
+
+		std::vector<DirItem_t*> part(files.begin() + pos, files.begin() + end);
+		std::vector<DirItem_t*> bad;
+
+		{
+			std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
+			if (SftpCompare::verify(ctx, part, &bad)) return;
+		}
+
+		for (DirItem_t* file : bad) {
+			SftpRemote::set_error(
+				ctx, SNOD_HASH_MISMATCH, "Hash mismatch after transfer");
+			sync_report_err(ctx, file->name.c_str());
+		}
+	}
+}
+
+/**
+ * @brief same as SftpCompare::is_same, the remote hash might be computed
+ * */
+static bool sync_is_same(SftpWatch_t* ctx, DirItem_t* item, bool is_down)
+{
+	std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
+	return SftpCompare::is_same(ctx, item, is_down);
+}
+
+/**
+ * @brief Do queued operations of current root. Shared session is locked for
+ * each remote operation only, never across the callbacks, since those wait
+ * for JavaScript thread.
+ * */
 static void sync_dir_op(SftpWatch_t* ctx, SyncQueue_t& que)
 {
+	// moves go first, their sources might be inside deleted directories
+	for (auto it = que.l_mov.begin(); it != que.l_mov.end() && !ctx->is_stopped;
+		++it) {
+		sync_dir_op_move(ctx, que, *it, true);
+	}
+
+	for (auto it = que.r_mov.begin(); it != que.r_mov.end() && !ctx->is_stopped;
+		++it) {
+		sync_dir_op_move(ctx, que, *it, false);
+	}
+
 	for (auto it = que.l_del.begin(); it != que.l_del.end() && !ctx->is_stopped;
 		++it) {
 
 		DirItem_t* item = &(*it);
 
+		SNOD_TRACE_FILE(ctx, "deleteRemote", &item->name);
+
 		if (item->type == IS_DIR) {
-			ctx->local_dirs.erase(item->name);
-			ctx->remote_dirs.erase(item->name);
-			SftpRemote::rmdir(ctx, item);
-		} else {
-			SftpRemote::remove(ctx, item);
+			ctx->root->local_dirs.erase(item->name);
+			ctx->root->remote_dirs.erase(item->name);
 		}
 
-		ctx->cb_file(ctx, ctx->user_data, item, true, EVT_FILE_LDEL);
+		std::vector<std::string> left;
+
+		{
+			std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
+
+			if (item->type == IS_DIR) {
+				SftpRemote::rmdir(ctx, item, &left);
+			} else {
+				SftpRemote::remove(ctx, item);
+			}
+		}
+
+		// entries without reply when pipelined delete timed out
+		for (const std::string& path : left) {
+			sync_report_err(ctx, path.c_str());
+		}
+
+		if (!left.empty()) sync_report_err(ctx, item->name.c_str());
+
+		SNOD_STAT_ADD(ctx, remote_dels, 1);
+		ctx->cb_file(ctx, ctx->user_data, item, true, EVT_FILE_LDEL, nullptr);
 	}
 
 	for (auto it = que.r_del.begin(); it != que.r_del.end() && !ctx->is_stopped;
@@ -370,35 +1147,81 @@ static void sync_dir_op(SftpWatch_t* ctx, SyncQueue_t& que)
 
 		DirItem_t* item = &(*it);
 
+		SNOD_TRACE_FILE(ctx, "deleteLocal", &item->name);
+
 		if (item->type == IS_DIR) {
-			ctx->local_dirs.erase(item->name);
-			ctx->remote_dirs.erase(item->name);
+			ctx->root->local_dirs.erase(item->name);
+			ctx->root->remote_dirs.erase(item->name);
 			SftpLocal::rmdir(ctx, item);
 		} else {
 			SftpLocal::remove(ctx, item);
 		}
 
-		ctx->cb_file(ctx, ctx->user_data, item, true, EVT_FILE_RDEL);
+		SNOD_STAT_ADD(ctx, local_dels, 1);
+		ctx->cb_file(ctx, ctx->user_data, item, true, EVT_FILE_RDEL, nullptr);
+	}
+
+	// transfer order follows priority config, see sftp_sched.hpp
+	SftpSched::arrange(ctx, que.r_new);
+	SftpSched::arrange(ctx, que.l_new);
+
+	// remote hashes of same sized files, instead of one command per file
+	{
+		std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
+		SftpCompare::prefetch(ctx, que.r_new, true);
+		SftpCompare::prefetch(ctx, que.l_new, false);
 	}
 
+	BatchGroup_t batch_down;
+	batch_down.is_down = true;
+
+	std::vector<DirItem_t*> hashed; /**< transferred with hash computed */
+
 	for (auto it = que.r_new.begin(); it != que.r_new.end() && !ctx->is_stopped;
 		++it) {
 
 		int32_t rc = 0;
 
+		// same content, only times and permission are changed
+		if (sync_is_same(ctx, *it, true)) {
+			SNOD_TRACE_FILE(ctx, "attrLocal", &(*it)->name);
+
+			if (SftpLocal::set_attrs(ctx, *it)) {
+				sync_report_err(ctx, (*it)->name.c_str());
+			} else {
+				SNOD_STAT_ADD(ctx, attr_syncs, 1);
+			}
+
+			continue;
+		}
+
+		// small files are transferred later, together with the others
+		if (sync_batch_add(ctx, &batch_down, *it)) continue;
+
 		switch ((*it)->type) {
 
 		case IS_DIR: {
+			SNOD_TRACE_FILE(ctx, "mkdirLocal", &(*it)->name);
 			rc = SftpLocal::mkdir(ctx, (*it));
 		} break;
 
 		case IS_SYMLINK: {
+			SNOD_TRACE_FILE(ctx, "symlink", &(*it)->name);
+
+			std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
 			rc = SftpRemote::down_symlink(ctx, *it);
 		} break;
 
 		case IS_REG_FILE: {
-			ctx->cb_file(ctx, ctx->user_data, (*it), false, EVT_FILE_DOWN);
+			ctx->cb_file(
+				ctx, ctx->user_data, (*it), false, EVT_FILE_DOWN, nullptr);
+
+			SNOD_TRACE_FILE(ctx, "download", &(*it)->name);
+
+			std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
 			rc = SftpRemote::down_file(ctx, *it);
+			if (!rc) SNOD_STAT_ADD(ctx, downloads, 1);
+			if (!rc && !(*it)->hash.empty()) hashed.push_back(*it);
 		} break;
 
 		default: {
@@ -406,27 +1229,60 @@ static void sync_dir_op(SftpWatch_t* ctx, SyncQueue_t& que)
 		} break;
 		}
 
-		if (rc) {
-			ctx->last_error.path = (*it)->name.c_str();
-			ctx->cb_err(ctx, ctx->user_data, &ctx->last_error);
-		}
+		if (rc) sync_report_err(ctx, (*it)->name.c_str());
 
-		ctx->cb_file(ctx, ctx->user_data, (*it), true, EVT_FILE_DOWN);
+		ctx->cb_file(ctx, ctx->user_data, (*it), true, EVT_FILE_DOWN, nullptr);
 	}
 
+	if (!ctx->is_stopped) sync_batch_flush(ctx, &batch_down);
+
+	// downloaded files are flushed at once, see #SNOD_FSYNC_BATCH
+	SftpWriter::sync(ctx);
+
+	BatchGroup_t batch_up;
+
 	for (auto it = que.l_new.begin(); it != que.l_new.end() && !ctx->is_stopped;
 		++it) {
 
 		int32_t rc = 0;
 
+		if (sync_is_same(ctx, *it, false)) {
+			SNOD_TRACE_FILE(ctx, "attrRemote", &(*it)->name);
+
+			{
+				std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
+				rc = SftpRemote::set_attrs(ctx, *it);
+			}
+
+			if (rc) {
+				sync_report_err(ctx, (*it)->name.c_str());
+			} else {
+				SNOD_STAT_ADD(ctx, attr_syncs, 1);
+			}
+
+			continue;
+		}
+
+		if (sync_batch_add(ctx, &batch_up, *it)) continue;
+
 		switch ((*it)->type) {
 
 		case IS_REG_FILE: {
-			ctx->cb_file(ctx, ctx->user_data, (*it), false, EVT_FILE_UP);
+			ctx->cb_file(
+				ctx, ctx->user_data, (*it), false, EVT_FILE_UP, nullptr);
+
+			SNOD_TRACE_FILE(ctx, "upload", &(*it)->name);
+
+			std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
 			rc = SftpRemote::up_file(ctx, (*it));
+			if (!rc) SNOD_STAT_ADD(ctx, uploads, 1);
+			if (!rc && !(*it)->hash.empty()) hashed.push_back(*it);
 		} break;
 
 		case IS_DIR: {
+			SNOD_TRACE_FILE(ctx, "mkdirRemote", &(*it)->name);
+
+			std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
 			rc = SftpRemote::mkdir(ctx, (*it));
 		} break;
 
@@ -435,105 +1291,300 @@ static void sync_dir_op(SftpWatch_t* ctx, SyncQueue_t& que)
 		} break;
 		}
 
-		if (rc) {
-			ctx->last_error.path = (*it)->name.c_str();
-			ctx->cb_err(ctx, ctx->user_data, &ctx->last_error);
-		}
+		if (rc) sync_report_err(ctx, (*it)->name.c_str());
 
-		ctx->cb_file(ctx, ctx->user_data, (*it), true, EVT_FILE_UP);
+		ctx->cb_file(ctx, ctx->user_data, (*it), true, EVT_FILE_UP, nullptr);
 	}
+
+	if (!ctx->is_stopped) sync_batch_flush(ctx, &batch_up);
+
+	if (ctx->checksum) sync_verify(ctx, hashed);
 }
 
 /**
- * @brief check for both local and remote root directories.
+ * @brief check for both local and remote directories of current root.
  * The root directory must exist and can be opened by the app.
  * */
-static bool check_root_dirs(SftpWatch_t* ctx)
+static bool check_root(SftpWatch_t* ctx)
 {
 	int32_t rc = 0;
 
 	LIBSSH2_SFTP_ATTRIBUTES attrs;
 
-	if ((rc = SftpRemote::get_filestat(ctx, ctx->remote_path, &attrs))) {
-		ctx->last_error.path = ctx->remote_path.c_str();
-		ctx->cb_err(ctx, ctx->user_data, &ctx->last_error);
-		return false;
-	}
+	{
+		std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
 
-	rc = SftpRemote::open_dir(ctx, &ctx->remote_dirs.at("/"));
-	SftpRemote::close_dir(ctx, &ctx->remote_dirs.at("/"));
+		rc = SftpRemote::get_filestat(ctx, ctx->root->remote_path, &attrs);
+
+		if (!rc) {
+			rc = SftpRemote::open_dir(ctx, &ctx->root->remote_dirs.at("/"));
+			SftpRemote::close_dir(ctx, &ctx->root->remote_dirs.at("/"));
+		}
+	}
 
 	if (rc) {
-		ctx->last_error.path = ctx->remote_path.c_str();
-		ctx->cb_err(ctx, ctx->user_data, &ctx->last_error);
+		sync_report_err(ctx, ctx->root->remote_path.c_str());
 		return false;
 	}
 
-	if ((rc = SftpLocal::filestat(ctx, ctx->local_path, &attrs))) {
-		ctx->last_error.path = ctx->local_path.c_str();
-		ctx->cb_err(ctx, ctx->user_data, &ctx->last_error);
+	if ((rc = SftpLocal::filestat(ctx, ctx->root->local_path, &attrs))) {
+		sync_report_err(ctx, ctx->root->local_path.c_str());
 		return false;
 	}
 
-	rc = SftpLocal::open_dir(ctx, &ctx->local_dirs.at("/"));
-	SftpLocal::close_dir(ctx, &ctx->local_dirs.at("/"));
+	rc = SftpLocal::open_dir(ctx, &ctx->root->local_dirs.at("/"));
+	SftpLocal::close_dir(ctx, &ctx->root->local_dirs.at("/"));
 
 	if (rc) {
-		ctx->last_error.path = ctx->local_path.c_str();
-		ctx->cb_err(ctx, ctx->user_data, &ctx->last_error);
+		sync_report_err(ctx, ctx->root->local_path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+static bool check_root_dirs(SftpWatch_t* ctx)
+{
+	// opened by sync thread, since a shared session has to be locked
+	if (SftpRemote::open_sftp(ctx)) {
+		sync_report_err(ctx, ctx->root->remote_path.c_str());
 		return false;
 	}
 
+	for (SyncRoot_t& root : ctx->roots) {
+		ctx->root = &root;
+		if (!check_root(ctx)) return false;
+	}
+
 	return true;
 }
 
 /**
- * @brief Main thread to check remote and local directories.
+ * @brief Reconnect to remote host. Only a single attempt is made, the caller
+ * should retry after the returned delay if it's failed.
+ * @return delay in milliseconds before the next cycle should be started
  * */
-void sync_thread(SftpWatch_t* ctx)
+static uint32_t sync_reconnect(SftpWatch_t* ctx)
 {
-	ctx->is_stopped = !check_root_dirs(ctx);
+	// other instances sharing this session must not hand it out anymore
+	SftpRemote::mark_broken(ctx);
+
+	if (SftpWatch::connect_or_reconnect(ctx) || SftpRemote::open_sftp(ctx)) {
+		// increase delay on each failure, up to timeout
+		uint32_t timeout_sec = static_cast<uint32_t>(ctx->timeout_sec);
+		if (ctx->reconnect_ms < SNOD_SEC2MS(timeout_sec)) {
+			ctx->reconnect_ms += ctx->delay_ms;
+		}
 
-	while (!ctx->is_stopped) {
-		int32_t     rc = 0;
-		AllIns_t    ins;
-		SyncQueue_t que;
+		return ctx->reconnect_ms;
+	}
+
+	// reset on succesful reconnection
+	ctx->reconnect_ms   = 0;
+	ctx->no_remote_hash = false;
+	SNOD_STAT_ADD(ctx, reconnects, 1);
+	SftpWatch::clear(ctx);
 
-		for (auto& [key, dir] : ctx->local_dirs) {
+	return ctx->delay_ms;
+}
+
+/**
+ * @brief Check remote and local directories of current root once.
+ * Scan durations and queue sizes are added to the cycle totals.
+ * @param paths triggered paths to be checked. Empty to check the whole root
+ * */
+static void sync_root_cycle(SftpWatch_t* ctx, CycleTotal_t* total,
+	const std::vector<std::string>& paths, bool is_verify)
+{
+	int32_t     rc         = 0;
+	bool        is_partial = false;
+	AllIns_t    ins;
+	SyncQueue_t que;
+
+	ctx->root->local_gone.clear();
+
+	std::vector<std::string> subtrees = prv_get_subtrees(ctx, paths);
+
+	// mirror modes skip destination side, except on the first and verify scan
+	bool is_full     = is_verify || ctx->root->base_snap.empty();
+	bool scan_local  = ctx->mode != SNOD_MODE_DOWNLOAD || is_full;
+	bool scan_remote = ctx->mode != SNOD_MODE_UPLOAD || is_full;
+
+	SyncClock_t::time_point t_scan = SyncClock_t::now();
+
+	{
+		SNOD_TRACE_PHASE(ctx, "localScan");
+
+		for (auto& [key, dir] : ctx->root->local_dirs) {
+			if (!scan_local) break;
+			if (!prv_in_subtree(key, subtrees)) continue;
 			if (ctx->is_stopped || (rc = sync_dir_local(ctx, dir, &ins))) {
+				is_partial = true;
 				break;
 			}
 		}
+	}
 
-		for (auto& [key, dir] : ctx->remote_dirs) {
-			if (ctx->is_stopped || (rc = sync_dir_remote(ctx, dir, &ins))) {
+	total->local_scan_us += prv_elapsed_us(t_scan);
+	t_scan = SyncClock_t::now();
+
+	{
+		SNOD_TRACE_PHASE(ctx, "remoteScan");
+
+		for (auto& [key, dir] : ctx->root->remote_dirs) {
+			if (!scan_remote) break;
+			if (!prv_in_subtree(key, subtrees)) continue;
+			if (ctx->is_stopped) {
+				is_partial = true;
+				break;
+			}
+
+			// other instances of the session get a turn between directories
+			std::unique_lock<EngineMutex_t> lock = SftpRemote::lock(ctx);
+			if ((rc = sync_dir_remote(ctx, dir, &ins))) {
+				is_partial = true;
 				break;
 			}
 		}
+	}
+
+	total->remote_scan_us += prv_elapsed_us(t_scan);
 
-		sync_dir_cmp_snap(ctx, ins, &que);
+	{
+		SNOD_TRACE_PHASE(ctx, "compare");
+		sync_dir_cmp_snap(ctx, ins, &que, subtrees, is_partial);
+		sync_trust_base(ctx, ins);
+	}
+
+	total->que_l_new += que.l_new.size();
+	total->que_r_new += que.r_new.size();
+	total->que_l_del += que.l_del.size();
+	total->que_r_del += que.r_del.size();
+
+	{
+		SNOD_TRACE_PHASE(ctx, "operations");
 		sync_dir_op(ctx, que);
+	}
+}
 
-		if (ctx->err_count >= ctx->max_err_count && !ctx->is_stopped) {
-			int16_t reconnect_delay = ctx->delay_ms;
-			while (!ctx->is_stopped && SftpWatch::connect_or_reconnect(ctx)) {
-				if (reconnect_delay < ctx->timeout_sec) {
-					reconnect_delay += ctx->delay_ms;
-				}
-				SNOD_DELAY_MS(reconnect_delay);
-			}
+/**
+ * @brief Check remote and local directories of all roots once.
+ * @return delay in milliseconds before the next cycle should be started
+ * */
+static uint32_t sync_cycle(SftpWatch_t* ctx)
+{
+	// previous reconnection has failed, don't scan anything until connected
+	if (ctx->reconnect_ms) return sync_reconnect(ctx);
+
+	CycleTotal_t             total;
+	std::vector<std::string> paths;
+
+	// take triggered paths. Empty paths means whole roots are checked
+	{
+		std::lock_guard<std::mutex> lock(ctx->wake_mtx);
+
+		if (ctx->is_triggered) paths.swap(ctx->trigger_paths);
+
+		ctx->trigger_paths.clear();
+		ctx->is_triggered = false;
+	}
 
-			// reset on succesful reconnection
-			SftpWatch::clear(ctx);
+	// both sides are scanned periodically in mirror modes
+	bool is_verify = ctx->verify_every
+		&& ++ctx->verify_cycles >= ctx->verify_every;
+	if (is_verify) ctx->verify_cycles = 0;
+
+	SyncClock_t::time_point t_cycle   = SyncClock_t::now();
+	uint64_t                rtt_saved = SNOD_STAT_GET(ctx, rtt_saved);
+
+	{
+		SNOD_TRACE_PHASE(ctx, "cycle");
+
+		// all roots share the same session and thread, one after another
+		for (SyncRoot_t& root : ctx->roots) {
+			if (ctx->is_stopped || ctx->err_count >= ctx->max_err_count) break;
+
+			ctx->root = &root;
+			sync_root_cycle(ctx, &total, paths, is_verify);
 		}
+	}
 
-		SNOD_THREAD_WAIT(SNOD_PRV_WAIT_MS, ctx->delay_ms, !ctx->is_stopped);
+	SNOD_STAT_SET(ctx, local_scan_us, total.local_scan_us);
+	SNOD_STAT_SET(ctx, remote_scan_us, total.remote_scan_us);
+	SNOD_STAT_SET(ctx, que_l_new, total.que_l_new);
+	SNOD_STAT_SET(ctx, que_r_new, total.que_r_new);
+	SNOD_STAT_SET(ctx, que_l_del, total.que_l_del);
+	SNOD_STAT_SET(ctx, que_r_del, total.que_r_del);
+	SNOD_STAT_SET(
+		ctx, cycle_rtt_saved, SNOD_STAT_GET(ctx, rtt_saved) - rtt_saved);
+	SNOD_STAT_SET(ctx, cycle_us, prv_elapsed_us(t_cycle));
+	SNOD_STAT_ADD(ctx, cycles, 1);
+
+	SftpCompare::save(ctx);
+
+	if (ctx->err_count >= ctx->max_err_count && !ctx->is_stopped) {
+		return sync_reconnect(ctx);
 	}
 
-	// Cleanup
+	return ctx->delay_ms;
+}
+
+/**
+ * @brief Main thread to check remote and local directories.
+ * */
+void sync_thread(SftpWatch_t* ctx)
+{
+	ctx->is_stopped = !check_root_dirs(ctx);
+
+	while (!ctx->is_stopped) {
+		uint32_t delay_ms = sync_cycle(ctx);
+
+		// wait for next cycle, stop request or triggered sync
+		std::unique_lock<std::mutex> lock(ctx->wake_mtx);
+		ctx->wake_cv.wait_for(lock, std::chrono::milliseconds(delay_ms),
+			[ctx]() { return ctx->is_stopped || ctx->is_triggered; });
+	}
+
+	// Cleanup, JavaScript thread never locks the session to close the channel
+	SftpRemote::close_sftp(ctx);
+	ctx->cb_cleanup(ctx, ctx->user_data);
+}
+
+/**
+ * @brief Shared engine task. Runs a single cycle, then reschedules itself
+ * until stop is requested.
+ * */
+void sync_task(SftpWatch_t* ctx)
+{
+	if (!ctx->is_stopped) {
+		uint32_t delay_ms = sync_cycle(ctx);
+
+		if (!ctx->is_stopped) {
+			SftpEngine::submit(ctx, sync_task, delay_ms);
+
+			// stop or trigger requested while running, wake was missed
+			std::lock_guard<std::mutex> lock(ctx->wake_mtx);
+			if (ctx->is_stopped || ctx->is_triggered) SftpEngine::wake(ctx);
+
+			return;
+		}
+	}
+
+	// Cleanup, JavaScript thread never locks the session to close the channel
+	SftpRemote::close_sftp(ctx);
 	ctx->cb_cleanup(ctx, ctx->user_data);
 }
 
+/**
+ * @brief First shared engine task. Same as #sync_thread, root directories
+ * are checked before the first cycle.
+ * */
+void sync_task_init(SftpWatch_t* ctx)
+{
+	ctx->is_stopped = !check_root_dirs(ctx);
+	sync_task(ctx);
+}
+
 } /* ******************** End of Static Functions *************************** */
 
 /* ************************ API Implementations ***************************** */
@@ -561,6 +1612,34 @@ uint8_t SftpWatch::get_filetype(DirItem_t* file)
 	}
 }
 
+bool SftpWatch::is_temp(const std::string& name)
+{
+	static const size_t len = sizeof(SNOD_TEMP_SUFFIX) - 1;
+
+	return name.size() > len
+		&& name.compare(name.size() - len, len, SNOD_TEMP_SUFFIX) == 0;
+}
+
+std::string SftpWatch::temp_path(const std::string& path)
+{
+	size_t pos = path.find_last_of(SNOD_SEP_CHAR);
+	pos        = (pos == std::string::npos) ? 0 : pos + 1;
+
+	return path.substr(0, pos) + "." + path.substr(pos) + SNOD_TEMP_SUFFIX;
+}
+
+std::string SftpWatch::stage_path(SftpWatch_t* ctx, const std::string& path)
+{
+	if (ctx->staging_dir.empty()) return SftpWatch::temp_path(path);
+
+	// named by hash of the destination, so files of all roots can share it
+	char name[32];
+	snprintf(name, sizeof(name), "%016zx",
+		static_cast<size_t>(std::hash<std::string> {}(path)));
+
+	return ctx->staging_dir + SNOD_SEP + "." + name + SNOD_TEMP_SUFFIX;
+}
+
 int32_t SftpWatch::set_user_data(SftpWatch_t* ctx, UserData_t data)
 {
 	if (!ctx || !data) return -1;
@@ -570,6 +1649,17 @@ int32_t SftpWatch::set_user_data(SftpWatch_t* ctx, UserData_t data)
 	return 0;
 }
 
+void SftpWatch::add_root(
+	SftpWatch_t* ctx, Directory_t remote, Directory_t local)
+{
+	uint16_t index = static_cast<uint16_t>(ctx->roots.size());
+
+	ctx->roots.emplace_back(index, remote, local);
+
+	// vector might be reallocated
+	ctx->root = &ctx->roots.front();
+}
+
 int32_t SftpWatch::connect_or_reconnect(SftpWatch_t* ctx)
 {
 	SftpRemote::disconnect(ctx);
@@ -584,12 +1674,62 @@ int32_t SftpWatch::connect_or_reconnect(SftpWatch_t* ctx)
 void SftpWatch::start(SftpWatch_t* ctx)
 {
 	ctx->is_stopped = false;
-	ctx->thread     = std::thread(sync_thread, ctx);
+
+	if (ctx->use_engine) {
+		SftpEngine::attach(ctx->engine_threads);
+		SftpEngine::submit(ctx, sync_task_init, 0);
+	} else {
+		ctx->thread = std::thread(sync_thread, ctx);
+	}
 }
 
 void SftpWatch::request_stop(SftpWatch_t* ctx)
 {
-	ctx->is_stopped = true;
+	{
+		std::lock_guard<std::mutex> lock(ctx->wake_mtx);
+		ctx->is_stopped = true;
+	}
+
+	// don't wait for the next scheduled cycle
+	ctx->wake_cv.notify_all();
+	if (ctx->use_engine) SftpEngine::wake(ctx);
+}
+
+void SftpWatch::trigger(SftpWatch_t* ctx, const std::string& path)
+{
+	std::string rela = path;
+
+	// same form as directory list keys, without leading and trailing separator
+	while (!rela.empty() && rela.front() == SNOD_SEP_CHAR) rela.erase(0, 1);
+	while (!rela.empty() && rela.back() == SNOD_SEP_CHAR) rela.pop_back();
+
+	{
+		std::lock_guard<std::mutex> lock(ctx->wake_mtx);
+
+		/*
+		 * Triggering whole roots overrides subtrees. It's marked by triggered
+		 * flag with empty path list.
+		 * */
+		bool is_whole = ctx->is_triggered && ctx->trigger_paths.empty();
+
+		if (rela.empty()) {
+			ctx->trigger_paths.clear();
+		} else if (!is_whole) {
+			ctx->trigger_paths.push_back(rela);
+		}
+
+		ctx->is_triggered = true;
+	}
+
+	ctx->wake_cv.notify_all();
+	if (ctx->use_engine) SftpEngine::wake(ctx);
+}
+
+void SftpWatch::join(SftpWatch_t* ctx)
+{
+	if (ctx->thread.joinable()) ctx->thread.join();
+
+	if (ctx->use_engine) SftpEngine::detach(ctx);
 }
 
 void SftpWatch::disconnect(SftpWatch_t* ctx)
@@ -599,12 +1739,14 @@ void SftpWatch::disconnect(SftpWatch_t* ctx)
 
 void SftpWatch::clear(SftpWatch_t* ctx)
 {
-	ctx->base_snap.clear();
-	ctx->local_snap.clear();
-	ctx->remote_snap.clear();
+	for (SyncRoot_t& root : ctx->roots) {
+		root.base_snap.clear();
+		root.local_snap.clear();
+		root.remote_snap.clear();
 
-	prv_clear_dirs(&ctx->remote_dirs);
-	prv_clear_dirs(&ctx->local_dirs);
+		prv_clear_dirs(&root.remote_dirs);
+		prv_clear_dirs(&root.local_dirs);
+	}
 
 	ctx->err_count = 0;
 }
@@ -2,16 +2,25 @@
 #define _SFTP_NODE_HPP
 
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 #include <libssh2.h>
 #include <libssh2_sftp.h>
 
+#include "sftp_engine.hpp"
+#include "sftp_pool.hpp"
+#include "sftp_stats.hpp"
+#include "sftp_trace.hpp"
+
 #if defined(_POSIX_VERSION)
 #	include <netinet/in.h>
 #	include <dirent.h>
@@ -19,9 +28,54 @@
 #	include <windows.h>
 #endif
 
-// default to 30000, as it is the value of max SFTP Packet
-#ifndef SFTP_READ_BUFFER_SIZE
-#	define SFTP_READ_BUFFER_SIZE 30000
+/** files of this size or larger are transferred in large file lane, 0 keeps
+ * a single lane */
+#ifndef SNOD_LARGE_FILE_SIZE
+#	define SNOD_LARGE_FILE_SIZE 0U
+#endif
+
+/** number of small files transferred between two large files */
+#ifndef SNOD_SMALL_PER_LARGE
+#	define SNOD_SMALL_PER_LARGE 8U
+#endif
+
+/** SFTP channels used to delete remote directory tree concurrently */
+#ifndef SNOD_DELETE_CHANNELS
+#	define SNOD_DELETE_CHANNELS 8U
+#endif
+
+/** delete requests kept in flight on each of those channels */
+#ifndef SNOD_DELETE_WINDOW
+#	define SNOD_DELETE_WINDOW 64U
+#endif
+
+/** remote trees with fewer items are deleted on a single channel */
+#ifndef SNOD_DELETE_PIPELINE_MIN
+#	define SNOD_DELETE_PIPELINE_MIN 64U
+#endif
+
+/** limits of a small file batch, see #SyncBatch_t */
+#ifndef SNOD_BATCH_FILES
+#	define SNOD_BATCH_FILES 256U
+#endif
+
+#ifndef SNOD_BATCH_BYTES
+#	define SNOD_BATCH_BYTES (16U * 1024U * 1024U)
+#endif
+
+/** block size of delta transfer, see #SyncDelta_t */
+#ifndef SNOD_DELTA_BLOCK_SIZE
+#	define SNOD_DELTA_BLOCK_SIZE (1024U * 1024U)
+#endif
+
+/** buffer size of local writes of downloaded files, see #SyncWriter_t */
+#ifndef SNOD_WRITE_BLOCK
+#	define SNOD_WRITE_BLOCK (1024U * 1024U)
+#endif
+
+/** suffix of partially written files, which are skipped when scanning */
+#ifndef SNOD_TEMP_SUFFIX
+#	define SNOD_TEMP_SUFFIX ".sftp-watch.tmp"
 #endif
 
 #ifndef SFTP_FILENAME_MAX_LEN
@@ -39,8 +93,9 @@
 
 #define SNOD_DELAY_US(us)                                                      \
 	std::this_thread::sleep_for(std::chrono::microseconds((us)))
-#define SNOD_DELAY_MS(ms)                                                      \
-	std::this_thread::sleep_for(std::chrono::milliseconds((ms)))
+
+/** engine task is suspended instead, other tasks of its thread keep running */
+#define SNOD_DELAY_MS(ms) SftpEngine::sleep((ms))
 
 #ifndef _WIN32
 #	define SNOD_SEC2MS(s) ((s) * 1000)
@@ -51,6 +106,13 @@
 
 #define SNOD_CHR2STR(s) (std::string(1, (s)))
 
+#define SNOD_STAT_ADD(ctx, field, n)                                           \
+	(ctx)->stats.field.fetch_add((n), std::memory_order_relaxed)
+#define SNOD_STAT_SET(ctx, field, n)                                           \
+	(ctx)->stats.field.store((n), std::memory_order_relaxed)
+#define SNOD_STAT_GET(ctx, field)                                              \
+	(ctx)->stats.field.load(std::memory_order_relaxed)
+
 #ifndef SNOD_HOSTKEY_HASH
 #	define SNOD_HOSTKEY_HASH LIBSSH2_HOSTKEY_HASH_SHA1
 #endif
@@ -82,11 +144,40 @@ enum ConnStatus_e {
 	SNOD_AUTHENTICATED = 2U,
 };
 
+/** Sync direction. Mirror modes trust destination side from base snapshot */
+enum SyncMode_e {
+	SNOD_MODE_BIDIR    = 0U,
+	SNOD_MODE_DOWNLOAD = 1U, /**< remote to local, local side isn't scanned */
+	SNOD_MODE_UPLOAD   = 2U, /**< local to remote, remote side isn't scanned */
+};
+
+/** How modified regular files are detected */
+enum SyncCompare_e {
+	SNOD_COMPARE_MTIME = 0U, /**< size and mtime */
+	SNOD_COMPARE_HASH  = 1U, /**< content hash when size is the same */
+};
+
+/** When downloaded files are flushed to disk */
+enum SyncFsync_e {
+	SNOD_FSYNC_NONE  = 0U, /**< left to the OS */
+	SNOD_FSYNC_FILE  = 1U, /**< each file before it's closed */
+	SNOD_FSYNC_BATCH = 2U, /**< once after all downloads of a cycle */
+};
+
+/** Order of queued files with the same priority */
+enum SyncOrder_e {
+	SNOD_ORDER_SCAN     = 0U,
+	SNOD_ORDER_SMALLEST = 1U,
+	SNOD_ORDER_OLDEST   = 2U,
+};
+
 typedef enum EventFile_e {
 	EVT_FILE_LDEL = 0x00,
 	EVT_FILE_UP   = 0x01,
 	EVT_FILE_RDEL = 0x02,
 	EVT_FILE_DOWN = 0x03,
+	EVT_FILE_LMOV = 0x04, /**< moved on local, renamed on remote */
+	EVT_FILE_RMOV = 0x05, /**< moved on remote, renamed on local */
 } EventFile_t;
 
 typedef enum ErrorFrom_e {
@@ -98,11 +189,22 @@ typedef enum ErrorFrom_e {
 
 typedef void* UserData_t;
 
-typedef struct DirItem_s   DirItem_t;
-typedef struct SftpWatch_s SftpWatch_t;
-typedef struct Directory_s Directory_t;
-typedef struct SyncQueue_s SyncQueue_t;
-typedef struct SyncErr_s   SyncErr_t;
+typedef struct DirItem_s      DirItem_t;
+typedef struct SftpWatch_s    SftpWatch_t;
+typedef struct Directory_s    Directory_t;
+typedef struct SyncQueue_s    SyncQueue_t;
+typedef struct SyncErr_s      SyncErr_t;
+typedef struct SyncStats_s    SyncStats_t;
+typedef struct SftpConn_s     SftpConn_t;
+typedef struct SyncRoot_s     SyncRoot_t;
+typedef struct SyncPriority_s SyncPriority_t;
+typedef struct SyncMove_s     SyncMove_t;
+typedef struct SyncDelta_s    SyncDelta_t;
+typedef struct SyncBatch_s    SyncBatch_t;
+typedef struct SyncWriter_s   SyncWriter_t;
+typedef struct SyncAlgo_s     SyncAlgo_t;
+typedef struct HashEntry_s    HashEntry_t;
+typedef struct HashCache_s    HashCache_t;
 
 typedef std::map<std::string, Directory_t> DirList_t;
 typedef std::map<std::string, DirItem_t>   PathFile_t;
@@ -110,8 +212,9 @@ typedef std::map<std::string, PathFile_t>  DirSnapshot_t;
 
 typedef std::map<std::string, std::unordered_set<std::string>> AllIns_t;
 
+/** prev is the previous name of a moved item, nullptr for other events */
 typedef void (*sync_file_cb)(SftpWatch_t* ctx, UserData_t data, DirItem_t* file,
-	bool status, EventFile_t ev);
+	bool status, EventFile_t ev, const std::string* prev);
 typedef void (*sync_cleanup_cb)(SftpWatch_t* ctx, UserData_t data);
 typedef void (*sync_err_cb)(
 	SftpWatch_t* ctx, UserData_t data, SyncErr_t* error);
@@ -133,11 +236,142 @@ struct SyncErr_s {
 	}
 };
 
-struct SyncQueue_s {
-	std::vector<DirItem_t*> l_new;
-	std::vector<DirItem_t*> r_new;
-	std::vector<DirItem_t>  r_del;
-	std::vector<DirItem_t>  l_del;
+/**
+ * Runtime counters. Updated by sync thread and can be read from any thread
+ * while synchronization is running. Durations are in microseconds.
+ * */
+struct SyncStats_s {
+	std::atomic<uint64_t> cycles         = 0; /**< finished sync cycles */
+	std::atomic<uint64_t> cycle_us       = 0; /**< duration of last cycle */
+	std::atomic<uint64_t> local_scan_us  = 0; /**< last local scan duration */
+	std::atomic<uint64_t> remote_scan_us = 0; /**< last remote scan duration */
+
+	std::atomic<uint64_t> local_dirs     = 0; /**< local dirs listed */
+	std::atomic<uint64_t> remote_dirs    = 0; /**< remote dirs listed */
+	std::atomic<uint64_t> local_entries  = 0; /**< local entries listed */
+	std::atomic<uint64_t> remote_entries = 0; /**< remote entries listed */
+
+	/** queue sizes of the last cycle, see #SyncQueue_t */
+	std::atomic<uint64_t> que_l_new = 0;
+	std::atomic<uint64_t> que_r_new = 0;
+	std::atomic<uint64_t> que_l_del = 0;
+	std::atomic<uint64_t> que_r_del = 0;
+
+	std::atomic<uint64_t> bytes_up    = 0;
+	std::atomic<uint64_t> bytes_down  = 0;
+	std::atomic<uint64_t> uploads     = 0; /**< finished file uploads */
+	std::atomic<uint64_t> downloads   = 0; /**< finished file downloads */
+	std::atomic<uint64_t> local_dels  = 0; /**< items deleted on local */
+	std::atomic<uint64_t> remote_dels = 0; /**< items deleted on remote */
+	std::atomic<uint64_t> moves       = 0; /**< renamed instead of transfer */
+	std::atomic<uint64_t> appends     = 0; /**< only new tail transferred */
+	std::atomic<uint64_t> deltas      = 0; /**< only changed blocks sent */
+	std::atomic<uint64_t> bytes_saved = 0; /**< unchanged bytes not sent */
+	std::atomic<uint64_t> batches     = 0; /**< tar batches transferred */
+	std::atomic<uint64_t> hashed      = 0; /**< files hashed, not cached */
+	std::atomic<uint64_t> attr_syncs  = 0; /**< same content, attrs only */
+	std::atomic<uint64_t> verified    = 0; /**< transfers hash matched */
+	std::atomic<uint64_t> reconnects  = 0; /**< successful reconnections */
+	std::atomic<uint64_t> errors      = 0; /**< errors reported to cb_err */
+
+	/** remote requests skipped because the answer is known from snapshots */
+	std::atomic<uint64_t> rtt_saved       = 0;
+	std::atomic<uint64_t> cycle_rtt_saved = 0; /**< rtt_saved of last cycle */
+};
+
+/**
+ * SSH connection, which can be shared by several instances targeting the same
+ * host with the same credentials. Each instance still opens its own SFTP
+ * channel on the session. libssh2 session is not thread-safe, so every
+ * instance must hold #mtx while using it, for a single remote operation.
+ * Engine tasks hold it while they're suspended, see #EngineMutex_t. It's never
+ * held across callbacks, nor locked by JavaScript thread.
+ * */
+struct SftpConn_s {
+	libssh2_socket_t     sock        = LIBSSH2_INVALID_SOCKET;
+	LIBSSH2_SESSION*     session     = nullptr;
+	int16_t              timeout_sec = 60U;
+	std::vector<uint8_t> fingerprint;
+
+	EngineMutex_t     mtx;
+	std::atomic<bool> is_authed = false;
+	std::atomic<bool> is_broken = false; /**< don't hand out to new instances */
+};
+
+/** Transfer scheduling, see sftp_sched.hpp */
+struct SyncPriority_s {
+	std::vector<std::string> patterns; /**< glob, first has highest priority */
+
+	uint8_t  order           = SNOD_ORDER_SCAN;      /**< see #SyncOrder_e */
+	uint64_t large_size      = SNOD_LARGE_FILE_SIZE; /**< 0 disables lanes */
+	uint32_t small_per_large = SNOD_SMALL_PER_LARGE;
+};
+
+/**
+ * Changed files are transferred block by block, only blocks with different
+ * hash are sent. Remote hashes are computed by a command over exec channel.
+ * */
+struct SyncDelta_s {
+	uint64_t    min_size = 0; /**< smallest file using delta. 0 disables */
+	uint32_t    block    = SNOD_DELTA_BLOCK_SIZE;
+	std::string command; /**< block hash command, empty for default */
+};
+
+/**
+ * Small files are transferred in batches, each batch as one tar archive
+ * streamed over exec channel, see sftp_batch.hpp.
+ * */
+struct SyncBatch_s {
+	uint64_t max_size  = 0; /**< largest file put in batch. 0 disables */
+	uint32_t max_files = SNOD_BATCH_FILES; /**< files in one batch */
+	uint64_t max_bytes = SNOD_BATCH_BYTES; /**< total size of one batch */
+};
+
+/**
+ * Local writes of downloaded files, see sftp_writer.hpp.
+ * */
+struct SyncWriter_s {
+	uint32_t block       = SNOD_WRITE_BLOCK; /**< size of each write */
+	bool     preallocate = true;  /**< reserve remote size before writing */
+	bool     direct      = false; /**< bypass page cache with O_DIRECT */
+	bool     drop_cache  = false; /**< write-behind, drop written pages */
+	uint8_t  fsync       = SNOD_FSYNC_NONE; /**< see #SyncFsync_e */
+
+	/**
+	 * duplicated descriptors of files waiting for batch fsync. On Linux, one
+	 * per file system, which is flushed by syncfs()
+	 * */
+	std::vector<int> unsynced;
+};
+
+/**
+ * SSH algorithm preferences, comma separated as libssh2_session_method_pref()
+ * takes them. Empty keeps libssh2 defaults. See sftp_algo.hpp for ranking.
+ * */
+struct SyncAlgo_s {
+	std::string kex;
+	std::string hostkey;
+	std::string cipher; /**< candidates of ranking, if it's enabled */
+	std::string mac;
+	bool        rank_local = false; /**< order ciphers by local OpenSSL speed */
+};
+
+/** content hash of a file, valid while the file keeps its stat */
+struct HashEntry_s {
+	uint64_t    size       = 0;
+	uint64_t    mtime      = 0;
+	uint32_t    mtime_nsec = 0;
+	uint64_t    ino        = 0;
+	std::string hash; /**< hex SHA-256 */
+};
+
+/** Hashes of local and remote files, keyed by side and absolute path */
+struct HashCache_s {
+	std::string path; /**< file the cache is kept in. Empty for memory only */
+	std::unordered_map<std::string, HashEntry_t> entries;
+
+	bool is_loaded = false;
+	bool is_dirty  = false;
 };
 
 struct DirItem_s {
@@ -149,6 +383,30 @@ struct DirItem_s {
 
 	/** File attributes. Also be used for local directory */
 	LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+	/** inode number of local item. 0 for remote item or when unknown */
+	uint64_t ino = 0;
+
+	/** sub-second part of local mtime. 0 for remote item */
+	uint32_t mtime_nsec = 0;
+
+	/** hex SHA-256 of the transferred content. Empty if it isn't hashed */
+	std::string hash;
+};
+
+/** Item moved on one side. Applied as rename on the other side */
+struct SyncMove_s {
+	DirItem_t  from; /**< item before moved, removed from snapshots */
+	DirItem_t* to;   /**< item in base snapshot, same as l_new and r_new */
+};
+
+struct SyncQueue_s {
+	std::vector<DirItem_t*> l_new;
+	std::vector<DirItem_t*> r_new;
+	std::vector<DirItem_t>  r_del;
+	std::vector<DirItem_t>  l_del;
+	std::vector<SyncMove_t> l_mov; /**< moved on local */
+	std::vector<SyncMove_t> r_mov; /**< moved on remote */
 };
 
 struct Directory_s {
@@ -169,43 +427,114 @@ struct Directory_s {
 #endif
 };
 
+/** Pair of remote and local root directories, synchronized together */
+struct SyncRoot_s {
+	uint16_t    index = 0; /**< position of the mapping in config */
+	std::string remote_path;
+	std::string local_path;
+
+	/** Snapshots */
+	DirSnapshot_t base_snap;
+	DirSnapshot_t remote_snap;
+	DirSnapshot_t local_snap;
+
+	/** local items gone in the current cycle, used to detect moves */
+	PathFile_t local_gone;
+
+	/** collection of directory that should be iterated */
+	DirList_t remote_dirs;
+	DirList_t local_dirs;
+
+	SyncRoot_s(uint16_t index, Directory_t remote_dir, Directory_t local_dir)
+		: index(index)
+		, remote_path(remote_dir.path)
+		, local_path(local_dir.path)
+	{
+		this->remote_dirs[SNOD_SEP] = remote_dir;
+		this->local_dirs[SNOD_SEP]  = local_dir;
+	}
+};
+
 struct SftpWatch_s {
 	int16_t     timeout_sec = 60U;
 	uint16_t    port        = 22U;
 	std::string host;
 	std::string username;
-	std::string remote_path;
-	std::string local_path;
 
 	std::string pubkey;
 	std::string privkey;
 	std::string password;
 	bool        use_keyboard = true;
+	SyncAlgo_t  algo;
 
 	std::atomic<uint8_t> status        = SNOD_DISCONNECTED;
 	std::atomic<uint8_t> err_count     = 0;
 	uint8_t              max_err_count = 3;
 
-	SyncErr_t last_error;
+	SyncErr_t   last_error;
+	SyncStats_t stats;
+	LatHist_t   latency[LAT_OP_COUNT]; /**< see #LatencyOp_t */
+	TraceBuf_t  trace;
 
 	std::atomic<bool> is_stopped = false; /**< set to true to stop sync loop */
 	uint32_t          delay_ms   = 1000;  /**< delay between sync loop */
 
+	SyncPriority_t priority;
+	uint8_t        delete_channels = SNOD_DELETE_CHANNELS; /**< 1 to disable */
+
+	/** trailing bytes compared before only new tail of a growing file is
+	 * transferred. 0 to always transfer whole file */
+	uint32_t append_window = 0;
+
+	SyncDelta_t  delta;
+	SyncBatch_t  batch;
+	SyncWriter_t writer;
+
+	uint8_t     compare = SNOD_COMPARE_MTIME; /**< see #SyncCompare_e */
+	HashCache_t hash_cache;
+
+	/** skip holes of uploaded files, and write zero blocks as holes */
+	bool sparse = false;
+
+	BufPool_t buffers; /**< transfer buffers, see sftp_pool.hpp */
+	BufPool_t blocks;  /**< blocks of local writer */
+
+	/** uploads of this size or larger are read by mmap. 0 to disable */
+	uint64_t mmap_size = 0;
+
+	/** write into temporary file, then rename it over the destination */
+	bool        staged = false;
+	std::string staging_dir; /**< local temporary files. Empty for same dir */
+
+	/** hash transferred bytes and compare them with remote sha256sum */
+	bool checksum       = false;
+	bool no_remote_hash = false; /**< remote hash command is unavailable */
+
+	uint8_t  mode          = SNOD_MODE_BIDIR; /**< see #SyncMode_e */
+	uint32_t verify_every  = 0; /**< full scan period in cycles. 0 to never */
+	uint32_t verify_cycles = 0; /**< cycles since the last full scan */
+
+	/** wakes up the sync thread on stop or trigger, guarded by #wake_mtx */
+	std::mutex               wake_mtx;
+	std::condition_variable  wake_cv;
+	bool                     is_triggered = false;
+	std::vector<std::string> trigger_paths; /**< subtrees to be checked */
+
 	libssh2_socket_t     sock;
 	LIBSSH2_SESSION*     session      = nullptr;
 	LIBSSH2_SFTP*        sftp_session = nullptr;
 	std::vector<uint8_t> fingerprint;
 
-	std::thread thread;
+	bool                        share_conn = false; /**< reuse SSH session */
+	std::shared_ptr<SftpConn_t> conn;               /**< owner of session */
 
-	/** Snapshots */
-	DirSnapshot_t base_snap;
-	DirSnapshot_t remote_snap;
-	DirSnapshot_t local_snap;
+	std::thread thread;
+	bool        use_engine     = false; /**< run on shared engine threads */
+	uint8_t     engine_threads = 0;     /**< shared engine size. 0 is default */
+	uint32_t    reconnect_ms   = 0;     /**< delay before next reconnection */
 
-	/** collection of directory that should be iterated */
-	DirList_t remote_dirs;
-	DirList_t local_dirs;
+	std::vector<SyncRoot_t> roots;          /**< mapped directory pairs */
+	SyncRoot_t*             root = nullptr; /**< root being synchronized */
 
 	sync_file_cb    cb_file;
 	sync_err_cb     cb_err;
@@ -219,8 +548,6 @@ struct SftpWatch_s {
 		sync_cleanup_cb cb_cleanup)
 		: host(host)
 		, username(username)
-		, remote_path(remote_dir.path)
-		, local_path(local_dir.path)
 		, pubkey(pubkey)
 		, privkey(privkey)
 		, password(password)
@@ -228,8 +555,8 @@ struct SftpWatch_s {
 		, cb_err(cb_err)
 		, cb_cleanup(cb_cleanup)
 	{
-		this->remote_dirs[SNOD_SEP] = remote_dir;
-		this->local_dirs[SNOD_SEP]  = local_dir;
+		this->roots.emplace_back(0, remote_dir, local_dir);
+		this->root = &this->roots.front();
 	}
 };
 
@@ -239,10 +566,20 @@ uint8_t get_filetype(DirItem_t* file);
 void    disconnect(SftpWatch_t* ctx);
 int32_t connect_or_reconnect(SftpWatch_t* ctx);
 int32_t set_user_data(SftpWatch_t* ctx, UserData_t data);
+void    add_root(SftpWatch_t* ctx, Directory_t remote, Directory_t local);
 void    start(SftpWatch_t* ctx);
 void    request_stop(SftpWatch_t* ctx);
+void    trigger(SftpWatch_t* ctx, const std::string& path);
+void    join(SftpWatch_t* ctx);
 void    clear(SftpWatch_t* ctx);
 uint8_t status(SftpWatch_t* ctx);
+bool    is_temp(const std::string& name);
+
+/** hidden temporary file next to the path, matched by is_temp() */
+std::string temp_path(const std::string& path);
+
+/** temporary file of staged download, in staging directory if it's set */
+std::string stage_path(SftpWatch_t* ctx, const std::string& path);
 
 }
 
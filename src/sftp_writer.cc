@@ -0,0 +1,318 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "debug.hpp"
+#include "sftp_writer.hpp"
+
+#include <fcntl.h>
+
+#if defined(_POSIX_VERSION)
+#	include <sys/stat.h>
+#	include <unistd.h>
+
+#	define SNOD_O_BINARY 0
+#elif defined(_WIN32)
+#	include <io.h>
+#	include <sys/stat.h>
+
+#	define SNOD_O_BINARY O_BINARY
+
+#	define lseek     _lseeki64
+#	define ftruncate _chsize_s
+#	define fsync     _commit
+#else
+#	error "UNKNOWN ENVIRONMENT"
+#endif
+
+static_assert(SNOD_POOL_ALIGN % SNOD_WRITE_ALIGN == 0,
+	"pooled blocks must be aligned for O_DIRECT");
+
+namespace { // start of unnamed namespace for static function
+
+/** unaligned tail can't be written with O_DIRECT, switch to buffered write */
+static void prv_clear_direct(LocalWriter_t* wr)
+{
+#if defined(O_DIRECT)
+	if (!wr->is_direct) return;
+
+	int flags = fcntl(wr->fd, F_GETFL);
+	if (flags != -1) fcntl(wr->fd, F_SETFL, flags & ~O_DIRECT);
+#endif
+
+	wr->is_direct = false;
+}
+
+/**
+ * @brief start writeback of the new block, then wait for the older blocks
+ * and drop them from page cache. Writeback runs one block behind the writer.
+ * */
+static void prv_write_behind(LocalWriter_t* wr, uint64_t offset, size_t len)
+{
+#if defined(__linux__)
+	if (!wr->conf->drop_cache || wr->is_direct) return;
+
+	sync_file_range(wr->fd, static_cast<off_t>(offset),
+		static_cast<off_t>(len), SYNC_FILE_RANGE_WRITE);
+
+	if (offset <= wr->dropped) return;
+
+	off_t start = static_cast<off_t>(wr->dropped);
+	off_t size  = static_cast<off_t>(offset - wr->dropped);
+
+	sync_file_range(wr->fd, start, size,
+		SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+			| SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(wr->fd, start, size, POSIX_FADV_DONTNEED);
+
+	wr->dropped = offset;
+#else
+	(void)wr;
+	(void)offset;
+	(void)len;
+#endif
+}
+
+static bool prv_is_zero(const char* ptr, size_t len)
+{
+	// every byte equals the next one, and the first one is zero
+	return !ptr[0] && !memcmp(ptr, ptr + 1, len - 1);
+}
+
+static int32_t prv_write_all(LocalWriter_t* wr, const char* ptr, size_t left)
+{
+	while (left) {
+		auto nwritten = ::write(wr->fd, ptr, static_cast<unsigned int>(left));
+
+		if (nwritten < 0 && errno == EINTR) continue;
+		if (nwritten <= 0) return errno ? errno : EIO;
+
+		ptr += nwritten;
+		left -= static_cast<size_t>(nwritten);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief write buffer, skipping zero blocks of sparse mode. Skipped blocks
+ * are beyond the end of file, they are left as holes.
+ * */
+static int32_t prv_write_sparse(LocalWriter_t* wr)
+{
+	size_t start = 0;
+	size_t pos   = 0;
+
+	while (pos < wr->filled) {
+		size_t len = std::min<size_t>(SNOD_SPARSE_BLOCK, wr->filled - pos);
+
+		if (!prv_is_zero(wr->mem + pos, len)) {
+			pos += len;
+			continue;
+		}
+
+		int32_t rc = prv_write_all(wr, wr->mem + start, pos - start);
+		if (rc) return rc;
+
+		if (lseek(wr->fd, static_cast<int64_t>(len), SEEK_CUR) < 0) {
+			return errno;
+		}
+
+		pos += len;
+		start = pos;
+	}
+
+	return prv_write_all(wr, wr->mem + start, pos - start);
+}
+
+static int32_t prv_flush(LocalWriter_t* wr)
+{
+	if (!wr->filled) return 0;
+
+	if (wr->is_direct && wr->filled % SNOD_WRITE_ALIGN) prv_clear_direct(wr);
+
+	int32_t rc = wr->is_sparse ? prv_write_sparse(wr)
+							   : prv_write_all(wr, wr->mem, wr->filled);
+	if (rc) return rc;
+
+	prv_write_behind(wr, wr->offset, wr->filled);
+
+	wr->offset += wr->filled;
+	wr->filled = 0;
+
+	return 0;
+}
+
+static void prv_release(LocalWriter_t* wr)
+{
+	if (wr->fd >= 0) ::close(wr->fd);
+	if (wr->mem) SftpPool::put(wr->pool, wr->mem, wr->block);
+
+	wr->fd  = -1;
+	wr->mem = nullptr;
+}
+
+} // end of unnamed namespace for static function
+
+LocalWriter_s::~LocalWriter_s()
+{
+	prv_release(this);
+}
+
+int32_t SftpWriter::open(SftpWatch_t* ctx, LocalWriter_t* wr,
+	const std::string& path, uint64_t offset, uint64_t size)
+{
+	const SyncWriter_t* conf = &ctx->writer;
+
+	wr->conf      = conf;
+	wr->offset    = offset;
+	wr->is_sparse = ctx->sparse;
+	wr->block     = std::max<size_t>(
+		conf->block / SNOD_WRITE_ALIGN * SNOD_WRITE_ALIGN, SNOD_WRITE_ALIGN);
+
+	int flags = O_WRONLY | O_CREAT | SNOD_O_BINARY;
+	if (!offset) flags |= O_TRUNC;
+
+#if defined(O_DIRECT)
+	// appended tail starts at unaligned offset, it can't be written directly
+	wr->is_direct = conf->direct && offset % SNOD_WRITE_ALIGN == 0;
+
+	if (wr->is_direct) {
+		wr->fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+
+		// not supported by the file system, e.g. tmpfs
+		if (wr->fd < 0 && errno == EINVAL) wr->is_direct = false;
+	}
+#endif
+
+	if (wr->fd < 0) wr->fd = ::open(path.c_str(), flags, 0644);
+	if (wr->fd < 0) return errno;
+
+	// pool size is clamped to a multiple of the alignment as well
+	wr->pool = &ctx->blocks;
+	SftpPool::init(wr->pool, wr->block);
+	wr->mem = SftpPool::get(wr->pool, &wr->block);
+
+	if (!wr->mem) {
+		prv_release(wr);
+		return ENOMEM;
+	}
+
+	if (lseek(wr->fd, static_cast<int64_t>(offset), SEEK_SET) < 0) {
+		int32_t rc = errno;
+		prv_release(wr);
+		return rc;
+	}
+
+	wr->dropped = offset;
+
+#if defined(__linux__)
+	/*
+	 * Reserve extents without changing the size, so a failed transfer doesn't
+	 * leave zeros at the end. Unused space is released by truncation on close.
+	 * Skipped for sparse file, holes would be allocated too.
+	 * */
+	if (conf->preallocate && !wr->is_sparse && size > offset) {
+		fallocate(wr->fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset),
+			static_cast<off_t>(size - offset));
+	}
+#else
+	(void)size;
+#endif
+
+	return 0;
+}
+
+int32_t SftpWriter::write(LocalWriter_t* wr, const char* data, size_t len)
+{
+	while (len) {
+		size_t n = std::min(len, wr->block - wr->filled);
+
+		memcpy(wr->mem + wr->filled, data, n);
+		wr->filled += n;
+		data += n;
+		len -= n;
+
+		if (wr->filled < wr->block) break;
+
+		int32_t rc = prv_flush(wr);
+		if (rc) return rc;
+	}
+
+	return 0;
+}
+
+int32_t SftpWriter::close(SftpWatch_t* ctx, LocalWriter_t* wr)
+{
+	int32_t rc = prv_flush(wr);
+
+	// preallocated space and old content after the end. Extends trailing hole
+	if (!rc && ftruncate(wr->fd, static_cast<int64_t>(wr->offset))) rc = errno;
+
+	if (!rc) rc = SftpWriter::commit(ctx, wr->fd);
+
+#if defined(__linux__)
+	// wait for the last blocks as well, then drop them
+	if (!rc && wr->conf->drop_cache) {
+		if (ctx->writer.fsync != SNOD_FSYNC_FILE) fdatasync(wr->fd);
+		posix_fadvise(wr->fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+#endif
+
+	if (::close(wr->fd) && !rc) rc = errno;
+	wr->fd = -1;
+
+	prv_release(wr);
+
+	return rc;
+}
+
+int32_t SftpWriter::commit(SftpWatch_t* ctx, int fd)
+{
+	SyncWriter_t* conf = &ctx->writer;
+
+	if (conf->fsync == SNOD_FSYNC_FILE) return fsync(fd) ? errno : 0;
+	if (conf->fsync != SNOD_FSYNC_BATCH) return 0;
+
+#if defined(__linux__)
+	// a descriptor of each file system is enough for syncfs()
+	struct stat st;
+	struct stat other;
+
+	if (fstat(fd, &st)) return errno;
+
+	for (int kept : conf->unsynced) {
+		if (!fstat(kept, &other) && other.st_dev == st.st_dev) return 0;
+	}
+#endif
+
+	// too many open files, flush those at once
+	if (conf->unsynced.size() >= SNOD_FSYNC_BATCH_FILES) SftpWriter::sync(ctx);
+
+	int kept = dup(fd);
+
+	// can't be kept open, flush it now
+	if (kept < 0) return fsync(fd) ? errno : 0;
+
+	conf->unsynced.push_back(kept);
+
+	return 0;
+}
+
+void SftpWriter::sync(SftpWatch_t* ctx)
+{
+	for (int fd : ctx->writer.unsynced) {
+#if defined(__linux__)
+		// one flush of the whole file system, instead of each file
+		int rc = syncfs(fd);
+#else
+		int rc = fsync(fd);
+#endif
+
+		if (rc) LOG_ERR("Failed to sync local files [%d]\n", errno);
+
+		::close(fd);
+	}
+
+	ctx->writer.unsynced.clear();
+}
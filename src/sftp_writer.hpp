@@ -0,0 +1,96 @@
+#ifndef _SFTP_WRITER_HPP
+#define _SFTP_WRITER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "sftp_watch.hpp"
+
+/*
+ * Local writer of downloaded files. Received bytes are collected into large
+ * aligned writes instead of one buffered write per SFTP read.
+ *
+ * On Linux, the file is preallocated to the remote size to avoid fragmenting
+ * large files, and it can be written with O_DIRECT. With drop_cache, written
+ * blocks are pushed to disk behind the writer by sync_file_range(), then
+ * dropped from page cache, so downloads don't evict other cached data.
+ * Other platforms only get the large writes and the fsync policy.
+ *
+ * In sparse mode, zero blocks are skipped by seeking over them, and they are
+ * left as holes. SFTP can't tell where remote holes are, zeros are still
+ * transferred, only local disk space is saved.
+ * */
+
+/** zero blocks of this size are left as holes in sparse mode */
+#ifndef SNOD_SPARSE_BLOCK
+#	define SNOD_SPARSE_BLOCK (64U * 1024U)
+#endif
+
+/** files kept open for batch fsync, more are flushed early */
+#ifndef SNOD_FSYNC_BATCH_FILES
+#	define SNOD_FSYNC_BATCH_FILES 256U
+#endif
+
+/** alignment of buffer, offset and length of O_DIRECT writes */
+#ifndef SNOD_WRITE_ALIGN
+#	define SNOD_WRITE_ALIGN 4096U
+#endif
+
+typedef struct LocalWriter_s LocalWriter_t;
+
+struct LocalWriter_s {
+	int      fd        = -1;
+	char*    mem       = nullptr; /**< aligned buffer of #block bytes */
+	size_t   block     = 0;
+	size_t   filled    = 0;
+	uint64_t offset    = 0; /**< file offset of the buffer */
+	uint64_t dropped   = 0; /**< pages before this are dropped from cache */
+	bool     is_direct = false;
+	bool     is_sparse = false; /**< zero blocks are skipped */
+
+	const SyncWriter_t* conf = nullptr;
+	BufPool_t*          pool = nullptr; /**< #mem is taken from this pool */
+
+	LocalWriter_s() { }
+	LocalWriter_s(const LocalWriter_s&)            = delete;
+	LocalWriter_s& operator=(const LocalWriter_s&) = delete;
+
+	~LocalWriter_s();
+};
+
+namespace SftpWriter {
+
+/**
+ * @brief open local file for writing from the offset, the content after the
+ * offset is replaced.
+ * @param size expected final size, used to preallocate the file
+ * @return 0 on success, otherwise errno
+ * */
+int32_t open(SftpWatch_t* ctx, LocalWriter_t* wr, const std::string& path,
+	uint64_t offset, uint64_t size);
+
+/** @return 0 on success, otherwise errno */
+int32_t write(LocalWriter_t* wr, const char* data, size_t len);
+
+/**
+ * @brief write remaining bytes, cut the file at the written end and close it.
+ * Flushed to disk as the fsync policy says.
+ * @return 0 on success, otherwise errno
+ * */
+int32_t close(SftpWatch_t* ctx, LocalWriter_t* wr);
+
+/**
+ * @brief flush a written file as the fsync policy says, at once or by the
+ * next sync(). For files written without #LocalWriter_t, before they're
+ * closed.
+ * @return 0 on success, otherwise errno
+ * */
+int32_t commit(SftpWatch_t* ctx, int fd);
+
+/** flush files left for batch fsync, see #SNOD_FSYNC_BATCH */
+void sync(SftpWatch_t* ctx);
+
+}
+
+#endif
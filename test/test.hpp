@@ -0,0 +1,25 @@
+#ifndef _SNOD_TEST_HPP
+#define _SNOD_TEST_HPP
+
+#include <cstdint>
+#include <cstdio>
+
+/*
+ * Minimal checks of the unit tests, without exceptions. Failed checks are
+ * printed and counted, and the test returns non zero, so ctest reports it.
+ * */
+
+static int32_t test_failed = 0;
+
+#define SNOD_CHECK(cond)                                                       \
+	do {                                                                       \
+		if (cond) break;                                                       \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,      \
+			#cond);                                                            \
+		test_failed++;                                                         \
+	} while (0)
+
+#define SNOD_TEST_RESULT()                                                     \
+	(fprintf(stderr, "%d check(s) failed\n", test_failed), test_failed ? 1 : 0)
+
+#endif
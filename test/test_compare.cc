@@ -0,0 +1,164 @@
+#include <cstdio>
+#include <string>
+
+#include "sftp_compare.hpp"
+#include "sftp_hash.hpp"
+#include "test.hpp"
+
+#define TEST_CACHE "test_compare.cache"
+
+namespace { // start of unnamed namespace for static function
+
+static SftpWatch_t* prv_create()
+{
+	Directory_t remote;
+	Directory_t local;
+
+	remote.path = "/remote";
+	local.path  = "/local";
+
+	SftpWatch_t* ctx = new SftpWatch_t(
+		"", "", "", "", "", remote, local, NULL, NULL, NULL);
+
+	ctx->hash_cache.path = TEST_CACHE;
+
+	return ctx;
+}
+
+static void prv_write(const std::string& content)
+{
+	FILE* fd = fopen(TEST_CACHE, "wb");
+	if (!fd) return;
+
+	fwrite(content.data(), 1, content.size(), fd);
+	fclose(fd);
+}
+
+/** add file to a snapshot, so its entry is kept when the cache is saved */
+static void prv_snap(DirSnapshot_t* snap, const std::string& name)
+{
+	DirItem_t item;
+
+	item.type = IS_REG_FILE;
+	item.name = name;
+
+	(*snap)[""][name] = item;
+}
+
+static void test_load()
+{
+	std::string hash_a = SftpHash::buffer("a", 1);
+	std::string hash_b = SftpHash::buffer("b", 1);
+
+	prv_write(hash_a + " 10 1700000000 500 42 L/local" SNOD_SEP "a b\n"
+		+ hash_b + " 20 1700000001 0 0 R/remote" SNOD_SEP "dir" SNOD_SEP "b\n"
+		+ "not a hash 1 2 3 4 L/local" SNOD_SEP "c\n"
+		+ hash_a + " 1 2 3 4\n"  // no key
+		+ hash_a + " 1 2 3 4 \n" // empty key
+		+ "\n"
+		+ hash_b + " 5 6 7 8 L/local" SNOD_SEP "last"); // no newline
+
+	SftpWatch_t* ctx = prv_create();
+	SftpCompare::load(ctx);
+
+	auto& entries = ctx->hash_cache.entries;
+
+	SNOD_CHECK(ctx->hash_cache.is_loaded);
+	SNOD_CHECK(!ctx->hash_cache.is_dirty);
+	SNOD_CHECK(entries.size() == 3);
+
+	auto it = entries.find("L/local" SNOD_SEP "a b");
+	SNOD_CHECK(it != entries.end());
+
+	if (it != entries.end()) {
+		SNOD_CHECK(it->second.hash == hash_a);
+		SNOD_CHECK(it->second.size == 10);
+		SNOD_CHECK(it->second.mtime == 1700000000);
+		SNOD_CHECK(it->second.mtime_nsec == 500);
+		SNOD_CHECK(it->second.ino == 42);
+	}
+
+	SNOD_CHECK(entries.contains("R/remote" SNOD_SEP "dir" SNOD_SEP "b"));
+	SNOD_CHECK(entries.contains("L/local" SNOD_SEP "last"));
+
+	// loaded only once
+	prv_write("");
+	SftpCompare::load(ctx);
+	SNOD_CHECK(entries.size() == 3);
+
+	delete ctx;
+}
+
+static void test_save()
+{
+	std::string hash_a = SftpHash::buffer("a", 1);
+
+	SftpWatch_t* ctx   = prv_create();
+	HashCache_t* cache = &ctx->hash_cache;
+
+	cache->is_loaded = true;
+
+	HashEntry_t entry;
+	entry.size       = 123;
+	entry.mtime      = 1700000000;
+	entry.mtime_nsec = 999999999;
+	entry.ino        = 7;
+	entry.hash       = hash_a;
+
+	cache->entries["L/local" SNOD_SEP "kept file"] = entry;
+	cache->entries["R/remote" SNOD_SEP "dir/kept"] = entry;
+	cache->entries["L/local" SNOD_SEP "gone"]      = entry;
+	cache->entries["L/local" SNOD_SEP "new\nline"] = entry;
+	cache->entries["R/local" SNOD_SEP "kept file"] = entry;
+
+	prv_snap(&ctx->root->local_snap, "kept file");
+	prv_snap(&ctx->root->local_snap, "new\nline");
+	prv_snap(&ctx->root->remote_snap, "dir/kept");
+
+	// nothing changed, file isn't written
+	prv_write("");
+	SftpCompare::save(ctx);
+	SNOD_CHECK(cache->entries.size() == 5);
+
+	cache->is_dirty = true;
+	SftpCompare::save(ctx);
+	SNOD_CHECK(!cache->is_dirty);
+
+	// entries of files in none of the snapshots are pruned
+	SNOD_CHECK(cache->entries.size() == 3);
+
+	SftpWatch_t* other = prv_create();
+	SftpCompare::load(other);
+
+	auto& entries = other->hash_cache.entries;
+
+	// key with new line can't be kept in the file
+	SNOD_CHECK(entries.size() == 2);
+	SNOD_CHECK(entries.contains("R/remote" SNOD_SEP "dir/kept"));
+
+	auto it = entries.find("L/local" SNOD_SEP "kept file");
+	SNOD_CHECK(it != entries.end());
+
+	if (it != entries.end()) {
+		SNOD_CHECK(it->second.hash == hash_a);
+		SNOD_CHECK(it->second.size == 123);
+		SNOD_CHECK(it->second.mtime == 1700000000);
+		SNOD_CHECK(it->second.mtime_nsec == 999999999);
+		SNOD_CHECK(it->second.ino == 7);
+	}
+
+	delete other;
+	delete ctx;
+}
+
+} // end of unnamed namespace for static function
+
+int main()
+{
+	test_load();
+	test_save();
+
+	remove(TEST_CACHE);
+
+	return SNOD_TEST_RESULT();
+}
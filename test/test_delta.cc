@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "sftp_delta.hpp"
+#include "sftp_hash.hpp"
+#include "test.hpp"
+
+#define TEST_BLOCK 1000U
+
+namespace { // start of unnamed namespace for static function
+
+/** output of the hash command, a sha256sum line for each block */
+static std::string prv_hash_output(const std::string& data)
+{
+	std::string out;
+
+	for (size_t off = 0; off < data.size(); off += TEST_BLOCK) {
+		std::string block = data.substr(off, TEST_BLOCK);
+		out += SftpHash::buffer(block.data(), block.size()) + "  -\n";
+	}
+
+	return out;
+}
+
+static void test_known_digest()
+{
+	SNOD_CHECK(SftpHash::buffer("abc", 3)
+		== "ba7816bf8f01cfea414140de5dae2223"
+		   "b00361a396177a9cb410ff61f20015ad");
+	SNOD_CHECK(SftpHash::buffer("", 0)
+		== "e3b0c44298fc1c149afbf4c8996fb924"
+		   "27ae41e4649b934ca495991b7852b855");
+}
+
+static void test_parse()
+{
+	std::string data;
+	for (size_t i = 0; i < TEST_BLOCK * 3 + 10; i++) {
+		data += static_cast<char>('a' + i % 26);
+	}
+
+	std::vector<std::string> hashes;
+
+	SNOD_CHECK(SftpDelta::parse_hashes(prv_hash_output(data), &hashes) == 0);
+	SNOD_CHECK(hashes.size() == 4);
+
+	for (size_t i = 0; i < hashes.size(); i++) {
+		std::string block = data.substr(i * TEST_BLOCK, TEST_BLOCK);
+		SNOD_CHECK(hashes[i] == SftpHash::buffer(block.data(), block.size()));
+	}
+
+	// uppercase digest, no file name, blank lines and missing last newline
+	std::string digest = SftpHash::buffer("abc", 3);
+	std::string upper  = digest;
+	for (char& c : upper) c = static_cast<char>(toupper(c));
+
+	hashes.clear();
+	SNOD_CHECK(SftpDelta::parse_hashes("\n" + upper + "\n\n" + digest + "  -",
+				   &hashes)
+		== 0);
+	SNOD_CHECK(hashes.size() == 2);
+	SNOD_CHECK(hashes.size() == 2 && hashes[0] == digest);
+	SNOD_CHECK(hashes.size() == 2 && hashes[1] == digest);
+
+	// empty file has no blocks
+	hashes.clear();
+	SNOD_CHECK(SftpDelta::parse_hashes("", &hashes) == 0);
+	SNOD_CHECK(hashes.empty());
+}
+
+static void test_invalid()
+{
+	std::vector<std::string> hashes;
+	std::string              digest = SftpHash::buffer("abc", 3);
+
+	SNOD_CHECK(SftpDelta::parse_hashes("split: no such file\n", &hashes)
+		== -1);
+	SNOD_CHECK(
+		SftpDelta::parse_hashes(digest.substr(0, 63) + "\n", &hashes) == -1);
+	SNOD_CHECK(SftpDelta::parse_hashes(
+				   digest + "\n" + std::string(64, 'g') + "\n", &hashes)
+		== -1);
+}
+
+static void test_file_range()
+{
+	std::string data(TEST_BLOCK * 2 + 100, '\0');
+	for (size_t i = TEST_BLOCK; i < data.size(); i++) {
+		data[i] = static_cast<char>(i);
+	}
+
+	FILE* fd = tmpfile();
+	SNOD_CHECK(fd);
+	if (!fd) return;
+
+	fwrite(data.data(), 1, data.size(), fd);
+	fflush(fd);
+
+	std::vector<std::string> hashes;
+	SftpDelta::parse_hashes(prv_hash_output(data), &hashes);
+	SNOD_CHECK(hashes.size() == 3);
+
+	// local blocks hash the same as remote ones, last block is shorter
+	for (size_t i = 0; i < hashes.size(); i++) {
+		uint64_t off = i * TEST_BLOCK;
+		uint64_t len = std::min<uint64_t>(TEST_BLOCK, data.size() - off);
+		SNOD_CHECK(SftpHash::file(fd, off, len) == hashes[i]);
+	}
+
+	// zero block, as a hole of sparse file is read
+	Hash_t hash;
+	SNOD_CHECK(SftpHash::init(&hash) == 0);
+	SNOD_CHECK(SftpHash::update_zeros(&hash, TEST_BLOCK) == 0);
+	SNOD_CHECK(hashes.size() == 3 && SftpHash::finish(&hash) == hashes[0]);
+
+	fclose(fd);
+}
+
+} // end of unnamed namespace for static function
+
+int main()
+{
+	test_known_digest();
+	test_parse();
+	test_invalid();
+	test_file_range();
+
+	return SNOD_TEST_RESULT();
+}
@@ -0,0 +1,119 @@
+#include <cstdint>
+
+#include "sftp_pool.hpp"
+#include "test.hpp"
+
+namespace { // start of unnamed namespace for static function
+
+static bool prv_is_aligned(char* mem)
+{
+	return reinterpret_cast<uintptr_t>(mem) % SNOD_POOL_ALIGN == 0;
+}
+
+static void test_reuse()
+{
+	BufPool_t pool;
+	size_t    size_a = 0;
+	size_t    size_b = 0;
+
+	char* mem_a = SftpPool::get(&pool, &size_a);
+	char* mem_b = SftpPool::get(&pool, &size_b);
+
+	SNOD_CHECK(mem_a && mem_b && mem_a != mem_b);
+	SNOD_CHECK(size_a == SFTP_READ_BUFFER_SIZE);
+	SNOD_CHECK(size_b == SFTP_READ_BUFFER_SIZE);
+	SNOD_CHECK(prv_is_aligned(mem_a) && prv_is_aligned(mem_b));
+	SNOD_CHECK(pool.count == 2);
+
+	SftpPool::put(&pool, mem_a, size_a);
+	SNOD_CHECK(pool.idle.size() == 1);
+
+	// idle buffer is taken instead of a new allocation
+	size_t size_c = 0;
+	char*  mem_c  = SftpPool::get(&pool, &size_c);
+
+	SNOD_CHECK(mem_c == mem_a);
+	SNOD_CHECK(pool.count == 2);
+	SNOD_CHECK(pool.idle.empty());
+
+	SftpPool::put(&pool, mem_b, size_b);
+	SftpPool::put(&pool, mem_c, size_c);
+	SNOD_CHECK(pool.idle.size() == 2);
+	SNOD_CHECK(pool.count == 2);
+}
+
+static void test_resize()
+{
+	BufPool_t pool;
+	size_t    size_busy = 0;
+	size_t    size_idle = 0;
+
+	char* busy = SftpPool::get(&pool, &size_busy);
+	char* idle = SftpPool::get(&pool, &size_idle);
+
+	SftpPool::put(&pool, idle, size_idle);
+	SNOD_CHECK(pool.count == 2);
+
+	// idle buffers of the old size are released at once
+	SftpPool::init(&pool, 65536);
+	SNOD_CHECK(pool.size == 65536);
+	SNOD_CHECK(pool.idle.empty());
+	SNOD_CHECK(pool.count == 1);
+
+	size_t size_new = 0;
+	char*  mem_new  = SftpPool::get(&pool, &size_new);
+
+	SNOD_CHECK(mem_new && size_new == 65536);
+	SNOD_CHECK(pool.count == 2);
+
+	// busy buffer of the old size is released when it's put back
+	SftpPool::put(&pool, busy, size_busy);
+	SNOD_CHECK(pool.idle.empty());
+	SNOD_CHECK(pool.count == 1);
+
+	SftpPool::put(&pool, mem_new, size_new);
+	SNOD_CHECK(pool.idle.size() == 1);
+	SNOD_CHECK(pool.count == 1);
+
+	// same size keeps idle buffers
+	SftpPool::init(&pool, 65536);
+	SNOD_CHECK(pool.idle.size() == 1);
+}
+
+static void test_clamp()
+{
+	BufPool_t pool;
+
+	SftpPool::init(&pool, 1);
+	SNOD_CHECK(pool.size == SNOD_POOL_MIN_SIZE);
+
+	SftpPool::init(&pool, SIZE_MAX);
+	SNOD_CHECK(pool.size == SNOD_POOL_MAX_SIZE);
+}
+
+static void test_scoped()
+{
+	BufPool_t pool;
+
+	{
+		SftpPool::PoolBuf_t buf(&pool);
+
+		SNOD_CHECK(buf.mem && buf.size == pool.size);
+		SNOD_CHECK(pool.idle.empty());
+	}
+
+	SNOD_CHECK(pool.idle.size() == 1);
+	SNOD_CHECK(pool.count == 1);
+}
+
+} // end of unnamed namespace for static function
+
+int main()
+{
+	test_reuse();
+	test_resize();
+	test_clamp();
+	test_scoped();
+
+	return SNOD_TEST_RESULT();
+}
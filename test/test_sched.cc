@@ -0,0 +1,85 @@
+#include <string>
+
+#include "sftp_sched.hpp"
+#include "test.hpp"
+
+namespace { // start of unnamed namespace for static function
+
+/** write patterns and paths with '/', converted to the platform separator */
+static std::string prv_sep(std::string str)
+{
+	for (char& c : str) {
+		if (c == '/') c = SNOD_SEP_CHAR;
+	}
+
+	return str;
+}
+
+static bool prv_match(const char* pattern, const char* path)
+{
+	return SftpSched::match(prv_sep(pattern), prv_sep(path));
+}
+
+static void test_base_name()
+{
+	// pattern without separator only matches base name
+	SNOD_CHECK(prv_match("*.log", "app.log"));
+	SNOD_CHECK(prv_match("*.log", "var/log/app.log"));
+	SNOD_CHECK(prv_match("app.???", "dir/app.log"));
+	SNOD_CHECK(prv_match("*", "dir/file"));
+
+	SNOD_CHECK(!prv_match("*.log", "app.log.1"));
+	SNOD_CHECK(!prv_match("*.log", "app.log/file"));
+	SNOD_CHECK(!prv_match("app.??", "app.log"));
+	SNOD_CHECK(!prv_match("app", "dir/app/file"));
+}
+
+static void test_single_star()
+{
+	SNOD_CHECK(prv_match("dir/*.log", "dir/app.log"));
+	SNOD_CHECK(prv_match("dir/*", "dir/"));
+	SNOD_CHECK(prv_match("*/app.log", "dir/app.log"));
+	SNOD_CHECK(prv_match("a*b*c", "dir/abc"));
+	SNOD_CHECK(prv_match("a*b*c", "dir/aXbYc"));
+
+	// '*' and '?' don't match separator
+	SNOD_CHECK(!prv_match("dir/*.log", "dir/sub/app.log"));
+	SNOD_CHECK(!prv_match("dir?app.log", "dir/app.log"));
+	SNOD_CHECK(!prv_match("dir/*.log", "other/app.log"));
+}
+
+static void test_double_star()
+{
+	// '**/' matches any number of directories, including none
+	SNOD_CHECK(prv_match("**/*.log", "app.log"));
+	SNOD_CHECK(prv_match("**/*.log", "dir/app.log"));
+	SNOD_CHECK(prv_match("**/*.log", "a/b/c/app.log"));
+	SNOD_CHECK(prv_match("dir/**/app.log", "dir/app.log"));
+	SNOD_CHECK(prv_match("dir/**/app.log", "dir/a/b/app.log"));
+	SNOD_CHECK(prv_match("dir/**", "dir/a/b/app.log"));
+
+	// only whole directories
+	SNOD_CHECK(!prv_match("dir/**/app.log", "dir/xapp.log"));
+	SNOD_CHECK(!prv_match("dir/**/app.log", "dirx/app.log"));
+	SNOD_CHECK(!prv_match("**/*.log", "dir/app.txt"));
+}
+
+static void test_empty()
+{
+	SNOD_CHECK(prv_match("", ""));
+	SNOD_CHECK(prv_match("*", ""));
+	SNOD_CHECK(!prv_match("", "file"));
+	SNOD_CHECK(!prv_match("?", ""));
+}
+
+} // end of unnamed namespace for static function
+
+int main()
+{
+	test_base_name();
+	test_single_star();
+	test_double_star();
+	test_empty();
+
+	return SNOD_TEST_RESULT();
+}
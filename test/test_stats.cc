@@ -0,0 +1,95 @@
+#include <cstdint>
+
+#include "sftp_stats.hpp"
+#include "test.hpp"
+
+namespace { // start of unnamed namespace for static function
+
+static void test_exact_values()
+{
+	LatHist_t hist;
+
+	// values below SNOD_HIST_SUB_COUNT have a bucket each
+	for (uint64_t i = 0; i < SNOD_HIST_SUB_COUNT; i++) {
+		SftpStats::record(&hist, i);
+	}
+
+	SNOD_CHECK(hist.count == SNOD_HIST_SUB_COUNT);
+	SNOD_CHECK(hist.min == 0);
+	SNOD_CHECK(hist.max == SNOD_HIST_SUB_COUNT - 1);
+
+	for (uint64_t i = 0; i < SNOD_HIST_SUB_COUNT; i++) {
+		SNOD_CHECK(SftpStats::percentile(&hist, (i + 1) * 100.0
+					   / SNOD_HIST_SUB_COUNT)
+			== i);
+	}
+}
+
+static void test_relative_error()
+{
+	const uint64_t values[] = { 32, 33, 47, 48, 63, 64, 65, 100, 1000, 4095,
+		4096, 123456789, (1ULL << 39) + 1 };
+
+	for (uint64_t value : values) {
+		LatHist_t hist;
+
+		// the larger one is max, so the first bucket isn't clamped to max
+		SftpStats::record(&hist, value);
+		SftpStats::record(&hist, value * 4);
+
+		uint64_t res = SftpStats::percentile(&hist, 50.0);
+
+		SNOD_CHECK(res >= value);
+		SNOD_CHECK(res - value < value / SNOD_HIST_HALF_COUNT + 1);
+	}
+}
+
+static void test_clamp_and_reset()
+{
+	LatHist_t hist;
+
+	SNOD_CHECK(SftpStats::percentile(&hist, 50.0) == 0);
+
+	SftpStats::record(&hist, 1ULL << 50);
+	SNOD_CHECK(hist.max == (1ULL << SNOD_HIST_MAX_BITS) - 1);
+	SNOD_CHECK(SftpStats::percentile(&hist, 100.0) == hist.max);
+
+	// single value is reported exactly, bucket is clamped to max
+	SftpStats::reset(&hist);
+	SftpStats::record(&hist, 1000);
+	SNOD_CHECK(hist.count == 1);
+	SNOD_CHECK(hist.sum == 1000);
+	SNOD_CHECK(SftpStats::percentile(&hist, 0.0) == 1000);
+	SNOD_CHECK(SftpStats::percentile(&hist, 99.9) == 1000);
+
+	SftpStats::reset(&hist);
+	SNOD_CHECK(hist.count == 0);
+	SNOD_CHECK(hist.min == UINT64_MAX);
+	SNOD_CHECK(SftpStats::percentile(&hist, 50.0) == 0);
+}
+
+static void test_percentile_rank()
+{
+	LatHist_t hist;
+
+	for (uint64_t i = 1; i <= 100; i++) SftpStats::record(&hist, i * 1000);
+
+	uint64_t p50 = SftpStats::percentile(&hist, 50.0);
+	uint64_t p99 = SftpStats::percentile(&hist, 99.0);
+
+	SNOD_CHECK(p50 >= 50000 && p50 < 50000 + 50000 / SNOD_HIST_HALF_COUNT);
+	SNOD_CHECK(p99 >= 99000 && p99 <= 100000);
+	SNOD_CHECK(SftpStats::percentile(&hist, 100.0) == 100000);
+}
+
+} // end of unnamed namespace for static function
+
+int main()
+{
+	test_exact_values();
+	test_relative_error();
+	test_clamp_and_reset();
+	test_percentile_rank();
+
+	return SNOD_TEST_RESULT();
+}
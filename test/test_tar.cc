@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "sftp_tar.hpp"
+#include "test.hpp"
+
+namespace { // start of unnamed namespace for static function
+
+typedef struct Read_s {
+	std::vector<TarEntry_t>  entries;
+	std::vector<std::string> contents;
+	int32_t                  ends  = 0;
+	int32_t                  abort = 0; /**< returned on begin, if set */
+} Read_t;
+
+static int32_t prv_entry_cb(
+	void* user, uint8_t evt, TarEntry_t* entry, const char* data, size_t len)
+{
+	Read_t* rd = static_cast<Read_t*>(user);
+
+	switch (evt) {
+
+	case TAR_EVT_BEGIN: {
+		if (rd->abort) return rd->abort;
+
+		rd->entries.push_back(*entry);
+		rd->contents.push_back("");
+	} break;
+
+	case TAR_EVT_DATA: {
+		rd->contents.back().append(data, len);
+	} break;
+
+	case TAR_EVT_END: {
+		rd->ends++;
+	} break;
+	}
+
+	return 0;
+}
+
+static std::string prv_entry(const std::string& name, const std::string& data)
+{
+	std::string res = SftpTar::header(name, data.size(), 0644, 1700000000);
+
+	res += data;
+	res += std::string(SftpTar::padding(data.size()), '\0');
+
+	return res;
+}
+
+/** feed the archive in chunks of given size */
+static int32_t prv_read(const std::string& tar, size_t chunk, Read_t* res)
+{
+	TarReader_t reader;
+	int32_t     rc = 0;
+
+	for (size_t i = 0; i < tar.size() && !rc; i += chunk) {
+		size_t n = std::min(chunk, tar.size() - i);
+		rc       = SftpTar::feed(&reader, tar.data() + i, n, prv_entry_cb, res);
+	}
+
+	if (!rc && !reader.is_end) return -2;
+
+	return rc;
+}
+
+static void test_padding()
+{
+	SNOD_CHECK(SftpTar::padding(0) == 0);
+	SNOD_CHECK(SftpTar::padding(1) == SNOD_TAR_BLOCK - 1);
+	SNOD_CHECK(SftpTar::padding(SNOD_TAR_BLOCK) == 0);
+	SNOD_CHECK(SftpTar::padding(SNOD_TAR_BLOCK + 10) == SNOD_TAR_BLOCK - 10);
+	SNOD_CHECK(SftpTar::trailer().size() == 2 * SNOD_TAR_BLOCK);
+}
+
+static void test_round_trip()
+{
+	std::string long_dir(120, 'd');
+	std::string long_name(150, 'n');
+
+	const std::string names[] = {
+		"empty",
+		"dir/file.txt",
+		long_dir + "/file.txt", // split into prefix and name
+		long_name,              // GNU long name
+		"last",
+	};
+	const std::string data[] = {
+		"",
+		"hello",
+		std::string(SNOD_TAR_BLOCK, 'x'),
+		std::string(SNOD_TAR_BLOCK * 3 + 7, 'y'),
+		"tail",
+	};
+
+	std::string tar;
+	for (size_t i = 0; i < 5; i++) tar += prv_entry(names[i], data[i]);
+	tar += SftpTar::trailer();
+
+	SNOD_CHECK(tar.size() % SNOD_TAR_BLOCK == 0);
+
+	const size_t chunks[] = { 1, 7, SNOD_TAR_BLOCK, tar.size() };
+
+	for (size_t chunk : chunks) {
+		Read_t res;
+
+		SNOD_CHECK(prv_read(tar, chunk, &res) == 0);
+		SNOD_CHECK(res.entries.size() == 5);
+		SNOD_CHECK(res.ends == 5);
+		if (res.entries.size() != 5) continue;
+
+		for (size_t i = 0; i < 5; i++) {
+			SNOD_CHECK(res.entries[i].name == names[i]);
+			SNOD_CHECK(res.entries[i].size == data[i].size());
+			SNOD_CHECK(res.entries[i].mode == 0644);
+			SNOD_CHECK(res.entries[i].mtime == 1700000000);
+			SNOD_CHECK(res.contents[i] == data[i]);
+		}
+	}
+}
+
+/** change type of the header and fix its checksum */
+static void prv_set_type(std::string* block, char type)
+{
+	uint32_t sum = 0;
+
+	(*block)[156] = type;
+	memset(&(*block)[148], ' ', 8);
+
+	for (size_t i = 0; i < SNOD_TAR_BLOCK; i++) {
+		sum += static_cast<unsigned char>((*block)[i]);
+	}
+
+	snprintf(&(*block)[148], 8, "%06o", sum);
+}
+
+static void test_pax_and_skip()
+{
+	std::string name(180, 'p');
+	std::string record = " path=" + name + "\n";
+	std::string len    = std::to_string(record.size() + 3);
+	std::string pax    = len + record;
+
+	// pax record length includes its own digits
+	SNOD_CHECK(pax.size() == strtoul(len.c_str(), NULL, 10));
+
+	std::string header = SftpTar::header("PaxHeader", pax.size(), 0644, 0);
+	prv_set_type(&header, 'x');
+
+	std::string dir = SftpTar::header("dir", 0, 0755, 0);
+	prv_set_type(&dir, '5');
+
+	std::string tar = dir + header + pax
+		+ std::string(SftpTar::padding(pax.size()), '\0')
+		+ prv_entry("short", "content") + SftpTar::trailer();
+
+	Read_t res;
+
+	SNOD_CHECK(prv_read(tar, 13, &res) == 0);
+	SNOD_CHECK(res.entries.size() == 1);
+	if (res.entries.size() != 1) return;
+
+	// directory is skipped, name from pax applies to the next entry
+	SNOD_CHECK(res.entries[0].name == name);
+	SNOD_CHECK(res.contents[0] == "content");
+}
+
+static void test_invalid()
+{
+	std::string tar = prv_entry("file", "data") + SftpTar::trailer();
+
+	// broken checksum
+	std::string broken = tar;
+	broken[0]          = 'F';
+
+	Read_t res;
+	SNOD_CHECK(prv_read(broken, SNOD_TAR_BLOCK, &res) == -1);
+	SNOD_CHECK(res.entries.empty());
+
+	// callback value is returned
+	Read_t aborted;
+	aborted.abort = 5;
+	SNOD_CHECK(prv_read(tar, 100, &aborted) == 5);
+
+	// truncated archive has no end
+	Read_t truncated;
+	SNOD_CHECK(prv_read(tar.substr(0, SNOD_TAR_BLOCK), 100, &truncated) == -2);
+}
+
+} // end of unnamed namespace for static function
+
+int main()
+{
+	test_padding();
+	test_round_trip();
+	test_pax_and_skip();
+	test_invalid();
+
+	return SNOD_TEST_RESULT();
+}
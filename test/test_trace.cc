@@ -0,0 +1,76 @@
+#include <string>
+
+#include "sftp_trace.hpp"
+#include "test.hpp"
+
+namespace { // start of unnamed namespace for static function
+
+static void test_ring()
+{
+	TraceBuf_t  buf;
+	std::string path = "dir/\"quoted\"\n";
+
+	// disabled trace records nothing
+	{
+		SftpTrace::TraceScope_t scope(&buf, "phase", "scan");
+	}
+
+	SNOD_CHECK(buf.count == 0);
+
+	SftpTrace::enable(&buf, true, 2);
+	SftpTrace::record(&buf, "phase", "first", nullptr, 10, 20);
+	SftpTrace::record(&buf, "phase", "second", nullptr, 20, 30);
+	SftpTrace::record(&buf, "file", "third", &path, 30, 45);
+
+	// the oldest span is overwritten
+	SNOD_CHECK(buf.count == 2);
+
+	std::string json = SftpTrace::dump(&buf, true);
+
+	SNOD_CHECK(json.find("\"first\"") == std::string::npos);
+	SNOD_CHECK(json.find("\"name\":\"second\"") != std::string::npos);
+	SNOD_CHECK(json.find("\"ts\":30,\"dur\":15") != std::string::npos);
+	SNOD_CHECK(json.find("dir/\\\"quoted\\\"\\n") != std::string::npos);
+	SNOD_CHECK(json.find("second") < json.find("third"));
+
+	// cleared by the dump
+	SNOD_CHECK(buf.count == 0);
+	SNOD_CHECK(SftpTrace::dump(&buf, false)
+		== "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[]}");
+}
+
+static void test_tid()
+{
+	TraceBuf_t buf_a;
+	TraceBuf_t buf_b;
+
+	SftpTrace::enable(&buf_a, true, 4);
+	SftpTrace::enable(&buf_b, true, 4);
+
+	// each instance has its own id, kept while it's enabled again
+	SNOD_CHECK(buf_a.tid && buf_b.tid && buf_a.tid != buf_b.tid);
+
+	uint32_t tid = buf_a.tid;
+
+	SftpTrace::enable(&buf_a, false, 0);
+	SftpTrace::enable(&buf_a, true, 8);
+	SNOD_CHECK(buf_a.tid == tid);
+
+	SftpTrace::record(&buf_a, "phase", "cycle", nullptr, 1, 2);
+	SNOD_CHECK(buf_a.events[0].tid == tid);
+
+	std::string json = SftpTrace::dump(&buf_a, false);
+	std::string key  = "\"tid\":" + std::to_string(tid) + ",";
+
+	SNOD_CHECK(json.find(key) != std::string::npos);
+}
+
+} // end of unnamed namespace for static function
+
+int main()
+{
+	test_ring();
+	test_tid();
+
+	return SNOD_TEST_RESULT();
+}
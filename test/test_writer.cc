@@ -0,0 +1,121 @@
+#include <cstdio>
+#include <string>
+
+#include "sftp_writer.hpp"
+#include "test.hpp"
+
+#define TEST_FILE_A "test_writer_a.bin"
+#define TEST_FILE_B "test_writer_b.bin"
+
+namespace { // start of unnamed namespace for static function
+
+static SftpWatch_t* prv_create(uint8_t fsync)
+{
+	Directory_t remote;
+	Directory_t local;
+
+	SftpWatch_t* ctx = new SftpWatch_t(
+		"", "", "", "", "", remote, local, NULL, NULL, NULL);
+
+	ctx->writer.fsync = fsync;
+
+	return ctx;
+}
+
+static int32_t prv_download(
+	SftpWatch_t* ctx, const char* path, const std::string& data)
+{
+	LocalWriter_t wr;
+
+	int32_t rc = SftpWriter::open(ctx, &wr, path, 0, data.size());
+	if (rc) return rc;
+
+	rc = SftpWriter::write(&wr, data.data(), data.size());
+	if (rc) return rc;
+
+	return SftpWriter::close(ctx, &wr);
+}
+
+static std::string prv_read(const char* path)
+{
+	std::string res;
+	char        mem[4096];
+	size_t      nread;
+
+	FILE* fd = fopen(path, "rb");
+	if (!fd) return res;
+
+	while ((nread = fread(mem, 1, sizeof(mem), fd)) > 0) res.append(mem, nread);
+	fclose(fd);
+
+	return res;
+}
+
+static void test_content()
+{
+	SftpWatch_t* ctx  = prv_create(SNOD_FSYNC_NONE);
+	std::string  data = std::string(ctx->writer.block * 2 + 10, 'x');
+
+	SNOD_CHECK(prv_download(ctx, TEST_FILE_A, data) == 0);
+	SNOD_CHECK(prv_read(TEST_FILE_A) == data);
+
+	// shorter content replaces the old one
+	SNOD_CHECK(prv_download(ctx, TEST_FILE_A, "short") == 0);
+	SNOD_CHECK(prv_read(TEST_FILE_A) == "short");
+	SNOD_CHECK(ctx->writer.unsynced.empty());
+
+	delete ctx;
+}
+
+static void test_fsync_policy()
+{
+	SftpWatch_t* ctx = prv_create(SNOD_FSYNC_FILE);
+
+	// flushed before it's closed, nothing is left
+	SNOD_CHECK(prv_download(ctx, TEST_FILE_A, "file") == 0);
+	SNOD_CHECK(ctx->writer.unsynced.empty());
+
+	ctx->writer.fsync = SNOD_FSYNC_BATCH;
+
+	SNOD_CHECK(prv_download(ctx, TEST_FILE_A, "batch a") == 0);
+	SNOD_CHECK(prv_download(ctx, TEST_FILE_B, "batch b") == 0);
+
+#if defined(__linux__)
+	// both files are on the same file system
+	SNOD_CHECK(ctx->writer.unsynced.size() == 1);
+#else
+	SNOD_CHECK(ctx->writer.unsynced.size() == 2);
+#endif
+
+	SftpWriter::sync(ctx);
+	SNOD_CHECK(ctx->writer.unsynced.empty());
+	SNOD_CHECK(prv_read(TEST_FILE_B) == "batch b");
+
+	// files written by other means follow the same policy
+	FILE* fd = fopen(TEST_FILE_B, "wb");
+	SNOD_CHECK(fd);
+
+	if (fd) {
+		SNOD_CHECK(SftpWriter::commit(ctx, fileno(fd)) == 0);
+		SNOD_CHECK(ctx->writer.unsynced.size() == 1);
+		fclose(fd);
+	}
+
+	SftpWriter::sync(ctx);
+	SNOD_CHECK(ctx->writer.unsynced.empty());
+
+	delete ctx;
+}
+
+} // end of unnamed namespace for static function
+
+int main()
+{
+	test_content();
+	test_fsync_policy();
+
+	remove(TEST_FILE_A);
+	remove(TEST_FILE_B);
+
+	return SNOD_TEST_RESULT();
+}